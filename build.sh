@@ -6,6 +6,7 @@ set -e
 # Note:  min-pagesize=0 is a work-around for a bug in GCC 12. Hopefully fixed in GCC 14?
 avr-gcc -Os -Wall -mcall-prologues -mmcu=atmega8 --param=min-pagesize=0 source/main.c -o main.obj
 avr-objcopy -R .eeprom -O ihex main.obj main.hex
+avr-objcopy -j .eeprom --change-section-lma .eeprom=0 -O ihex main.obj main.eep
 
 if [ "$1" = "write" ]
 then
@@ -22,4 +23,11 @@ then
     
     echo "Writing main.hex..."
     avrdude -p m8 -c avr910 -P ${TTY} -U flash:w:main.hex
+
+    # Songs converted with --eeprom keep part of their frame data in the EEPROM
+    if [ "$(wc -l < main.eep)" -gt 1 ]
+    then
+        echo "Writing main.eep..."
+        avrdude -p m8 -c avr910 -P ${TTY} -U eeprom:w:main.eep
+    fi
 fi
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+gcc source/vgm_profile.c \
+    -o vgm_profile
@@ -0,0 +1,24 @@
+#!/bin/sh
+
+# Exit on first error
+set -e
+
+# Given a header from vgm_convert, the firmware is built in
+# so that --embedded renders the converted song.
+if [ -n "$1" ]
+then
+    gcc -O3 -ffast-math -DSONG_HEADER="\"$(realpath "$1")\"" \
+        source/vgm_render/vgm_render.c \
+        source/vgm_render/sn76489.c \
+        source/vgm_render/ym2413.c \
+        source/vgm_render/embedded.c \
+        source/vgm_convert/vgm_read.c \
+        -o vgm_render -lz -lm
+else
+    gcc -O3 -ffast-math \
+        source/vgm_render/vgm_render.c \
+        source/vgm_render/sn76489.c \
+        source/vgm_render/ym2413.c \
+        source/vgm_convert/vgm_read.c \
+        -o vgm_render -lz -lm
+fi
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+gcc source/vgm_uart_sim.c \
+    -o vgm_uart_sim -lm
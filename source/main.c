@@ -5,10 +5,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef HOST_BUILD
+#include "vgm_render/host.h"
+#else
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#endif
 
 #define TONE_0_BIT      0x01
 #define TONE_1_BIT      0x02
@@ -29,15 +34,52 @@
  * The music should be processed by the vgm_convert
  * tool.
  *
- * In EMBED_BUILD, YM2413 support has not yet been
- * combined into this source file. A separate file,
- * main_fm.c, contains an initial implementation
- * without compression. */
+ * In EMBED_BUILD, the music may use both the
+ * SN76489 and the YM2413. Songs that contain YM2413
+ * data define YM2413_ENABLED, and each frame then
+ * carries the YM2413 register writes alongside the
+ * SN76489 data.
+ *
+ * The embedded image may hold several songs, which
+ * share their frame data. The first song plays at
+ * power-on. If UART_BUILD is also defined, another
+ * song can be selected by sending 0xc0 followed by
+ * the song number.
+ *
+ * Songs converted with --channels define CHANNEL_STREAMS.
+ * Instead of whole frames, each channel then has its
+ * own stream of values, which advances on its own delay
+ * counter.
+ *
+ * Songs converted with --eeprom define FRAME_DATA_EEPROM_SIZE,
+ * and keep the start of their frame data in the EEPROM. The
+ * EEPROM is then written from main.eep by build.sh.
+ *
+ * HOST_BUILD is defined when vgm_render builds this file
+ * for the host, to play the song named by SONG_HEADER
+ * into its software chips. vgm_uart_sim defines UART_BUILD
+ * along with it, to run the UART Rx interrupt on the host.
+ *
+ * When PROFILE_BUILD is defined, the time spent in each
+ * interrupt is measured with Timer 1, along with missed
+ * ticks and UART receive errors. Once a second, the
+ * statistics are sent out on the UART Tx pin (PortD.1),
+ * to be shown by the vgm_profile tool. */
+#ifdef HOST_BUILD
+#ifndef UART_BUILD
+#define EMBED_BUILD
+#endif
+#else
 #define UART_BUILD
 // #define EMBED_BUILD
+// #define PROFILE_BUILD
+#endif
 
 #ifdef EMBED_BUILD
 
+#ifdef SONG_HEADER
+#include SONG_HEADER
+#else
 #include "../aqua_lake.h"
 // #include "../bridge_zone.h"
 // #include "../chocolate.h"
@@ -46,17 +88,105 @@
 // #include "../sky_high.h"
 // #include "../tiny_cavern.h"
 // #include "../turkish_march.h"
+#endif
+
+/* Position within the compressed index_data. References
+ * may point at data containing further references, so a
+ * stack of segments is kept, each with the number of
+ * elements left to play. The bottom of the stack is the
+ * song itself, which ends at the song's end offset. */
+typedef struct index_stack_s
+{
+    uint16_t position [INDEX_STACK_DEPTH];
+    uint8_t remaining [INDEX_STACK_DEPTH];
+#ifdef TONE_TRANSPOSE
+    int8_t transpose [INDEX_STACK_DEPTH];   /* Tone table entries to move each tone by */
+#endif
+    uint8_t top;
+    uint16_t end;
+} index_stack;
+
+#ifdef TONE_TRANSPOSE
+/* The transposition of the frame being played */
+static int8_t tone_transpose = 0;
+#endif
+
+#ifdef CHANNEL_STREAMS
+/* The same as below, for each channel stream */
+static index_stack stream_indexes [STREAM_COUNT] = { };
+static uint16_t stream_delay [STREAM_COUNT] = { 0 };
+
+/* The song being played, for looking up its song_table entry */
+static uint8_t song_number = 0;
+
+/* In a channel stream element, bit 11 marks a delay without a new value */
+#define STREAM_HOLD 0x0800
+
+/* The element for a long delay, which has nothing to write */
+#define INDEX_REST STREAM_HOLD
+#else
+static index_stack indexes = { };   /* Position within the compressed index_data */
+static uint16_t frame_index = 0;    /* Index into frame data */
+static uint16_t delay = 0;          /* Ticks until the next frame */
+
+/* The loop index from the current song's entry in the song_table */
+static uint16_t song_loop = 0;
+
+/* The current tone periods, for tone fields stored as a change */
+static uint16_t tone_period [3] = { 0 };
 
-static uint16_t outer_index = 0; /* Index into the compressed index_data */
-static uint16_t inner_index = 0; /* Index when expanding references into index_data */
-static uint16_t frame_index = 0; /* Index into frame data */
+#ifdef VOLUME_MACRO_COUNT
+/* The volume macro running on each channel */
+static uint8_t macro_position [4] = { 0 };  /* Next step in volume_macro_data */
+static uint8_t macro_wait [4] = { 0 };      /* Ticks until the next step */
 
+/* The macros are stopped at the loop point, unless the loop was moved to
+ * where they are already in the same state as at the end of the song */
+static bool song_loop_macros_stop = false;
+#endif
+
+/* The element for a long delay, which plays the zero frame */
+#define INDEX_REST 0x0000
+#endif /* CHANNEL_STREAMS */
+
+#if defined (CHANNEL_STREAMS)
+/* Channel streams do not use a frame layout */
+#elif defined (FRAME_LAYOUT_FAST)
+/* Number of set bits in each nibble of the frame header */
+static const uint8_t header_bit_count [16] PROGMEM = {
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+#elif defined (FRAME_LAYOUT_HUFFMAN)
+/* The byte of frame data being decoded, and a mask for its next bit */
+static uint8_t bit_buffer = 0;
+static uint8_t bit_mask = 0;
+#else
 /* Flag for 'is the next nibble to the high nibble of its byte?' */
 static bool nibble_high = false;
+#endif
+
+#ifdef FRAME_DATA_EEPROM_SIZE
+/*
+ * Read a byte of frame data. Songs converted with --eeprom
+ * keep the start of their frame data in the EEPROM.
+ */
+static uint8_t frame_data_read (uint16_t index)
+{
+    if (index < FRAME_DATA_EEPROM_SIZE)
+    {
+        return eeprom_read_byte (&(frame_data_eeprom[index]));
+    }
+
+    return pgm_read_byte (&(frame_data[index - FRAME_DATA_EEPROM_SIZE]));
+}
+#else
+#define frame_data_read(index) pgm_read_byte (&(frame_data[index]))
+#endif
 
 #endif /* EMBED_BUILD */
 
 
+#ifndef HOST_BUILD
 /*
  * Assert an 8-bit value onto the bus.
  */
@@ -99,7 +229,7 @@ static void psg_write (uint8_t data)
  * PB2 = A0
  * PB4 = ~CS
  */
-#ifdef UART_BUILD
+#if defined (UART_BUILD) || defined (YM2413_ENABLED)
 static void ym2413_write (uint8_t addr, uint8_t data)
 {
     /* Prepare the address at least 10 ns before driving CS low. */
@@ -129,24 +259,69 @@ static void ym2413_write (uint8_t addr, uint8_t data)
      * The ym2413 also needs 84 cycles before accepting the next write. */
     _delay_us(10);
 }
-#endif
+#endif /* UART_BUILD || YM2413_ENABLED */
+#endif /* HOST_BUILD */
 
 
 /*
  * Read the next nibble from the frame data.
  */
-#ifdef EMBED_BUILD
+#if defined (EMBED_BUILD) && defined (FRAME_LAYOUT_HUFFMAN)
+static uint8_t nibble_read ()
+{
+    uint8_t code = 0;
+    uint8_t first = 0;
+    uint8_t index = 0;
+
+    /* Canonical Huffman code, most-significant bit first. After each bit,
+     * check if the code falls within the range of codes of that length. */
+    for (uint8_t length = 1; ; length++)
+    {
+        if (bit_mask == 0)
+        {
+            bit_buffer = frame_data_read (frame_index++);
+            bit_mask = 0x80;
+        }
+
+        if (bit_buffer & bit_mask)
+        {
+            code |= 1;
+        }
+        bit_mask >>= 1;
+
+        uint8_t count = pgm_read_byte (&(huffman_count[length]));
+        if ((uint8_t) (code - first) < count)
+        {
+            return pgm_read_byte (&(huffman_symbol[index + code - first]));
+        }
+
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+}
+
+
+/*
+ * Discard the remaining bits of the final byte of the frame.
+ */
+static void nibble_done ()
+{
+    bit_mask = 0;
+}
+
+#elif defined (EMBED_BUILD) && !defined (FRAME_LAYOUT_FAST) && !defined (CHANNEL_STREAMS)
 static uint8_t nibble_read ()
 {
     if (nibble_high)
     {
         nibble_high = false;
-        return  pgm_read_byte (&(frame_data[frame_index++])) >> 4;
+        return  frame_data_read (frame_index++) >> 4;
     }
     else
     {
         nibble_high = true;
-        return  pgm_read_byte (&(frame_data[frame_index])) & 0x0f;
+        return  frame_data_read (frame_index) & 0x0f;
     }
 }
 
@@ -189,75 +364,670 @@ static void led_update (uint8_t channel, uint8_t data)
 
 
 /*
- * Called every 1/60s to apply the next set of register writes.
+ * Put both chips into a known state, with all channels silent.
+ *
+ * PB5 = YM2413 ~RESET
  */
+static void chips_reset (void)
+{
+    psg_write (0x80 | 0x00); /* Clear Tone0 */
+    psg_write (0x00);
+    psg_write (0x80 | 0x20); /* Clear Tone1 */
+    psg_write (0x00);
+    psg_write (0x80 | 0x40); /* Clear Tone2 */
+    psg_write (0x00);
+    psg_write (0x80 | 0x60); /* Clear Noise */
+
+    psg_write (0x80 | 0x1f); /* Mute Tone0 */
+    psg_write (0x80 | 0x3f); /* Mute Tone1 */
+    psg_write (0x80 | 0x5f); /* Mute Tone2 */
+    psg_write (0x80 | 0x7f); /* Mute Noise */
+
+    PORTB &= ~(1 << DDB5);
+    _delay_ms (10);
+    PORTB |= (1 << DDB5);
+    _delay_ms (10);
+
+    /* Turn off the LEDs too */
+    led_update (0, 0x0f);
+    led_update (1, 0x0f);
+    led_update (2, 0x0f);
+    led_update (3, 0x0f);
+}
+
+
+#ifdef PROFILE_BUILD
+#define PROFILE_SYNC_0          0xa5
+#define PROFILE_SYNC_1          0x5a
+#define PROFILE_BUCKET_COUNT    8
+#define PROFILE_BUCKET_SHIFT    11      /* 2048 counts, about one eighth of a tick */
+#define PROFILE_PERIOD          100     /* Main loop iterations between reports, ~1 s */
+
+/* Statistics for one report. Times are in Timer 1 counts,
+ * 8 CPU cycles each. The structure is sent as it is, so it
+ * is packed to keep the same layout on the wire if built
+ * for a host. */
+typedef struct __attribute__ ((packed)) profile_s
+{
+    uint16_t tick_count;
+    uint16_t tick_max;                                  /* Longest tick */
+    uint16_t tick_late_max;                             /* Longest wait from the timer match to the tick starting */
+    uint8_t  tick_histogram [PROFILE_BUCKET_COUNT];     /* Tick lengths, saturating at 255 */
+    uint16_t rx_count;
+    uint16_t rx_max;                                    /* Longest Rx interrupt */
+    uint8_t  ticks_missed;                              /* Ticks that ran into the next timer match */
+    uint8_t  rx_overruns;                               /* USART DOR */
+    uint8_t  rx_frame_errors;                           /* USART FE */
+} profile_t;
+
+static profile_t profile = { 0 };
+
+
+/*
+ * Timer 1 counts since an interrupt started.
+ */
+static uint16_t profile_elapsed (uint16_t start)
+{
+    uint16_t now = TCNT1;
+
 #ifdef EMBED_BUILD
-static void tick ()
+    /* Timer 1 restarts from zero at each tick */
+    if (now < start)
+    {
+        now += OCR1A + 1;
+    }
+#endif
+
+    return now - start;
+}
+
+
+/*
+ * Increment a counter that stops at its maximum.
+ */
+static void profile_count (uint8_t *counter)
 {
-    static uint8_t delay = 0;
-    static uint16_t segment_end = 0;
+    if (*counter < 0xff)
+    {
+        (*counter)++;
+    }
+}
 
-    /* Read and process the next frame */
-    if (delay == 0)
+
+#ifdef EMBED_BUILD
+/*
+ * Record a tick that started at the given count.
+ */
+static void profile_tick_end (uint16_t start)
+{
+    uint16_t elapsed = profile_elapsed (start);
+    uint8_t bucket = elapsed >> PROFILE_BUCKET_SHIFT;
+
+    profile.tick_count++;
+
+    if (elapsed > profile.tick_max)
     {
-        uint16_t element;
-        uint8_t frame;
-        uint8_t data;
+        profile.tick_max = elapsed;
+    }
+
+    /* The timer restarts at the match, so its count on entry is the latency */
+    if (start > profile.tick_late_max)
+    {
+        profile.tick_late_max = start;
+    }
+
+    if (bucket >= PROFILE_BUCKET_COUNT)
+    {
+        bucket = PROFILE_BUCKET_COUNT - 1;
+    }
+    profile_count (&profile.tick_histogram [bucket]);
+
+    /* If the next match has already happened, that tick will start late */
+    if (TIFR & (1 << OCF1A))
+    {
+        profile_count (&profile.ticks_missed);
+    }
+}
+#endif /* EMBED_BUILD */
+
+
+#ifdef UART_BUILD
+/*
+ * Record an Rx interrupt that started at the given count, with the
+ * USART status read before its data.
+ */
+static void profile_rx_end (uint16_t start, uint8_t status)
+{
+    uint16_t elapsed = profile_elapsed (start);
+
+    profile.rx_count++;
+
+    if (elapsed > profile.rx_max)
+    {
+        profile.rx_max = elapsed;
+    }
+
+    if (status & (1 << DOR))
+    {
+        profile_count (&profile.rx_overruns);
+    }
+
+    if (status & (1 << FE))
+    {
+        profile_count (&profile.rx_frame_errors);
+    }
+}
+#endif /* UART_BUILD */
+
+
+/*
+ * Send a byte on the UART, waiting for space.
+ */
+static void profile_send (uint8_t data)
+{
+    while ((UCSRA & (1 << UDRE)) == 0);
+    UDR = data;
+}
+
+
+/*
+ * Called from the main loop. Once every PROFILE_PERIOD calls, take
+ * the statistics and start a new period, then send them with sync
+ * bytes and a checksum. Sending from the main loop keeps the UART
+ * wait out of the interrupts being measured.
+ */
+static void profile_report (void)
+{
+    static uint8_t calls = 0;
+    profile_t report;
+    uint8_t checksum = 0;
+
+    if (++calls < PROFILE_PERIOD)
+    {
+        return;
+    }
+    calls = 0;
+
+    cli ();
+    report = profile;
+    profile = (profile_t) { 0 };
+    sei ();
+
+    profile_send (PROFILE_SYNC_0);
+    profile_send (PROFILE_SYNC_1);
 
-        /* If we are not already processing a segment of referenced
-         * data, read a new element from the compressed index_data */
-        if (inner_index == segment_end)
+    for (uint8_t i = 0; i < sizeof (report); i++)
+    {
+        uint8_t data = ((uint8_t *) &report) [i];
+        checksum += data;
+        profile_send (data);
+    }
+
+    profile_send (checksum);
+}
+#endif /* PROFILE_BUILD */
+
+
+#ifdef EMBED_BUILD
+#ifdef YM2413_ENABLED
+/*
+ * Apply a set of YM2413 register writes from the frame data.
+ */
+static void ym2413_frame_write (uint16_t index)
+{
+    uint8_t count = frame_data_read (index++);
+
+    /* The writes may instead be a reference to identical writes in another frame */
+    if (count & 0x80)
+    {
+        index = ((count & 0x0f) << 8) | frame_data_read (index);
+        count = frame_data_read (index++);
+    }
+
+    for (; count > 0; count--)
+    {
+        uint8_t addr = frame_data_read (index++);
+        uint8_t data = frame_data_read (index++);
+
+#ifdef YM2413_PATCH_COUNT
+        /* Address 0x40 loads a custom instrument patch into registers 0x00 - 0x07 */
+        if (addr == 0x40)
+        {
+            for (addr = 0; addr < 8; addr++)
+            {
+                ym2413_write (addr, pgm_read_byte (&(ym2413_patch_data[data * 8 + addr])));
+            }
+            continue;
+        }
+#endif /* YM2413_PATCH_COUNT */
+
+        ym2413_write (addr, data);
+    }
+}
+#endif /* YM2413_ENABLED */
+
+
+/* First bytes of the elements in index_data */
+#define INDEX_REFERENCE     0x80    /* 10ll oooo, followed by the low byte of the offset */
+#define INDEX_HOT           0xc0    /* 11hh hhhh, an entry from index_hot */
+#define INDEX_TRANSPOSE     0xfe    /* Followed by the transposition, and a reference */
+#define INDEX_LONG_DELAY    0xff    /* Followed by the delay */
+
+/*
+ * Read the next byte of index_data from the top of the stack.
+ */
+static uint8_t index_byte_read (index_stack *stack)
+{
+    return pgm_read_byte (&(index_data[stack->position [stack->top]++]));
+}
+
+
+/*
+ * Read the next element from the compressed index_data,
+ * expanding any references, along with its delay.
+ */
+static uint16_t index_read (index_stack *stack, uint16_t *delay_ticks)
+{
+    uint16_t element;
+    uint8_t first;
+#ifdef TONE_TRANSPOSE
+    int8_t transpose = 0;
+#endif
+
+    /* References are followed until an index is found */
+    while (true)
+    {
+        first = index_byte_read (stack);
+
+        /* Each element counts towards the length of its segment */
+        stack->remaining [stack->top]--;
+
+#ifdef TONE_TRANSPOSE
+        /* A transposed reference is one element, with the reference after the transposition */
+        if (first == INDEX_TRANSPOSE)
+        {
+            transpose = index_byte_read (stack);
+            first = index_byte_read (stack);
+        }
+#endif
+
+        if (first < INDEX_REFERENCE)
+        {
+            /* Index, with its delay */
+            element = (first << 8) | index_byte_read (stack);
+            break;
+        }
+        else if (first == INDEX_LONG_DELAY)
+        {
+            /* A long delay with nothing to write */
+            element = index_byte_read (stack) << 8;
+            element |= index_byte_read (stack);
+            break;
+        }
+#ifdef INDEX_HOT_COUNT
+        else if (first >= INDEX_HOT)
+        {
+            /* One of the most used indexes */
+            element = pgm_read_word (&(index_hot[first - INDEX_HOT]));
+            break;
+        }
+#endif
+        else
         {
-            element = pgm_read_word (&(index_data[outer_index++]));
+            /* Reference, with the number of elements to play. The
+             * longest length code is followed by the full length. */
+            uint16_t offset = ((first & 0x0f) << 8) | index_byte_read (stack);
+            uint8_t length = ((first >> 4) & 0x03) + 2;
 
-            if (element & 0x8000)
+            if (length == 5)
             {
-                /* Segment */
-                inner_index = element & 0x0fff;
-                segment_end = inner_index + ((element >> 12) & 0x0007) + 2;
+                length = index_byte_read (stack);
             }
-            else
+
+            stack->top++;
+            stack->position [stack->top] = offset;
+            stack->remaining [stack->top] = length;
+#ifdef TONE_TRANSPOSE
+            /* Transpositions of nested segments add together */
+            stack->transpose [stack->top] = stack->transpose [stack->top - 1] + transpose;
+            transpose = 0;
+#endif
+        }
+    }
+
+#ifdef TONE_TRANSPOSE
+    /* The tones of the frame are moved by the transposition of its segment */
+    tone_transpose = stack->transpose [stack->top];
+#endif
+
+    if (first == INDEX_LONG_DELAY)
+    {
+        *delay_ticks = element;
+        element = INDEX_REST;
+    }
+    else
+    {
+        *delay_ticks = ((element >> 12) & 0x0007) + 1;
+    }
+
+    /* Return from any segments that have been played to the end */
+    while (stack->top > 0 && stack->remaining [stack->top] == 0)
+    {
+        stack->top--;
+    }
+
+    return element;
+}
+
+
+#ifdef CHANNEL_STREAMS
+/*
+ * Start playing a song from the song_table.
+ * The chips should be reset first.
+ */
+static void song_select (uint8_t song)
+{
+    if (song >= SONG_COUNT)
+    {
+        return;
+    }
+
+    song_number = song;
+
+    for (uint8_t stream = 0; stream < STREAM_COUNT; stream++)
+    {
+        stream_indexes [stream].position [0] = pgm_read_word (&(song_table[song][stream][0]));
+        stream_indexes [stream].end = pgm_read_word (&(song_table[song][stream][1]));
+        stream_indexes [stream].top = 0;
+        stream_delay [stream] = 0;
+    }
+}
+
+
+/*
+ * Write a new value for one channel stream.
+ */
+static void stream_value_write (uint8_t stream, uint16_t value)
+{
+    if (stream < 3)
+    {
+        /* Tone */
+        psg_write (0x80 | (stream << 5) | (value & 0x0f));
+        psg_write (value >> 4);
+    }
+    else if (stream == 3)
+    {
+        /* Noise */
+        psg_write (0x80 | 0x60 | value);
+    }
+    else if (stream < 8)
+    {
+        /* Volume */
+        psg_write (0x80 | 0x10 | ((stream - 4) << 5) | value);
+        led_update (stream - 4, value);
+    }
+#ifdef YM2413_ENABLED
+    else
+    {
+        ym2413_frame_write (value);
+    }
+#endif
+}
+
+
+/*
+ * Called every 1/60s to apply the next set of register writes.
+ * Each channel stream is advanced independently.
+ */
+static void tick ()
+{
+    for (uint8_t stream = 0; stream < STREAM_COUNT; stream++)
+    {
+        /* Read and process the next element */
+        if (stream_delay [stream] == 0)
+        {
+            uint16_t element = index_read (&stream_indexes [stream], &stream_delay [stream]);
+
+            if (!(element & STREAM_HOLD))
             {
-                /* Single index */
-                inner_index = outer_index - 1;
-                segment_end = outer_index;
+                stream_value_write (stream, element & 0x07ff);
             }
         }
 
+        /* Check for end of data and loop, once any final segment has been played */
+        if (stream_indexes [stream].top == 0 &&
+            stream_indexes [stream].position [0] == stream_indexes [stream].end)
+        {
+            stream_indexes [stream].position [0] = pgm_read_word (&(song_table[song_number][stream][2]));
+        }
+
+        stream_delay [stream]--;
+    }
+}
+
+#else
+#ifdef VOLUME_MACRO_COUNT
+/* Volume macro steps: [7] last step, [6..4] ticks to wait - 1, [3..0] volume */
+#define MACRO_LAST 0x80
+#define MACRO_NONE 0xff
+
+/*
+ * Stop the volume macros on all channels.
+ */
+static void volume_macros_clear ()
+{
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        macro_position [channel] = MACRO_NONE;
+    }
+}
+
+
+/*
+ * Start the macro for a volume written by a frame, if it has one.
+ * This replaces any macro already running on the channel.
+ */
+static void volume_macro_start (uint8_t channel, uint8_t volume)
+{
+    macro_position [channel] = pgm_read_byte (&(volume_macro[volume]));
+
+    if (macro_position [channel] != MACRO_NONE)
+    {
+        macro_wait [channel] = ((pgm_read_byte (&(volume_macro_data[macro_position [channel]])) >> 4) & 0x07) + 1;
+    }
+}
+
+
+/*
+ * Write the next step of each running volume macro, once its wait is over.
+ */
+static void volume_macros_step ()
+{
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        if (macro_position [channel] == MACRO_NONE || --macro_wait [channel] > 0)
+        {
+            continue;
+        }
+
+        uint8_t step = pgm_read_byte (&(volume_macro_data[macro_position [channel]++]));
+        psg_write (0x80 | 0x10 | (channel << 5) | (step & 0x0f));
+        led_update (channel, step & 0x0f);
+
+        if (step & MACRO_LAST)
+        {
+            macro_position [channel] = MACRO_NONE;
+        }
+        else
+        {
+            macro_wait [channel] = ((pgm_read_byte (&(volume_macro_data[macro_position [channel]])) >> 4) & 0x07) + 1;
+        }
+    }
+}
+#endif /* VOLUME_MACRO_COUNT */
+
+
+/*
+ * Start playing a song from the song_table.
+ * The chips should be reset first.
+ */
+static void song_select (uint8_t song)
+{
+    if (song >= SONG_COUNT)
+    {
+        return;
+    }
+
+    indexes.position [0] = pgm_read_word (&(song_table[song][0]));
+    indexes.end          = pgm_read_word (&(song_table[song][1]));
+    indexes.top          = 0;
+    song_loop            = pgm_read_word (&(song_table[song][2]));
+
+#ifdef VOLUME_MACRO_COUNT
+    song_loop_macros_stop = song_loop & SONG_LOOP_MACROS_STOP;
+    song_loop &= ~SONG_LOOP_MACROS_STOP;
+#endif
+
+    /* The chips are reset with each tone period cleared */
+    tone_period [0] = 0;
+    tone_period [1] = 0;
+    tone_period [2] = 0;
+
+#ifdef VOLUME_MACRO_COUNT
+    volume_macros_clear ();
+#endif
+
+    delay = 0;
+}
+
+
+#ifndef FRAME_LAYOUT_FAST
+/* First nibble of a tone field that is a small change to the period */
+#define TONE_DELTA 0x08
+
+/* Tone table entry for a period stored in full */
+#define TONE_TABLE_RAW 0x7f
+
+/*
+ * Read a tone field from the frame data and write it to the SN76489.
+ */
+static void tone_field_write (uint8_t channel)
+{
+    uint16_t period;
+    uint8_t first = nibble_read ();
+
+    if (first & TONE_DELTA)
+    {
+        /* A change of -4 to +4, skipping zero */
+        int8_t delta = (first & 0x07) - 4;
+        period = tone_period [channel] + delta + (delta >= 0);
+    }
+    else
+    {
+        period = first | (nibble_read () << 3);
+#ifdef TONE_TABLE_COUNT
+        if (period != TONE_TABLE_RAW)
+        {
+#ifdef TONE_TRANSPOSE
+            period += tone_transpose;
+#endif
+            period = pgm_read_word (&(tone_table[period]));
+        }
+        else
+        {
+            period = nibble_read ();
+            period |= nibble_read () << 3;
+            period |= nibble_read () << 7;
+        }
+#else
+        period |= nibble_read () << 7;
+#endif
+    }
+
+    tone_period [channel] = period;
+    psg_write (0x80 | (channel << 5) | (period & 0x0f));
+    psg_write (period >> 4);
+}
+#endif /* FRAME_LAYOUT_FAST */
+
+
+/*
+ * Write a volume from the frame data to the SN76489.
+ */
+static void volume_write (uint8_t channel, uint8_t volume)
+{
+    psg_write (0x80 | 0x10 | (channel << 5) | volume);
+    led_update (channel, volume);
+
+#ifdef VOLUME_MACRO_COUNT
+    volume_macro_start (channel, volume);
+#endif
+}
+
+
+/*
+ * Called every 1/60s to apply the next set of register writes.
+ */
+static void tick ()
+{
+#ifdef VOLUME_MACRO_COUNT
+    /* The volume macros may be stopped at the loop point, and run before each frame is read */
+    if (song_loop_macros_stop && delay == 0 && indexes.top == 0 && indexes.position [0] == song_loop)
+    {
+        volume_macros_clear ();
+    }
+    volume_macros_step ();
+#endif
+
+    /* Read and process the next frame */
+    if (delay == 0)
+    {
+        uint8_t frame;
+        uint8_t data;
+
         /* Read the delay and frame_index from the index_data */
-        frame_index = pgm_read_word (&(index_data[inner_index++]));
-        delay = ((frame_index >> 12) & 0x0007) + 1;
+        frame_index = index_read (&indexes, &delay);
         frame_index &= 0x0fff;
 
         /* Read the frame header from the frame_data */
-        frame = pgm_read_byte (&(frame_data[frame_index++]));
+#ifdef FRAME_LAYOUT_HUFFMAN
+        frame = nibble_read ();
+        frame |= nibble_read () << 4;
+#else
+        frame = frame_data_read (frame_index++);
+#endif
 
-        if (frame & TONE_0_BIT)
+#ifdef FRAME_LAYOUT_FAST
+        /* In the byte-aligned layout, each field is stored as the byte(s) to
+         * write to the SN76489. Tone fields take two bytes, others take one. */
+        for (uint8_t count = pgm_read_byte (&(header_bit_count[frame & 0x0f])) +
+                             pgm_read_byte (&(header_bit_count[frame & 0x07])) +
+                             pgm_read_byte (&(header_bit_count[frame >> 4])); count > 0; count--)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x00 | data);
+            data = frame_data_read (frame_index++);
 
-            data = nibble_read ();
-            data |= nibble_read () << 4;
-            psg_write (data);
+            /* Volume writes also update the LEDs, and start any macro */
+            if ((data & 0x90) == 0x90)
+            {
+                volume_write ((data >> 5) & 0x03, data & 0x0f);
+            }
+            else
+            {
+                psg_write (data);
+            }
+        }
+#else
+        if (frame & TONE_0_BIT)
+        {
+            tone_field_write (0);
         }
         if (frame & TONE_1_BIT)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x20 | data);
-
-            data = nibble_read ();
-            data |= nibble_read () << 4;
-            psg_write (data);
+            tone_field_write (1);
         }
         if (frame & TONE_2_BIT)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x40 | data);
-
-            data = nibble_read ();
-            data |= nibble_read () << 4;
-            psg_write (data);
+            tone_field_write (2);
         }
         if (frame & NOISE_BIT)
         {
@@ -266,38 +1036,34 @@ static void tick ()
         }
         if (frame & VOLUME_0_BIT)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x10 | data);
-            led_update (0, data);
+            volume_write (0, nibble_read ());
         }
         if (frame & VOLUME_1_BIT)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x30 | data);
-            led_update (1, data);
+            volume_write (1, nibble_read ());
         }
         if (frame & VOLUME_2_BIT)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x50 | data);
-            led_update (2, data);
+            volume_write (2, nibble_read ());
         }
         if (frame & VOLUME_3_BIT)
         {
-            data = nibble_read ();
-            psg_write (0x80 | 0x70 | data);
-            led_update (3, data);
+            volume_write (3, nibble_read ());
         }
 
         nibble_done ();
+#endif /* FRAME_LAYOUT_FAST */
+
+#ifdef YM2413_ENABLED
+        /* The YM2413 register writes follow the SN76489 data */
+        ym2413_frame_write (frame_index);
+#endif /* YM2413_ENABLED */
     }
 
-    /* Check for end of data and loop */
-    if (outer_index == END_FRAME_INDEX)
+    /* Check for end of data and loop, once any final segment has been played */
+    if (indexes.top == 0 && indexes.position [0] == indexes.end)
     {
-        outer_index = LOOP_FRAME_INDEX_OUTER;
-        inner_index = LOOP_FRAME_INDEX_INNER;
-        segment_end = LOOP_FRAME_SEGMENT_END;
+        indexes.position [0] = song_loop;
     }
 
     /* Decrement the delay counter */
@@ -306,6 +1072,7 @@ static void tick ()
         delay--;
     }
 }
+#endif /* CHANNEL_STREAMS */
 
 
 /*
@@ -313,7 +1080,13 @@ static void tick ()
  */
 ISR (TIMER1_COMPA_vect)
 {
+#ifdef PROFILE_BUILD
+    uint16_t start = TCNT1;
     tick ();
+    profile_tick_end (start);
+#else
+    tick ();
+#endif
 }
 #endif /* EMBED_BUILD */
 
@@ -325,6 +1098,10 @@ ISR (TIMER1_COMPA_vect)
 ISR (USART_RXC_vect)
 {
     static uint8_t cmd_latch = 0;
+#ifdef PROFILE_BUILD
+    uint16_t start = TCNT1;
+    uint8_t status = UCSRA; /* The error flags are only valid until UDR is read */
+#endif
     uint8_t rx_byte = UDR;
 
     /* The first byte is an instruction on what to do */
@@ -333,21 +1110,7 @@ ISR (USART_RXC_vect)
         if (rx_byte == 0x01)
         {
             /* 0x01 is a request to reset */
-            psg_write (0x80 | 0x1f); /* Mute Tone0 */
-            psg_write (0x80 | 0x3f); /* Mute Tone1 */
-            psg_write (0x80 | 0x5f); /* Mute Tone2 */
-            psg_write (0x80 | 0x7f); /* Mute Noise */
-
-            PORTB &= ~(1 << DDB5);
-            _delay_ms (10);
-            PORTB |= (1 << DDB5);
-            _delay_ms (10);
-
-            /* Turn off the LEDs too */
-            led_update (0, 0x0f);
-            led_update (1, 0x0f);
-            led_update (2, 0x0f);
-            led_update (3, 0x0f);
+            chips_reset ();
         }
         else
         {
@@ -390,15 +1153,28 @@ ISR (USART_RXC_vect)
                 ym2413_write (cmd_latch & 0x3f, rx_byte);
                 break;
 
+#ifdef EMBED_BUILD
+            case 0xc0:
+                /* Select an embedded song */
+                chips_reset ();
+                song_select (rx_byte);
+                break;
+#endif /* EMBED_BUILD */
+
             default:
         }
 
         cmd_latch = 0;
     }
+
+#ifdef PROFILE_BUILD
+    profile_rx_end (start, status);
+#endif
 }
 #endif /* UART_BUILD */
 
 
+#ifndef HOST_BUILD
 /*
  * Entry point.
  *
@@ -449,13 +1225,12 @@ int main (void)
     DDRD = (1 << DDD2) | (1 << DDD3) | (1 << DDD4) | (1 << DDD5) | (1 << DDD6) | (1 << DDD7);
     PORTD = 0;
 
-    /* Default register values */
-    psg_write (0x80 | 0x1f); /* Mute Tone0 */
-    psg_write (0x80 | 0x3f); /* Mute Tone1 */
-    psg_write (0x80 | 0x5f); /* Mute Tone2 */
-    psg_write (0x80 | 0x7f); /* Mute Noise */
+    /* Default register values, and take the ym2413 out of reset */
+    chips_reset ();
 
 #ifdef EMBED_BUILD
+    song_select (0);
+
     /* Use timer 1 to generate a 60 Hz interrupt */
     TCCR1A = 0;
     TCCR1B = (1 << WGM12) | (1 << CS11); /* CTC mode, pre-scale clock by 8 */
@@ -463,11 +1238,6 @@ int main (void)
     TIMSK = (1 << OCIE1A); /* Interrupt on Output-compare-A match */
 #endif /* EMBED_BUILD */
 
-    /* Wait 10ms and then take the ym2413 out of reset */
-    _delay_ms (10);
-    PORTB |= (1 << DDB5);
-    _delay_ms (10);
-
 #ifdef UART_BUILD
     /* Configure the UART */
     UCSRA |= (1 << U2X); /* U2X mode for more accurate timing */
@@ -476,11 +1246,29 @@ int main (void)
     UCSRC = (1 << URSEL) | (1 << UCSZ0) | (1 << UCSZ1); /* 8N1 */
 #endif /* UART_BUILD */
 
+#ifdef PROFILE_BUILD
+    /* Statistics are sent on Tx, at the same 28800 Baud */
+    UCSRA |= (1 << U2X);
+    UBRRL = 30;
+    UCSRB |= (1 << TXEN);
+    UCSRC = (1 << URSEL) | (1 << UCSZ0) | (1 << UCSZ1);
+
+#ifndef EMBED_BUILD
+    /* Without the 60 Hz interrupt, timer 1 runs freely to time the Rx interrupt */
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11); /* Pre-scale clock by 8 */
+#endif
+#endif /* PROFILE_BUILD */
+
     /* Enable interrupts */
     sei ();
 
     while (true)
     {
         _delay_ms (10);
+#ifdef PROFILE_BUILD
+        profile_report ();
+#endif
     }
 }
+#endif /* HOST_BUILD */
@@ -1,3 +1,5 @@
+#include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,40 +32,340 @@ typedef struct psg_regs_s
 #define VOLUME_2_BIT    0x40
 #define VOLUME_3_BIT    0x80
 
-/* State tracking */
+/* State tracking.
+ * The dirty masks record which registers have been written since the last
+ * frame, so that frame generation only needs to check those registers.
+ * psg_dirty uses the same bits as the frame header. */
 static psg_regs current_state = { 0 };
+static psg_regs previous_state = { 0 };
+static uint8_t psg_dirty = 0;
+static uint8_t psg_latch = 0;
+static uint8_t ym2413_regs [0x40] = { 0 };
+static uint8_t previous_ym2413_regs [0x40] = { 0 };
+static uint64_t ym2413_dirty = 0;
 static uint32_t samples_delay = 0;
+static bool ym2413_enabled = false;
+static uint32_t ym2413_write_count = 0;
+static uint32_t ym2413_change_count = 0;
+static uint32_t ym2413_frame_data_size = 0;
+static uint32_t ym2413_reference_saving = 0;
+
+/* Custom instrument patches (registers 0x00 - 0x07) */
+#define PATCH_COUNT_MAX 256
+#define PATCH_WRITES_MIN 4
+static uint8_t  ym2413_patch_data [PATCH_COUNT_MAX * 8] = { 0 };
+static uint16_t ym2413_patch_count = 0;
+static uint32_t ym2413_patch_saving = 0;
 
 /* Unique frames. Note that:
  *  1. Frames are variable length.
- *  2. A zero-frame is pre-populated at the start for use with delay-only indexes. */
+ *  2. A zero-frame is pre-populated at the start for use with delay-only indexes.
+ *  3. Frames may overlap, or be contained within other frames. */
 static uint8_t  frame_data [OUTPUT_SIZE_MAX + 10] = { 0 };
-static uint32_t frame_data_size = 1;
+static uint32_t frame_data_size = 0;
+static uint32_t frame_index_max = 0;    /* Must fit in the 12 bits of an index */
+#define FRAME_INDEX_LIMIT 0x0fff
+
+/* Frame layouts */
+#define LAYOUT_NIBBLE   0   /* Nibble-packed */
+#define LAYOUT_BYTE     1   /* Byte-aligned, --fast */
+#define LAYOUT_HUFFMAN  2   /* Huffman-coded nibbles, --huffman */
+#define LAYOUT_COUNT    3
+static uint8_t frame_layout_selected = LAYOUT_NIBBLE;
+
+/* Canonical Huffman code for the nibbles of the Huffman layout.
+ * The length limit bounds the decode time of each nibble. */
+#define HUFFMAN_LENGTH_MAX 8
+static uint8_t  huffman_length [16] = { 0 };
+static uint8_t  huffman_code [16] = { 0 };
+static uint8_t  huffman_count [HUFFMAN_LENGTH_MAX + 1] = { 0 };
+static uint8_t  huffman_symbol [16] = { 0 };
+static uint8_t  huffman_symbol_count = 0;
+
+/* Table of tone periods for the nibble-packed and Huffman layouts.
+ * Each tone field is stored as a seven-bit table entry, or as the raw
+ * period following TONE_TABLE_RAW for periods not in the table. */
+#define TONE_TABLE_COUNT_MAX    127
+#define TONE_TABLE_RAW          0x7f
+static uint16_t tone_table [TONE_TABLE_COUNT_MAX] = { 0 };
+static uint16_t tone_table_count = 0;
+static uint16_t tone_table_entry [0x400] = { 0 };   /* Entry + 1, or zero if not in the table */
+static int32_t  tone_table_saving = 0;
 
-/* Index of each unique frame to speed up matching. */
+/* With --transpose, the tone table starts with one entry for each semitone
+ * in the range used, lowest note last. A melody played in another key then
+ * uses the same entries moved by a constant number, and can be stored as a
+ * reference to the first one, with the firmware adding the difference to
+ * each entry it looks up. */
+#define TRANSPOSE_ANY           INT16_MIN
+static bool     tone_transpose_enabled = false;
+static uint16_t tone_table_semitones = 0;           /* Entries laid out by semitone */
+static uint16_t tone_table_fillers = 0;             /* Semitones in the range that are not used */
+
+/* Small tone changes can instead be stored in one nibble, as a change
+ * of -4 to +4 from the previous period. The first nibble of a tone field
+ * has TONE_DELTA set for a change, and is otherwise the start of a period
+ * or table entry. Not used by the byte-aligned layout or channel streams. */
+#define TONE_DELTA              0x08
+#define TONE_DELTA_MAX          4
+static bool     tone_delta_enabled = false;
+static uint8_t  tone_absolute_pending = 0;  /* Tones that must next be written in full */
+static uint32_t tone_delta_count = 0;
+static uint32_t tone_change_count = 0;
+
+/* Index of each unique frame within frame_data. */
 static uint16_t frame_indexes [OUTPUT_SIZE_MAX + 10] = { 0 };
-static uint16_t frame_count = 1;
+static uint16_t index_frame [0x1000] = { 0 };       /* The frame at each index into frame_data */
+
+/* Frames are packed into frame_data so that they overlap where one frame's
+ * bytes end with the start of another's, or contain another frame entirely. */
+static uint8_t  frame_data_unpacked [OUTPUT_SIZE_MAX + 10] = { 0 };
+static uint32_t frame_data_unpacked_size = 0;
 
 /* Indexes into frame data to be used for playback. */
 /* Note: two bytes per index is pretty big, we probably need ~12 bits.
  *       Consider:
  *        - nibble-packing.
  *        - Storing delay in the extra bits. */
-static uint16_t index_data [OUTPUT_SIZE_MAX + 10] = { 0 };
-static uint16_t index_data_count = 0;
-static uint16_t loop_frame_index = 0;
+#define INDEX_COUNT_MAX 0x40000
+static uint16_t index_data [INDEX_COUNT_MAX] = { 0 };
+static uint32_t index_data_count = 0;
+
+/* The compressed index data is a stream of bytes, with elements of one to
+ * four bytes. See compress_indexes () for the format. */
+static uint8_t  compressed_index_data [INDEX_COUNT_MAX * 4] = {};
+static uint32_t compressed_index_data_size = 0;
+static uint32_t compressed_element_count = 0;
+static uint32_t compressed_offset [INDEX_COUNT_MAX + 1] = { 0 };        /* Where each element starts */
+
+/* References may point at data that itself contains references, so that
+ * repeated phrases can be re-used within repeated verses. The firmware keeps
+ * a stack of the segments being played, which limits how deeply they nest. */
+#define INDEX_NESTING_MAX 3
+static uint32_t expanded_index_data [INDEX_COUNT_MAX] = { 0 };          /* The compressed data, expanded */
+static uint32_t compressed_expansion [INDEX_COUNT_MAX + 1] = { 0 };     /* Where each element's expansion starts */
+static uint8_t  compressed_depth [INDEX_COUNT_MAX] = { 0 };             /* Levels of references within each element */
+static uint16_t compressed_literal [INDEX_COUNT_MAX] = { 0 };           /* The index in each element, if any */
+static uint8_t  compressed_depth_max = 0;
+
+/* First bytes of the compressed elements */
+#define INDEX_REFERENCE         0x80    /* References, 0x80 - 0xbf */
+#define INDEX_HOT               0xc0    /* One-byte indexes, 0xc0 - 0xfd */
+#define INDEX_TRANSPOSE         0xfe    /* A reference, played transposed */
+#define INDEX_LONG_DELAY        0xff    /* A delay with nothing to write */
+#define INDEX_REFERENCE_MAX     4
+#define INDEX_REFERENCE_LONG    3       /* Length code for a reference with a one-byte length */
+#define INDEX_OFFSET_MAX        0x0fff
+#define INDEX_NO_LITERAL        0xffff
+static uint32_t index_tokens [INDEX_COUNT_MAX] = { 0 };
+static uint32_t index_token_cost [INDEX_COUNT_MAX + 1] = { 0 };         /* Bytes to store the tokens before each token */
+static uint32_t index_long_delay_count = 0;
+static uint32_t index_long_reference_count = 0;
+static uint32_t index_transposed_count = 0;
+
+/* The indexes left in the compressed data most often are given one-byte
+ * codes, which look up the full index in a table ranked by use. */
+#define INDEX_HOT_COUNT_MAX     62
+#define INDEX_HOT_USES_MIN      3       /* Each table entry costs two bytes */
+static uint32_t index_literal_uses [0x8000] = { 0 };
+static uint8_t  index_hot_code [0x8000] = { 0 };                        /* One more than the code, if any */
+static uint16_t index_hot [INDEX_HOT_COUNT_MAX] = { 0 };
+static uint8_t  index_hot_count = 0;
+static uint32_t index_hot_uses = 0;
+
+/* Songs. Each song has its own range of index_data, but the frames and
+ * compressed_index_data are shared so that songs can re-use each other's data. */
+#define SONG_COUNT_MAX 64
+typedef struct song_s
+{
+    char    *filename;
+    uint32_t timeline_start;    /* Range within the timeline */
+    uint32_t timeline_end;
+    uint32_t timeline_loop;
+    uint32_t index_start;       /* Range within index_data */
+    uint32_t index_end;
+    uint32_t loop_frame_index;
+    bool     loop_given;        /* The .vgm file has a loop offset */
+    bool     loop_macro_active; /* Volume macros were running when the given loop point was reached */
+    bool     loop_macros_stop;  /* The loop point is where the volume macros were stopped */
+    uint16_t start;             /* Range of bytes within compressed_index_data */
+    uint16_t end;
+    uint16_t loop;              /* Always the start of an element in the range */
+} song;
+
+static song songs [SONG_COUNT_MAX] = { };
+static uint8_t song_count = 0;
+
+/* Loop search. A loop found in a song without a loop offset must be at
+ * least one second long, so that trailing silence is not looped. */
+#define LOOP_SEARCH_TICKS_MIN 60
+static bool loop_search = true;
 
-static uint16_t compressed_index_data [OUTPUT_SIZE_MAX + 10] = {};
-static uint16_t compressed_index_data_count = 0;
-static uint16_t loop_frame_index_outer = 0;
-static uint16_t loop_frame_index_inner = 0;
-static uint16_t loop_frame_segment_end = 0;
+/* Per-channel streams, --channels.
+ * Instead of one index stream of whole frames, each song is split into a
+ * stream for each channel. Streams 0-2 are the tones, 3 is the noise, 4-7
+ * are the volumes, and 8 is the YM2413 writes. Each stream is compressed
+ * in the same way as the frame indexes. */
+#define STREAM_COUNT_MAX 9
+#define STREAM_HOLD 0x0800
+static bool channel_streams = false;
+static uint8_t stream_count = 1;
+static song streams [SONG_COUNT_MAX][STREAM_COUNT_MAX] = { };
+static uint16_t stream_source [INDEX_COUNT_MAX] = { 0 };
 
-#define TOTAL_SIZE (frame_data_size + compressed_index_data_count * 2)
+/* Volume envelope macros. When a frame writes a volume directly, the macro for
+ * that volume (if any) is started on the channel, replacing any macro already
+ * running there. The macro then writes the volumes that follow on its own,
+ * until its last step or the next direct write. Macros are stopped at a
+ * loop point given by the .vgm file. Each step is one byte:
+ *  [7]    - Last step of the macro
+ *  [6..4] - Ticks since the previous step (or the direct write), minus one
+ *  [3..0] - Volume
+ * Not used with channel streams, where each volume stream is compressed on its own. */
+#define MACRO_STEP_COUNT_MAX    32
+#define MACRO_WAIT_MAX          8
+#define MACRO_LAST              0x80
+#define MACRO_NONE              0xff
+#define MACRO_CANDIDATE_MAX     256     /* Distinct sequences to try for each volume */
+#define MACRO_WRITE_GAIN        2       /* Estimated nibbles saved by each volume change a macro writes */
+#define MACRO_CORRECTION_COST   6       /* Estimated nibbles for a frame to correct a macro */
+static bool     volume_macros_enabled = false;
+static uint8_t  volume_macro [16] = { 0 };                  /* Offset of the macro for each volume, or MACRO_NONE */
+static uint8_t  volume_macro_data [MACRO_NONE] = { 0 };
+static uint16_t volume_macro_data_size = 0;
+static uint8_t  volume_macro_count = 0;
+static uint32_t volume_macro_writes = 0;
+static uint8_t  macro_position [4] = { 0 };                 /* The macro engine, as run by the firmware */
+static uint8_t  macro_wait [4] = { 0 };
+static uint64_t index_macro_state [INDEX_COUNT_MAX] = { 0 };  /* The macro engine at the start of each index */
+#define MACRO_STATE_UNKNOWN     UINT64_MAX
+#define SONG_LOOP_MACROS_STOP   0x8000  /* In the song_table loop offset */
+
+#define HUFFMAN_TABLE_SIZE (frame_layout_selected == LAYOUT_HUFFMAN ? HUFFMAN_LENGTH_MAX + 1 + huffman_symbol_count : 0)
+#define VOLUME_MACRO_SIZE (volume_macro_count > 0 ? 16 + volume_macro_data_size : 0)
+#define TOTAL_SIZE (frame_data_size + compressed_index_data_size + index_hot_count * 2 + tone_table_count * 2 + ym2413_patch_count * 8 + song_count * stream_count * 6 + HUFFMAN_TABLE_SIZE + VOLUME_MACRO_SIZE)
+
+/* With --eeprom, the start of frame_data is moved into the EEPROM, which
+ * is otherwise unused. At least one byte is left in flash, as C arrays
+ * may not be empty. */
+#define EEPROM_SIZE 512
+static bool eeprom_enabled = false;
+#define FRAME_DATA_EEPROM_SIZE (!eeprom_enabled ? 0 : (frame_data_size > EEPROM_SIZE) ? EEPROM_SIZE : frame_data_size - 1)
+#define FLASH_SIZE (TOTAL_SIZE - FRAME_DATA_EEPROM_SIZE)
+
+/* A frame, before it is encoded for the micro controller */
+typedef struct frame_s
+{
+    uint8_t  psg_bits;              /* Which PSG registers change, using the frame header bits */
+    uint8_t  tone_delta_bits;       /* Which tones are stored as a change, as a TONE_DELTA nibble */
+    psg_regs psg;                   /* New values of the changed PSG registers */
+    uint8_t  ym2413_count;          /* Number of YM2413 writes */
+    uint8_t  ym2413_addr [0x40];    /* Address 0x40 loads a custom instrument patch */
+    uint8_t  ym2413_data [0x40];
+} frame;
+
+/* Unique frames, before encoding */
+#define FRAME_COUNT_MAX 0x1000
+static frame frames [FRAME_COUNT_MAX] = { 0 };
+static uint16_t frame_count = 1;
+
+/* Frames that are only played through transposed references are left out
+ * of frame_data, and given an unused index above the end of frame_data. */
+static bool     frame_unused [FRAME_COUNT_MAX] = { 0 };
+static uint16_t frame_unused_count = 0;
 
 /* Holding space for newly generated frame */
-#define FRAME_SIZE_MAX 8
-static uint8_t new_frame [FRAME_SIZE_MAX] = { 0 };
+static frame new_frame = { 0 };
+static uint16_t new_frame_patch_saving = 0;
+
+/* The register state at each point where a song is divided into frames.
+ * Songs are first read into the timeline, and the frames are then
+ * generated from it. */
+typedef struct timeline_entry_s
+{
+    psg_regs psg;
+    uint8_t  psg_dirty;
+    uint8_t  ym2413_regs [0x40];
+    uint64_t ym2413_dirty;
+    uint16_t delay;             /* 1/60s until the next entry */
+} timeline_entry;
+
+#define TIMELINE_COUNT_MAX 0x40000
+static timeline_entry *timeline = NULL;     /* Grown as the songs are read */
+static uint32_t timeline_count = 0;
+static uint32_t timeline_allocated = 0;
+
+/* Lossy changes to the timeline for --budget, in order of how noticeable they
+ * are. Each step also includes the changes from the steps before it, and is
+ * applied to a copy of the original timeline. */
+typedef struct lossy_step_s
+{
+    const char *description;
+    bool     trim_silence;      /* Trim leading and trailing silence */
+    bool     collapse_glitches; /* Remove values that only last for one frame */
+    uint8_t  tone_shift;        /* Snap tone changes smaller than 1/2^n of the period, 0 to disable */
+    uint8_t  volume_step;       /* Merge volume changes of up to this many steps */
+} lossy_step;
+
+static const lossy_step lossy_steps [] = {
+    { "Lossless",                                       false, false, 0, 0 },
+    { "Trim leading and trailing silence",              true,  false, 0, 0 },
+    { "Collapse single-frame glitches",                 true,  true,  0, 0 },
+    { "Snap tone changes under 1/128 of the period",    true,  true,  7, 0 },
+    { "Merge single volume steps",                      true,  true,  7, 1 },
+    { "Snap tone changes under 1/64 of the period",     true,  true,  6, 1 },
+    { "Merge volume steps of up to 2",                  true,  true,  6, 2 },
+    { "Snap tone changes under 1/32 of the period",     true,  true,  5, 2 },
+};
+#define LOSSY_STEP_COUNT (sizeof (lossy_steps) / sizeof (lossy_steps [0]))
+
+static uint32_t budget = 0;
+static timeline_entry *timeline_lossless = NULL;    /* Allocated for the first lossy step */
+
+/* The budget is for flash, which is everything but the EEPROM part with --eeprom */
+#define BUDGET_SIZE_NAME (eeprom_enabled ? " in flash" : " total")
+static song songs_lossless [SONG_COUNT_MAX] = { };
+static uint32_t lossy_silence_trimmed = 0;
+static uint32_t lossy_glitches_collapsed = 0;
+static uint32_t lossy_tones_snapped = 0;
+static uint32_t lossy_volumes_merged = 0;
+static uint32_t lossy_entries_merged = 0;
+
+/* What the lossy steps changed, for reporting each budget step */
+typedef struct lossy_counter_s
+{
+    const uint32_t *count;
+    const char *description;
+} lossy_counter;
+
+static const lossy_counter lossy_counters [] = {
+    { &lossy_silence_trimmed,       "frames of silence trimmed" },
+    { &lossy_glitches_collapsed,    "single-frame glitches collapsed" },
+    { &lossy_tones_snapped,         "tone changes snapped" },
+    { &lossy_volumes_merged,        "volume steps merged" },
+    { &lossy_entries_merged,        "frames merged with the frame before" },
+};
+#define LOSSY_COUNTER_COUNT (sizeof (lossy_counters) / sizeof (lossy_counters [0]))
+
+/* The songs may be encoded many times with --budget and --transpose, so
+ * the report on each encoding is kept, and only the last one is printed */
+static FILE *encode_report = NULL;
+static char *encode_report_text = NULL;
+static size_t encode_report_size = 0;
+
+/* Encoded frame size limit:
+ * Header, 26 PSG nibbles, YM2413 write count, and a write-pair for each YM2413 register */
+#define FRAME_SIZE_MAX (1 + 13 + 1 + 0x40 * 2)
+
+/* Estimated AVR cycles to decode SN76489 frame data in tick(), not counting
+ * the time spent waiting for the chip. These are rough figures taken from
+ * the avr-gcc -Os output of each decoder, for comparing the frame layouts. */
+#define FRAME_CYCLES            60  /* Index lookup and header read */
+#define NIBBLE_FIELD_CYCLES     30  /* nibble_read () call, including the nibble_high branch */
+#define BYTE_FIELD_CYCLES       12  /* pgm_read_byte and the LED check */
+#define HUFFMAN_SYMBOL_CYCLES   30  /* nibble_read () call and symbol lookup */
+#define HUFFMAN_BIT_CYCLES      20  /* Each bit of the code, including the count lookup */
+#define TONE_TABLE_CYCLES       10  /* Reading the period from tone_table */
 
 /* TODO: For PAL music, perhaps define delay as multiples of 1/50, or have
  *       a shorter delay like 1/300 that can cleanly describe both PAL and
@@ -71,204 +373,323 @@ static uint8_t new_frame [FRAME_SIZE_MAX] = { 0 };
 
 
 /*
- * Convert a collection of register writes into a
- * nibble-packed format for the micro controller.
+ * Check if the custom instrument registers should be loaded from
+ * the patch table, adding the current instrument to the table if needed.
+ * Returns the patch number to use, or -1 to write the registers individually.
  */
-uint16_t generate_frame (void)
+static int16_t ym2413_patch_find (const uint8_t *previous_ym2413_regs)
 {
-    static psg_regs previous_state;
-
-    uint8_t frame_size = 1;
-
-    uint8_t nibble [16] = { 0 };
-    uint8_t nibble_count = 0;
+    uint8_t changes = 0;
 
-    /* Clear all bits for the new frame */
-    memset (new_frame, 0, sizeof (new_frame));
-
-    /* Frame format description:
-     *
-     *  Bitfields: vvvv nttt
-     *
-     *  nttt -> 0001: Tone0 nibbles follow (3)
-     *          0010: Tone1 nibbles follow (3)
-     *          0100: Tone2 nibbles follow (3)
-     *          1000: Noise nibble follows
-     *
-     *          Nibbles are packed least-significant nibble first.
-     *          Within an output bytes, the least-significant nibble comes first.
-     *
-     *
-     *  vvvv -> 0001: Tone0 volume nibble follows
-     *       -> 0010: Tone1 volume nibble follows
-     *       -> 0100: Tone2 volume nibble follows
-     *       -> 1000: Noise volume nibble follows
-     *
-     *  Bytes follow in the order they appear in the above list.
-     *  Two bytes for the 10-bit tone registers.
-     */
+    for (uint8_t addr = 0; addr < 8; addr++)
+    {
+        if (ym2413_regs [addr] != previous_ym2413_regs [addr])
+        {
+            changes++;
+        }
+    }
 
-    /* Tone0 */
-    if (current_state.tone_0 != previous_state.tone_0)
+    /* A patch load takes the space of a single register write */
+    if (changes < 2)
     {
-        new_frame [0] |= TONE_0_BIT;
-        nibble [nibble_count++] = (current_state.tone_0 & 0x00f);
-        nibble [nibble_count++] = (current_state.tone_0 & 0x0f0) >> 4;
-        nibble [nibble_count++] = (current_state.tone_0 & 0x300) >> 8;
+        return -1;
     }
 
-    /* Tone1 */
-    if (current_state.tone_1 != previous_state.tone_1)
+    for (uint16_t patch = 0; patch < ym2413_patch_count; patch++)
     {
-        new_frame [0] |= TONE_1_BIT;
-        nibble [nibble_count++] = (current_state.tone_1 & 0x00f);
-        nibble [nibble_count++] = (current_state.tone_1 & 0x0f0) >> 4;
-        nibble [nibble_count++] = (current_state.tone_1 & 0x300) >> 8;
+        if (memcmp (&ym2413_patch_data [patch * 8], ym2413_regs, 8) == 0)
+        {
+            new_frame_patch_saving = (changes - 1) * 2;
+            ym2413_change_count += changes;
+            return patch;
+        }
     }
 
-    /* Tone2 */
-    if (current_state.tone_2 != previous_state.tone_2)
+    /* Only add new patches when enough registers change to pay for the table entry */
+    if (changes < PATCH_WRITES_MIN || ym2413_patch_count == PATCH_COUNT_MAX)
     {
-        new_frame [0] |= TONE_2_BIT;
-        nibble [nibble_count++] = (current_state.tone_2 & 0x00f);
-        nibble [nibble_count++] = (current_state.tone_2 & 0x0f0) >> 4;
-        nibble [nibble_count++] = (current_state.tone_2 & 0x300) >> 8;
+        return -1;
     }
 
-    /* Noise */
-    if (current_state.noise != previous_state.noise)
+    memcpy (&ym2413_patch_data [ym2413_patch_count * 8], ym2413_regs, 8);
+    new_frame_patch_saving = (changes - 1) * 2;
+    ym2413_change_count += changes;
+    return ym2413_patch_count++;
+}
+
+
+/*
+ * Get one of the SN76489 registers, numbered by its frame header bit.
+ */
+static uint16_t psg_field_get (const psg_regs *regs, uint8_t field)
+{
+    switch (field)
     {
-        new_frame [0] |= NOISE_BIT;
-        nibble [nibble_count++] = current_state.noise & 0x0f;
+        case 0:  return regs->tone_0;
+        case 1:  return regs->tone_1;
+        case 2:  return regs->tone_2;
+        case 3:  return regs->noise;
+        case 4:  return regs->volume_0;
+        case 5:  return regs->volume_1;
+        case 6:  return regs->volume_2;
+        default: return regs->volume_3;
     }
+}
 
-    /* Volume 0 */
-    if (current_state.volume_0 != previous_state.volume_0)
+
+/*
+ * Set one of the SN76489 registers, numbered by its frame header bit.
+ */
+static void psg_field_set (psg_regs *regs, uint8_t field, uint16_t value)
+{
+    switch (field)
     {
-        new_frame [0] |= VOLUME_0_BIT;
-        nibble [nibble_count++] = current_state.volume_0 & 0x0f;
+        case 0:  regs->tone_0 = value;   break;
+        case 1:  regs->tone_1 = value;   break;
+        case 2:  regs->tone_2 = value;   break;
+        case 3:  regs->noise = value;    break;
+        case 4:  regs->volume_0 = value; break;
+        case 5:  regs->volume_1 = value; break;
+        case 6:  regs->volume_2 = value; break;
+        default: regs->volume_3 = value; break;
     }
+}
 
-    /* Volume 1 */
-    if (current_state.volume_1 != previous_state.volume_1)
+
+/*
+ * Stop all volume macros, as the firmware does at the loop point.
+ */
+static void volume_macros_clear (void)
+{
+    memset (macro_position, MACRO_NONE, sizeof (macro_position));
+}
+
+
+/*
+ * Check if any volume macros are running.
+ */
+static bool volume_macros_active (void)
+{
+    for (uint8_t channel = 0; channel < 4; channel++)
     {
-        new_frame [0] |= VOLUME_1_BIT;
-        nibble [nibble_count++] = current_state.volume_1 & 0x0f;
+        if (macro_position [channel] != MACRO_NONE)
+        {
+            return true;
+        }
     }
 
-    /* Volume 2 */
-    if (current_state.volume_2 != previous_state.volume_2)
+    return false;
+}
+
+
+/*
+ * Get the state of the macro engine, for comparing loop points.
+ */
+static uint64_t volume_macros_state (void)
+{
+    uint64_t state = 0;
+
+    for (uint8_t channel = 0; channel < 4; channel++)
     {
-        new_frame [0] |= VOLUME_2_BIT;
-        nibble [nibble_count++] = current_state.volume_2 & 0x0f;
+        state = (state << 16) | (macro_position [channel] << 8);
+        if (macro_position [channel] != MACRO_NONE)
+        {
+            state |= macro_wait [channel];
+        }
     }
 
-    /* Volume 3 */
-    if (current_state.volume_3 != previous_state.volume_3)
+    return state;
+}
+
+
+/*
+ * Start the macro for a volume written directly by a frame,
+ * replacing any macro already running on the channel.
+ */
+static void volume_macro_start (uint8_t channel, uint8_t volume)
+{
+    macro_position [channel] = volume_macro [volume];
+
+    if (macro_position [channel] != MACRO_NONE)
     {
-        new_frame [0] |= VOLUME_3_BIT;
-        nibble [nibble_count++] = current_state.volume_3 & 0x0f;
+        macro_wait [channel] = ((volume_macro_data [macro_position [channel]] >> 4) & 0x07) + 1;
     }
+}
 
-    /* Pack nibbles */
-    /* TODO: Use C bitfields */
-    for (int i = 0; i < nibble_count; i++)
+
+/*
+ * Run the volume macros for one tick, as the firmware does before reading
+ * each frame. The volumes written are recorded in previous_state, and
+ * marked dirty so that the next frame can correct them.
+ *
+ * Returns true if a volume now differs from current_state.
+ */
+static bool volume_macros_step (void)
+{
+    bool differs = false;
+
+    for (uint8_t channel = 0; channel < 4; channel++)
     {
-        if (i % 2 == 0)
+        if (macro_position [channel] != MACRO_NONE && --macro_wait [channel] == 0)
         {
-            /* Low nibble */
-            new_frame [frame_size] = (nibble [i] & 0x0f);
+            uint8_t step = volume_macro_data [macro_position [channel]++];
+
+            psg_field_set (&previous_state, 4 + channel, step & 0x0f);
+            psg_dirty |= VOLUME_0_BIT << channel;
+
+            if (step & MACRO_LAST)
+            {
+                macro_position [channel] = MACRO_NONE;
+            }
+            else
+            {
+                macro_wait [channel] = ((volume_macro_data [macro_position [channel]] >> 4) & 0x07) + 1;
+            }
+
+            if ((step & 0x0f) == psg_field_get (&current_state, 4 + channel))
+            {
+                volume_macro_writes++;
+            }
         }
-        else
+
+        if (psg_field_get (&previous_state, 4 + channel) != psg_field_get (&current_state, 4 + channel))
         {
-            /* High nibble */
-            new_frame [frame_size++] |= (nibble [i] & 0x0f) << 4;
+            differs = true;
         }
     }
 
-    /* If we have an odd number of nibbles, remember to increment the frame size */
-    if (nibble_count % 2 == 1)
+    return differs;
+}
+
+
+/*
+ * Get the value to store in new_frame for a tone change on a channel.
+ *
+ * Small changes are stored as a TONE_DELTA nibble, unless the tone needs
+ * to be written in full, as at the start of the song and the loop point.
+ */
+static uint16_t tone_field_value (uint8_t channel, uint16_t period, uint16_t previous)
+{
+    int16_t delta = period - previous;
+    bool absolute = tone_absolute_pending & (TONE_0_BIT << channel);
+
+    tone_absolute_pending &= ~(TONE_0_BIT << channel);
+    tone_change_count++;
+
+    if (!tone_delta_enabled || absolute || delta < -TONE_DELTA_MAX || delta > TONE_DELTA_MAX)
     {
-        frame_size++;
+        return period;
     }
 
-    memcpy (&previous_state, &current_state, sizeof (psg_regs));
+    /* Zero is skipped, as an unchanged tone is not written */
+    new_frame.tone_delta_bits |= TONE_0_BIT << channel;
+    tone_delta_count++;
 
-    return frame_size;
+    return TONE_DELTA | (delta < 0 ? delta + TONE_DELTA_MAX : delta + TONE_DELTA_MAX - 1);
 }
 
 
 /*
- * Adds a frame to the output buffers.
- *
- * If the frame is new, it is added both to frame_data and index_data.
- * If the frame is a duplicate, it is only added to index_data.
- *
- * Format:
- *  [15]     - Always output 0, reserved for use by compression
- *  [14..12] - Delay, 1/60 to 8/60s
- *  [11..0]  - Index into frame data
+ * Collect the register changes since the previous frame into new_frame.
  */
-void write_frame (void)
+void generate_frame (void)
 {
-    uint16_t index = 0xffff;
-    uint16_t new_frame_size = generate_frame ();
-    uint16_t frame_delay = samples_delay / 735;
-    samples_delay -= frame_delay * 735;
+    /* Clear all fields for the new frame, so that frames can be compared with memcmp */
+    memset (&new_frame, 0, sizeof (new_frame));
+    new_frame_patch_saving = 0;
 
-    /* Check if the frame already exists */
-    for (int i = 0; i < frame_count; i++)
+    /* Tone0 */
+    if ((psg_dirty & TONE_0_BIT) && current_state.tone_0 != previous_state.tone_0)
     {
-        if (memcmp (new_frame, &(frame_data [frame_indexes [i]]), new_frame_size) == 0)
-        {
-            /* Found */
-            index = frame_indexes [i];
-            break;
-        }
+        new_frame.psg_bits |= TONE_0_BIT;
+        new_frame.psg.tone_0 = tone_field_value (0, current_state.tone_0, previous_state.tone_0);
+        previous_state.tone_0 = current_state.tone_0;
     }
 
-    /* If a matching index was not found, then this is a new unique frame. */
-    if (index == 0xffff)
+    /* Tone1 */
+    if ((psg_dirty & TONE_1_BIT) && current_state.tone_1 != previous_state.tone_1)
     {
-        /* Check there is space for a new frame, as we use 12 bits to index them */
-        if (frame_data_size >= 0x0fff)
-        {
-            fprintf (stderr, "Warning: frame_data too large to index.\n");
-        }
+        new_frame.psg_bits |= TONE_1_BIT;
+        new_frame.psg.tone_1 = tone_field_value (1, current_state.tone_1, previous_state.tone_1);
+        previous_state.tone_1 = current_state.tone_1;
+    }
 
-        index = frame_data_size;
-        frame_indexes [frame_count++] = index;
+    /* Tone2 */
+    if ((psg_dirty & TONE_2_BIT) && current_state.tone_2 != previous_state.tone_2)
+    {
+        new_frame.psg_bits |= TONE_2_BIT;
+        new_frame.psg.tone_2 = tone_field_value (2, current_state.tone_2, previous_state.tone_2);
+        previous_state.tone_2 = current_state.tone_2;
+    }
 
-        /* Add the new frame to the frame_data buffer */
-        for (int i = 0; i < new_frame_size; i++)
-        {
-            frame_data [frame_data_size++] = new_frame[i];
-        }
+    /* Noise */
+    if ((psg_dirty & NOISE_BIT) && current_state.noise != previous_state.noise)
+    {
+        new_frame.psg_bits |= NOISE_BIT;
+        new_frame.psg.noise = previous_state.noise = current_state.noise;
     }
 
-    if (frame_delay <= 8)
+    /* Volume 0 */
+    if ((psg_dirty & VOLUME_0_BIT) && current_state.volume_0 != previous_state.volume_0)
     {
-        uint16_t delay_bits = (frame_delay - 1) << 12;
-        index_data [index_data_count++] = delay_bits | index;
+        new_frame.psg_bits |= VOLUME_0_BIT;
+        new_frame.psg.volume_0 = previous_state.volume_0 = current_state.volume_0;
+        volume_macro_start (0, current_state.volume_0);
     }
-    else
+
+    /* Volume 1 */
+    if ((psg_dirty & VOLUME_1_BIT) && current_state.volume_1 != previous_state.volume_1)
     {
-        /* More than 16/60s delay requires multiple indexes */
-        index_data [index_data_count++] = 0x7000 | index;
-        frame_delay -= 8;
+        new_frame.psg_bits |= VOLUME_1_BIT;
+        new_frame.psg.volume_1 = previous_state.volume_1 = current_state.volume_1;
+        volume_macro_start (1, current_state.volume_1);
+    }
 
-        while (frame_delay)
+    /* Volume 2 */
+    if ((psg_dirty & VOLUME_2_BIT) && current_state.volume_2 != previous_state.volume_2)
+    {
+        new_frame.psg_bits |= VOLUME_2_BIT;
+        new_frame.psg.volume_2 = previous_state.volume_2 = current_state.volume_2;
+        volume_macro_start (2, current_state.volume_2);
+    }
+
+    /* Volume 3 */
+    if ((psg_dirty & VOLUME_3_BIT) && current_state.volume_3 != previous_state.volume_3)
+    {
+        new_frame.psg_bits |= VOLUME_3_BIT;
+        new_frame.psg.volume_3 = previous_state.volume_3 = current_state.volume_3;
+        volume_macro_start (3, current_state.volume_3);
+    }
+
+    psg_dirty = 0;
+
+    /* YM2413 register writes */
+    if (ym2413_enabled)
+    {
+        /* Changes to the custom instrument may be replaced by a patch from the patch table */
+        if (ym2413_dirty & 0xff)
         {
-            if (frame_delay <= 8)
+            int16_t patch = ym2413_patch_find (previous_ym2413_regs);
+            if (patch >= 0)
             {
-                uint16_t delay_bits = (frame_delay - 1) << 12;
-                index_data [index_data_count++] = delay_bits;
-                frame_delay = 0;
+                new_frame.ym2413_addr [new_frame.ym2413_count] = 0x40;
+                new_frame.ym2413_data [new_frame.ym2413_count++] = patch;
+                memcpy (previous_ym2413_regs, ym2413_regs, 8);
+                ym2413_dirty &= ~(uint64_t) 0xff;
             }
-            else
+        }
+
+        /* Visit the written registers in address order */
+        for (; ym2413_dirty != 0; ym2413_dirty &= ym2413_dirty - 1)
+        {
+            uint8_t addr = __builtin_ctzll (ym2413_dirty);
+
+            if (ym2413_regs [addr] != previous_ym2413_regs [addr])
             {
-                index_data [index_data_count++] = 0x7000;
-                frame_delay -= 8;
+                new_frame.ym2413_addr [new_frame.ym2413_count] = addr;
+                new_frame.ym2413_data [new_frame.ym2413_count++] = ym2413_regs [addr];
+                ym2413_change_count++;
+                previous_ym2413_regs [addr] = ym2413_regs [addr];
             }
         }
     }
@@ -276,126 +697,2830 @@ void write_frame (void)
 
 
 /*
- * Find repeating segments within index_data and use
- * references to these to save space.
- *
- * Format:
- *  [15]     - If 1, this entry refers to a sequence of previous indexes.
- *  [14..12] - Length of matching sequence, 2-9 words.
- *  [11..0]  - Index into compressed data.
+ * List the nibbles that follow the header in the SN76489 part of a frame.
+ * Returns the number of nibbles.
  */
-void compress_indexes (void)
+static uint8_t psg_nibbles (const frame *f, uint8_t *nibble)
 {
-    uint16_t match_length = 0;
+    uint16_t tones [3] = { f->psg.tone_0, f->psg.tone_1, f->psg.tone_2 };
+    uint8_t others [5] = { f->psg.noise, f->psg.volume_0, f->psg.volume_1, f->psg.volume_2, f->psg.volume_3 };
+    uint8_t nibble_count = 0;
 
-    /* Iterate over non-compressed data, adding it to the compressed data */
-    for (uint32_t i = 0; i < index_data_count; i += match_length)
+    for (uint8_t channel = 0; channel < 3; channel++)
     {
-        uint16_t longest_segment_index = 0;
-        uint16_t longest_segment_length = 0;
-        match_length = 0;
-
-        /* Iterate over compressed data, finding the longest matching segment */
-        for (uint32_t j = 0; j < compressed_index_data_count; j++)
+        if (f->psg_bits & (TONE_0_BIT << channel))
         {
-            /* Check the length of this match */
-            for (uint32_t k = 0; i + k < index_data_count && j + k < compressed_index_data_count; k++)
+            if (f->tone_delta_bits & (TONE_0_BIT << channel))
             {
-                if (compressed_index_data [j + k] == index_data [i + k])
-                {
-                    if (k + 1 > longest_segment_length)
-                    {
-                        longest_segment_index = j;
-                        longest_segment_length = k + 1;
-                    }
-                }
-                else
-                {
-                    break;
-                }
+                nibble [nibble_count++] = tones [channel];
+                continue;
             }
-        }
 
-        if (longest_segment_length >= 2)
-        {
-            /* Limit match length */
-            if (longest_segment_length > 9)
+            if (tone_table_count > 0)
             {
-                longest_segment_length = 9;
+                uint8_t entry = tone_table_entry [tones [channel]] ? tone_table_entry [tones [channel]] - 1 : TONE_TABLE_RAW;
+                nibble [nibble_count++] = entry & 0x07;
+                nibble [nibble_count++] = entry >> 3;
+
+                if (entry != TONE_TABLE_RAW)
+                {
+                    continue;
+                }
             }
 
-            /* Emit reference - 3 bits of length, 12 bits of index */
-            compressed_index_data [compressed_index_data_count++] = 0x8000 | ((longest_segment_length - 2) << 12) | longest_segment_index;
-            match_length = longest_segment_length;
-        }
-        else
-        {
-            /* Emit index */
-            compressed_index_data [compressed_index_data_count++] = index_data [i];
-            match_length = 1;
+            /* The first nibble leaves TONE_DELTA clear */
+            nibble [nibble_count++] = (tones [channel] & 0x007);
+            nibble [nibble_count++] = (tones [channel] & 0x078) >> 3;
+            nibble [nibble_count++] = (tones [channel] & 0x380) >> 7;
         }
+    }
 
-        if (loop_frame_index_outer == 0 &&
-            i + (match_length - 1) >= loop_frame_index)
+    for (uint8_t field = 0; field < 5; field++)
+    {
+        if (f->psg_bits & (NOISE_BIT << field))
         {
-            /* Outer index points at the next compressed element to play after this segment */
-            loop_frame_index_outer = compressed_index_data_count;
-
-            /* Inner index points to the loop frame itself */
-            if (longest_segment_length >= 2)
-            {
-                uint8_t depth = loop_frame_index - i;
-                loop_frame_index_inner = longest_segment_index + depth;
-                loop_frame_segment_end = longest_segment_index + match_length;
-            }
-            else
-            {
-                loop_frame_index_inner = loop_frame_index_outer - 1;
-                loop_frame_segment_end = loop_frame_index_outer;
-            }
-            uint16_t depth = i + match_length - loop_frame_index;
+            nibble [nibble_count++] = others [field] & 0x0f;
         }
     }
 
-    fprintf (stderr, "Compressed indexes: %d bytes (%d indexes).\n", compressed_index_data_count * 2, compressed_index_data_count);
+    return nibble_count;
 }
 
 
 /*
- * Entry point.
+ * Encode the SN76489 part of a frame in the nibble-packed layout.
+ * Returns the number of bytes used.
+ *
+ *  Bitfields: vvvv nttt
+ *
+ *  nttt -> 0001: Tone0 nibbles follow (3)
+ *          0010: Tone1 nibbles follow (3)
+ *          0100: Tone2 nibbles follow (3)
+ *          1000: Noise nibble follows
+ *
+ *          The three tone nibbles hold bits [2..0], [6..3], and [9..7]
+ *          of the period. With a tone table, the tone is instead two
+ *          nibbles holding bits [2..0] and [6..3] of its tone_table
+ *          entry. Entry TONE_TABLE_RAW is followed by the three nibbles
+ *          of a period that is not in the table.
+ *
+ *          A first tone nibble with TONE_DELTA set is the whole field,
+ *          a change of -4 to -1 (0x8 - 0xb) or +1 to +4 (0xc - 0xf).
+ *
+ *          Nibbles are packed least-significant nibble first.
+ *          Within an output bytes, the least-significant nibble comes first.
  *
- * Currently contains the parser for VGM commands
- * and generator for the output text.
+ *
+ *  vvvv -> 0001: Tone0 volume nibble follows
+ *       -> 0010: Tone1 volume nibble follows
+ *       -> 0100: Tone2 volume nibble follows
+ *       -> 1000: Noise volume nibble follows
+ *
+ *  Bytes follow in the order they appear in the above list.
+ *  Two bytes for the 10-bit tone registers.
  */
-int main (int argc, char **argv)
+static uint16_t psg_encode_nibbles (const frame *f, uint8_t *output)
 {
-    /* File I/O */
-    char *filename = argv [1];
-    uint8_t *buffer = NULL;
-    uint32_t vgm_offset = 0;
+    uint8_t frame_size = 1;
 
-    /* PSG */
-    uint8_t latch = 0;
-    uint8_t data = 0;
-    uint16_t data_low = 0;
-    uint16_t data_high = 0;
+    uint8_t nibble [26] = { 0 };
+    uint8_t nibble_count = psg_nibbles (f, nibble);
 
-    if (argc != 2)
+    output [0] = f->psg_bits;
+
+    /* Pack nibbles */
+    /* TODO: Use C bitfields */
+    for (int i = 0; i < nibble_count; i++)
     {
-        fprintf (stderr, "Error: No VGM file specified.\n");
-        return EXIT_FAILURE;
+        if (i % 2 == 0)
+        {
+            /* Low nibble */
+            output [frame_size] = (nibble [i] & 0x0f);
+        }
+        else
+        {
+            /* High nibble */
+            output [frame_size++] |= (nibble [i] & 0x0f) << 4;
+        }
     }
 
-    buffer = read_vgm (filename);
+    /* If we have an odd number of nibbles, remember to increment the frame size */
+    if (nibble_count % 2 == 1)
+    {
+        frame_size++;
+    }
+
+    return frame_size;
+}
+
+
+/*
+ * Encode the SN76489 part of a frame in the byte-aligned layout.
+ * Returns the number of bytes used.
+ *
+ * The header is the same as for the nibble-packed layout, but each field
+ * is stored as the byte(s) to be written to the SN76489. This takes more
+ * space, but avoids the nibble handling when decoding.
+ *
+ * Tone deltas are not used with this layout.
+ */
+static uint16_t psg_encode_bytes (const frame *f, uint8_t *output)
+{
+    uint16_t tones [3] = { f->psg.tone_0, f->psg.tone_1, f->psg.tone_2 };
+    uint8_t volumes [4] = { f->psg.volume_0, f->psg.volume_1, f->psg.volume_2, f->psg.volume_3 };
+    uint8_t frame_size = 0;
+
+    output [frame_size++] = f->psg_bits;
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        if (f->psg_bits & (TONE_0_BIT << channel))
+        {
+            output [frame_size++] = 0x80 | (channel << 5) | (tones [channel] & 0x0f);
+            output [frame_size++] = tones [channel] >> 4;
+        }
+    }
+
+    if (f->psg_bits & NOISE_BIT)
+    {
+        output [frame_size++] = 0xe0 | f->psg.noise;
+    }
+
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        if (f->psg_bits & (VOLUME_0_BIT << channel))
+        {
+            output [frame_size++] = 0x90 | (channel << 5) | volumes [channel];
+        }
+    }
+
+    return frame_size;
+}
+
+
+/*
+ * Lay out the start of the tone table by semitone, for --transpose.
+ * Returns the nibbles taken by the tones that are given entries.
+ *
+ * Each period is placed on the nearest semitone of the equal-tempered
+ * scale that the periods fit best, and the most used period on each
+ * semitone gets that semitone's entry. Entries for semitones within the
+ * range that are not used are left as zero, to be given other periods.
+ */
+static uint32_t tone_table_semitones_build (uint32_t *uses)
+{
+    uint16_t semitone_period [128] = { 0 };
+    uint32_t semitone_uses [128] = { 0 };
+    uint32_t nibbles = 0;
+    double tuning_x = 0.0;
+    double tuning_y = 0.0;
+    double tuning;
+    int16_t low = -1;
+    int16_t high = -1;
+
+    tone_table_semitones = 0;
+
+    /* Find the tuning as the average position of the periods between semitones */
+    for (uint16_t period = 1; period < 0x400; period++)
+    {
+        double angle = 2.0 * M_PI * 12.0 * log2 (period);
+
+        tuning_x += uses [period] * cos (angle);
+        tuning_y += uses [period] * sin (angle);
+    }
+    tuning = atan2 (tuning_y, tuning_x) / (2.0 * M_PI);
+
+    for (uint16_t period = 1; period < 0x400; period++)
+    {
+        uint8_t semitone = floor (12.0 * log2 (period) - tuning + 0.5);
+
+        if (uses [period] > semitone_uses [semitone])
+        {
+            semitone_period [semitone] = period;
+            semitone_uses [semitone] = uses [period];
+        }
+    }
+
+    for (uint8_t semitone = 0; semitone < 128; semitone++)
+    {
+        if (semitone_uses [semitone] > 0)
+        {
+            low = (low < 0) ? semitone : low;
+            high = semitone;
+        }
+    }
+
+    if (low < 0)
+    {
+        return 0;
+    }
+
+    /* Keep the busier end if the range does not fit */
+    while (high - low + 1 > TONE_TABLE_COUNT_MAX)
+    {
+        if (semitone_uses [low] < semitone_uses [high])
+        {
+            low++;
+        }
+        else
+        {
+            high--;
+        }
+    }
+
+    for (int16_t semitone = low; semitone <= high; semitone++)
+    {
+        uint16_t period = semitone_period [semitone];
+
+        if (semitone_uses [semitone] > 0)
+        {
+            tone_table_entry [period] = tone_table_count + 1;
+            nibbles += uses [period] * 2;
+            uses [period] = 0;
+        }
+
+        tone_table [tone_table_count++] = period;
+    }
+
+    tone_table_semitones = tone_table_count;
+
+    return nibbles;
+}
+
+
+/*
+ * Build the table of tone periods for the nibble-packed and Huffman layouts.
+ *
+ * Periods used by at least two unique frames are given entries, most used
+ * first. The table is dropped if it would not be smaller than storing each
+ * tone as its raw period. With --transpose, the table is always kept, and
+ * starts with an entry for each semitone.
+ */
+static void tone_table_build (uint8_t layout)
+{
+    static uint32_t uses [0x400];
+    uint32_t nibbles_raw = 0;
+    uint32_t nibbles_table = 0;
+
+    memset (uses, 0, sizeof (uses));
+    memset (tone_table_entry, 0, sizeof (tone_table_entry));
+    tone_table_count = 0;
+    tone_table_saving = 0;
+    tone_table_semitones = 0;
+
+    if (layout == LAYOUT_BYTE)
+    {
+        return;
+    }
+
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        uint16_t tones [3] = { frames [i].psg.tone_0, frames [i].psg.tone_1, frames [i].psg.tone_2 };
+
+        for (uint8_t channel = 0; channel < 3; channel++)
+        {
+            if ((frames [i].psg_bits & ~frames [i].tone_delta_bits) & (TONE_0_BIT << channel))
+            {
+                uses [tones [channel]]++;
+                nibbles_raw += 3;
+            }
+        }
+    }
+
+    if (tone_transpose_enabled)
+    {
+        nibbles_table += tone_table_semitones_build (uses);
+    }
+
+    /* Entries for unused semitones are already paid for, so
+     * they are given the most used of the other periods */
+    tone_table_fillers = 0;
+    for (uint16_t entry = 0; entry < tone_table_semitones; entry++)
+    {
+        uint16_t period_best = 0;
+
+        if (tone_table [entry] != 0)
+        {
+            continue;
+        }
+
+        for (uint16_t period = 1; period < 0x400; period++)
+        {
+            if (uses [period] > uses [period_best])
+            {
+                period_best = period;
+            }
+        }
+
+        if (uses [period_best] == 0)
+        {
+            tone_table_fillers++;
+            continue;
+        }
+
+        tone_table [entry] = period_best;
+        tone_table_entry [period_best] = entry + 1;
+        nibbles_table += uses [period_best] * 2;
+        uses [period_best] = 0;
+    }
+
+    /* An entry takes four nibbles in the table, and saves three
+     * nibbles on each use compared to an escaped raw period */
+    while (tone_table_count < TONE_TABLE_COUNT_MAX)
+    {
+        uint16_t period_best = 0;
+
+        for (uint16_t period = 1; period < 0x400; period++)
+        {
+            if (uses [period] > uses [period_best])
+            {
+                period_best = period;
+            }
+        }
+
+        if (uses [period_best] < 2)
+        {
+            break;
+        }
+
+        tone_table [tone_table_count++] = period_best;
+        tone_table_entry [period_best] = tone_table_count;
+        nibbles_table += uses [period_best] * 2;
+        uses [period_best] = 0;
+    }
+
+    for (uint16_t period = 0; period < 0x400; period++)
+    {
+        nibbles_table += uses [period] * 5;
+    }
+
+    if (nibbles_table + tone_table_count * 4 >= nibbles_raw && !tone_transpose_enabled)
+    {
+        memset (tone_table_entry, 0, sizeof (tone_table_entry));
+        tone_table_count = 0;
+        return;
+    }
+
+    tone_table_saving = ((int32_t) nibbles_raw - (int32_t) nibbles_table) / 2;
+}
+
+
+/*
+ * Build a canonical Huffman code for the nibbles in the unique frames,
+ * including the two nibbles of each frame header.
+ *
+ * If the code would be longer than HUFFMAN_LENGTH_MAX bits, the
+ * symbol counts are flattened until it fits.
+ */
+static void huffman_build (void)
+{
+    uint32_t symbol_counts [16] = { 0 };
+
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        uint8_t nibble [26] = { 0 };
+        uint8_t nibble_count = psg_nibbles (&frames [i], nibble);
+
+        if (frame_unused [i])
+        {
+            continue;
+        }
+
+        symbol_counts [frames [i].psg_bits & 0x0f]++;
+        symbol_counts [frames [i].psg_bits >> 4]++;
+        for (uint8_t j = 0; j < nibble_count; j++)
+        {
+            symbol_counts [nibble [j]]++;
+        }
+    }
+
+    while (true)
+    {
+        uint32_t weight [16];
+        int8_t parent [32];
+        uint8_t node_count = 16;
+        bool merged [32] = { false };
+        uint8_t length_max = 0;
+
+        memset (huffman_length, 0, sizeof (huffman_length));
+        memset (parent, -1, sizeof (parent));
+
+        /* Repeatedly merge the two lightest nodes */
+        uint32_t node_weight [32] = { 0 };
+        uint8_t live_count = 0;
+        for (uint8_t symbol = 0; symbol < 16; symbol++)
+        {
+            weight [symbol] = symbol_counts [symbol];
+            node_weight [symbol] = weight [symbol];
+            merged [symbol] = (weight [symbol] == 0);
+            live_count += (weight [symbol] != 0);
+        }
+
+        while (live_count > 1)
+        {
+            int8_t lightest [2] = { -1, -1 };
+
+            for (uint8_t node = 0; node < node_count; node++)
+            {
+                if (merged [node])
+                {
+                    continue;
+                }
+                if (lightest [0] < 0 || node_weight [node] < node_weight [lightest [0]])
+                {
+                    lightest [1] = lightest [0];
+                    lightest [0] = node;
+                }
+                else if (lightest [1] < 0 || node_weight [node] < node_weight [lightest [1]])
+                {
+                    lightest [1] = node;
+                }
+            }
+
+            node_weight [node_count] = node_weight [lightest [0]] + node_weight [lightest [1]];
+            parent [lightest [0]] = parent [lightest [1]] = node_count;
+            merged [lightest [0]] = merged [lightest [1]] = true;
+            node_count++;
+            live_count--;
+        }
+
+        /* The code length of each symbol is its depth in the tree */
+        for (uint8_t symbol = 0; symbol < 16; symbol++)
+        {
+            if (weight [symbol] == 0)
+            {
+                continue;
+            }
+
+            /* A lone symbol still needs one bit */
+            huffman_length [symbol] = 1;
+            for (int8_t node = parent [symbol]; node >= 0 && parent [node] >= 0; node = parent [node])
+            {
+                huffman_length [symbol]++;
+            }
+
+            if (huffman_length [symbol] > length_max)
+            {
+                length_max = huffman_length [symbol];
+            }
+        }
+
+        if (length_max <= HUFFMAN_LENGTH_MAX)
+        {
+            break;
+        }
+
+        /* Flatten the distribution and try again */
+        for (uint8_t symbol = 0; symbol < 16; symbol++)
+        {
+            if (symbol_counts [symbol] != 0)
+            {
+                symbol_counts [symbol] = (symbol_counts [symbol] + 1) / 2;
+            }
+        }
+    }
+
+    /* Assign canonical codes, in order of length and then symbol */
+    uint8_t code = 0;
+    memset (huffman_count, 0, sizeof (huffman_count));
+    huffman_symbol_count = 0;
+
+    for (uint8_t length = 1; length <= HUFFMAN_LENGTH_MAX; length++)
+    {
+        for (uint8_t symbol = 0; symbol < 16; symbol++)
+        {
+            if (huffman_length [symbol] == length)
+            {
+                huffman_code [symbol] = code++;
+                huffman_symbol [huffman_symbol_count++] = symbol;
+                huffman_count [length]++;
+            }
+        }
+        code <<= 1;
+    }
+}
+
+
+/*
+ * Encode the SN76489 part of a frame in the Huffman layout.
+ * Returns the number of bytes used.
+ *
+ * The header and field nibbles are the same as for the nibble-packed
+ * layout, with the header split into its low and then high nibble.
+ * Each nibble is replaced by its Huffman code, packed most-significant
+ * bit first. The frame is padded to a whole number of bytes.
+ */
+static uint16_t psg_encode_huffman (const frame *f, uint8_t *output)
+{
+    uint8_t nibble [28] = { f->psg_bits & 0x0f, f->psg_bits >> 4 };
+    uint8_t nibble_count = 2 + psg_nibbles (f, &nibble [2]);
+    uint16_t bit_count = 0;
+
+    for (uint8_t i = 0; i < nibble_count; i++)
+    {
+        for (int8_t bit = huffman_length [nibble [i]] - 1; bit >= 0; bit--)
+        {
+            if (bit_count % 8 == 0)
+            {
+                output [bit_count / 8] = 0;
+            }
+            if (huffman_code [nibble [i]] & (1 << bit))
+            {
+                output [bit_count / 8] |= 0x80 >> (bit_count % 8);
+            }
+            bit_count++;
+        }
+    }
+
+    return (bit_count + 7) / 8;
+}
+
+
+/*
+ * Encode the YM2413 part of a frame, using a reference to identical writes
+ * already in frame_data where possible. Returns the number of bytes used.
+ *
+ *  If the song uses the YM2413, the PSG data is followed by a byte
+ *  containing the number of YM2413 register writes in the frame. Each
+ *  write is then stored as an address byte followed by a data byte.
+ *
+ *  If the same YM2413 writes are already stored in frame_data, they can
+ *  instead be referred to with two bytes: 0x80 | index[11..8], index[7..0].
+ *
+ *  A write to address 0x40 loads custom instrument patch <data> from
+ *  ym2413_patch_data into registers 0x00 - 0x07.
+ */
+static uint16_t ym2413_encode (const frame *f, uint8_t *output)
+{
+    uint16_t ym2413_size = 0;
+
+    output [ym2413_size++] = f->ym2413_count;
+
+    for (uint8_t i = 0; i < f->ym2413_count; i++)
+    {
+        output [ym2413_size++] = f->ym2413_addr [i];
+        output [ym2413_size++] = f->ym2413_data [i];
+    }
+
+    /* A reference takes two bytes, so is only useful for larger sets of writes */
+    if (ym2413_size <= 2)
+    {
+        return ym2413_size;
+    }
+
+    for (uint32_t i = 0; i + ym2413_size <= frame_data_size && i <= 0x0fff; i++)
+    {
+        if (memcmp (output, &frame_data [i], ym2413_size) == 0)
+        {
+            ym2413_reference_saving += ym2413_size - 2;
+            output [0] = 0x80 | (i >> 8);
+            output [1] = i & 0xff;
+            return 2;
+        }
+    }
+
+    return ym2413_size;
+}
+
+
+/*
+ * Estimate the cycles needed to decode the SN76489 part of a frame.
+ */
+static uint16_t frame_decode_cycles (const frame *f, uint8_t layout)
+{
+    uint8_t fields = __builtin_popcount (f->psg_bits);
+    uint8_t tones = __builtin_popcount (f->psg_bits & (TONE_0_BIT | TONE_1_BIT | TONE_2_BIT));
+    uint8_t tones_looked_up = (tone_table_count > 0) ? tones - __builtin_popcount (f->tone_delta_bits) : 0;
+
+    if (layout == LAYOUT_BYTE)
+    {
+        return FRAME_CYCLES + (fields + tones) * BYTE_FIELD_CYCLES;
+    }
+    else if (layout == LAYOUT_HUFFMAN)
+    {
+        uint8_t nibble [28] = { f->psg_bits & 0x0f, f->psg_bits >> 4 };
+        uint8_t nibble_count = 2 + psg_nibbles (f, &nibble [2]);
+        uint16_t cycles = FRAME_CYCLES + nibble_count * HUFFMAN_SYMBOL_CYCLES + tones_looked_up * TONE_TABLE_CYCLES;
+
+        for (uint8_t i = 0; i < nibble_count; i++)
+        {
+            cycles += huffman_length [nibble [i]] * HUFFMAN_BIT_CYCLES;
+        }
+
+        return cycles;
+    }
+
+    uint8_t nibble [26];
+    return FRAME_CYCLES + psg_nibbles (f, nibble) * NIBBLE_FIELD_CYCLES + tones_looked_up * TONE_TABLE_CYCLES;
+}
+
+
+/*
+ * Find the offset of a sequence of bytes in the first size bytes
+ * of frame_data, up to 0x0fff. Returns -1 if it is not found.
+ */
+static int32_t frame_data_find (const uint8_t *bytes, uint16_t length, uint32_t size)
+{
+    for (uint32_t i = 0; i + length <= size && i <= 0x0fff; i++)
+    {
+        if (memcmp (&frame_data [i], bytes, length) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Pack the encoded frames into frame_data as a short common superstring.
+ *
+ * Frames that are contained within another frame are removed, and the
+ * rest are joined in chains, greedily taking the pairs with the longest
+ * overlap first. The zero frame stays at the start of frame_data.
+ *
+ * Frames that refer to YM2413 writes elsewhere in frame_data are placed
+ * last, once the data they refer to has found its new place.
+ */
+static void frame_data_pack (const bool *ym2413_reference)
+{
+    const uint8_t *bytes = frame_data_unpacked;
+    uint16_t *start = calloc (frame_count, sizeof (uint16_t));
+    uint16_t *length = calloc (frame_count, sizeof (uint16_t));
+    uint16_t *position = calloc (frame_count, sizeof (uint16_t));
+    int32_t *container = calloc (frame_count, sizeof (int32_t));
+    int32_t *next = calloc (frame_count, sizeof (int32_t));
+    int32_t *previous = calloc (frame_count, sizeof (int32_t));
+    int32_t *chain = calloc (frame_count, sizeof (int32_t));
+    uint8_t *overlap = calloc ((size_t) frame_count * frame_count, sizeof (uint8_t));
+    uint16_t overlap_max = 0;
+
+    memcpy (frame_data_unpacked, frame_data, frame_data_size);
+    frame_data_unpacked_size = frame_data_size;
+
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        start [i] = frame_indexes [i];
+        length [i] = ((i + 1 < frame_count) ? frame_indexes [i + 1] : frame_data_unpacked_size) - frame_indexes [i];
+        container [i] = -1;
+        next [i] = -1;
+        previous [i] = -1;
+        chain [i] = i;
+    }
+
+    /* Remove frames that are contained within a longer frame */
+    for (uint16_t i = 1; i < frame_count; i++)
+    {
+        for (uint16_t j = 0; j < frame_count && !ym2413_reference [i] && !frame_unused [i] && container [i] < 0; j++)
+        {
+            if (j == i || ym2413_reference [j] || length [j] < length [i] || (length [j] == length [i] && j > i))
+            {
+                continue;
+            }
+
+            for (uint16_t k = 0; k + length [i] <= length [j]; k++)
+            {
+                if (memcmp (&bytes [start [j] + k], &bytes [start [i]], length [i]) == 0)
+                {
+                    container [i] = j;
+                    position [i] = k;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Find the overlap of the end of each frame with the start of each other frame */
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        for (uint16_t j = 1; j < frame_count; j++)
+        {
+            if (i == j || container [i] >= 0 || container [j] >= 0 || ym2413_reference [i] || ym2413_reference [j] ||
+                frame_unused [i] || frame_unused [j])
+            {
+                continue;
+            }
+
+            for (uint16_t k = (length [i] < length [j] ? length [i] : length [j]) - 1; k > 0; k--)
+            {
+                if (memcmp (&bytes [start [i] + length [i] - k], &bytes [start [j]], k) == 0)
+                {
+                    overlap [(size_t) i * frame_count + j] = k;
+                    if (k > overlap_max)
+                    {
+                        overlap_max = k;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Join frames into chains, longest overlaps first */
+    for (uint16_t k = overlap_max; k > 0; k--)
+    {
+        for (uint16_t i = 0; i < frame_count; i++)
+        {
+            for (uint16_t j = 1; j < frame_count && next [i] < 0; j++)
+            {
+                if (overlap [(size_t) i * frame_count + j] != k || previous [j] >= 0 || chain [i] == chain [j])
+                {
+                    continue;
+                }
+
+                next [i] = j;
+                previous [j] = i;
+
+                /* Label the joined chain with the chain of its first frame */
+                for (int32_t f = j; f >= 0; f = next [f])
+                {
+                    chain [f] = chain [i];
+                }
+            }
+        }
+    }
+
+    /* Write out the chains, starting with the zero frame */
+    frame_data_size = 0;
+    for (uint16_t head = 0; head < frame_count; head++)
+    {
+        if (container [head] >= 0 || ym2413_reference [head] || previous [head] >= 0 || frame_unused [head])
+        {
+            continue;
+        }
+
+        for (int32_t f = head; f >= 0; f = next [f])
+        {
+            uint8_t skip = (previous [f] >= 0) ? overlap [(size_t) previous [f] * frame_count + f] : 0;
+
+            memcpy (&frame_data [frame_data_size], &bytes [start [f] + skip], length [f] - skip);
+            frame_indexes [f] = frame_data_size - skip;
+            frame_data_size += length [f] - skip;
+        }
+    }
+
+    /* Contained frames take their place within their container */
+    for (uint16_t i = 1; i < frame_count; i++)
+    {
+        int32_t outer = i;
+        uint32_t offset = 0;
+
+        while (container [outer] >= 0)
+        {
+            offset += position [outer];
+            outer = container [outer];
+        }
+
+        if (outer != i)
+        {
+            frame_indexes [i] = frame_indexes [outer] + offset;
+        }
+    }
+
+    /* Re-point the YM2413 references, and add their frames */
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        uint8_t encoded [FRAME_SIZE_MAX];
+        const uint8_t *reference;
+        int32_t target;
+        int32_t found = -1;
+
+        if (!ym2413_reference [i])
+        {
+            continue;
+        }
+
+        memcpy (encoded, &bytes [start [i]], length [i]);
+        reference = &bytes [((encoded [length [i] - 2] & 0x0f) << 8) | encoded [length [i] - 1]];
+        target = frame_data_find (reference, 1 + reference [0] * 2, frame_data_size);
+
+        if (target < 0)
+        {
+            /* Keep the frames as they were */
+            memcpy (frame_data, frame_data_unpacked, frame_data_unpacked_size);
+            frame_data_size = frame_data_unpacked_size;
+            memcpy (frame_indexes, start, frame_count * sizeof (uint16_t));
+            break;
+        }
+
+        encoded [length [i] - 2] = 0x80 | (target >> 8);
+        encoded [length [i] - 1] = target & 0xff;
+
+        /* Use an existing copy of the frame, or overlap the end of frame_data */
+        found = frame_data_find (encoded, length [i], frame_data_size);
+        if (found >= 0)
+        {
+            frame_indexes [i] = found;
+            continue;
+        }
+
+        for (uint16_t k = length [i] - 1; k > 0; k--)
+        {
+            if (k <= frame_data_size && memcmp (&frame_data [frame_data_size - k], encoded, k) == 0)
+            {
+                found = frame_data_size - k;
+                break;
+            }
+        }
+        if (found < 0)
+        {
+            found = frame_data_size;
+        }
+
+        memcpy (&frame_data [found], encoded, length [i]);
+        frame_indexes [i] = found;
+        frame_data_size = found + length [i];
+    }
+
+    free (start);
+    free (length);
+    free (position);
+    free (container);
+    free (next);
+    free (previous);
+    free (chain);
+    free (overlap);
+}
+
+
+/*
+ * Encode all unique frames into frame_data, using the nibble-packed,
+ * byte-aligned, or Huffman layout, recording the index of each.
+ *
+ * When frames are left out, the tone table is kept as it was, as the
+ * transposed references depend on its entries.
+ */
+static void frame_layout (uint8_t layout)
+{
+    static bool ym2413_reference [FRAME_COUNT_MAX] = { 0 };
+
+    frame_data_size = 0;
+    frame_index_max = 0;
+    ym2413_frame_data_size = 0;
+    ym2413_reference_saving = 0;
+
+    if (frame_unused_count == 0)
+    {
+        tone_table_build (layout);
+    }
+
+    if (layout == LAYOUT_HUFFMAN)
+    {
+        huffman_build ();
+    }
+
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        uint8_t *output = &frame_data [frame_data_size];
+        uint16_t psg_size = 0;
+        uint16_t ym2413_size = 0;
+
+        if (frame_unused [i])
+        {
+            frame_indexes [i] = frame_data_size;
+            ym2413_reference [i] = false;
+            continue;
+        }
+
+        switch (layout)
+        {
+        case LAYOUT_BYTE:
+            psg_size = psg_encode_bytes (&frames [i], output);
+            break;
+
+        case LAYOUT_HUFFMAN:
+            psg_size = psg_encode_huffman (&frames [i], output);
+            break;
+
+        default:
+            psg_size = psg_encode_nibbles (&frames [i], output);
+            break;
+        }
+
+        if (ym2413_enabled)
+        {
+            ym2413_size = ym2413_encode (&frames [i], &output [psg_size]);
+        }
+        ym2413_reference [i] = (ym2413_size > 0) && (output [psg_size] & 0x80);
+
+        frame_indexes [i] = frame_data_size;
+        frame_data_size += psg_size + ym2413_size;
+        ym2413_frame_data_size += ym2413_size;
+    }
+
+    frame_data_pack (ym2413_reference);
+
+    /* Frames that were left out still need an index of their own */
+    for (uint16_t i = 0, unused_index = frame_data_size; i < frame_count; i++)
+    {
+        if (frame_unused [i])
+        {
+            frame_indexes [i] = unused_index++;
+        }
+    }
+
+    /* Indexes use 12 bits. Layouts that do not fit are only reported by
+     * frame_layout_compare, and the converter fails if one is selected. */
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        if (frame_indexes [i] > frame_index_max)
+        {
+            frame_index_max = frame_indexes [i];
+        }
+    }
+
+    for (uint16_t i = frame_count; i > 0; i--)
+    {
+        index_frame [frame_indexes [i - 1] & 0x0fff] = i - 1;
+    }
+}
+
+
+/*
+ * Encode the frames with each layout, and report the size and
+ * estimated decode time of each. The chosen layout is left in frame_data.
+ */
+static void frame_layout_compare (uint8_t selected)
+{
+    const char *layout_names [LAYOUT_COUNT] = { "nibble-packed", "byte-aligned", "huffman" };
+    uint32_t size [LAYOUT_COUNT] = { 0 };
+
+    fprintf (encode_report, "Frame layouts (estimated SN76489 decode cycles per frame):\n");
+
+    for (uint8_t layout = 0; layout < LAYOUT_COUNT; layout++)
+    {
+        if (layout == LAYOUT_BYTE && tone_delta_enabled)
+        {
+            fprintf (encode_report, " - %-13s not available with tone deltas, use --fast to compare\n", layout_names [layout]);
+            continue;
+        }
+
+        frame_layout (layout);
+        size [layout] = frame_data_size;
+
+        fprintf (encode_report, " - %-13s %5d bytes, %d saved by overlapping frames%s%s\n", layout_names [layout],
+                 size [layout], frame_data_unpacked_size - frame_data_size, layout == selected ? " (selected)" : "",
+                 frame_index_max > FRAME_INDEX_LIMIT ? ", too large to index" : "");
+        if (tone_table_count > 0)
+        {
+            fprintf (encode_report, "   - %d tone table entries (%d bytes), saving around %d bytes of frame data\n",
+                     tone_table_count, tone_table_count * 2, tone_table_saving);
+        }
+
+        for (uint8_t song_index = 0; song_index < song_count; song_index++)
+        {
+            song *s = &songs [song_index];
+            uint32_t cycles_total = 0;
+            uint16_t cycles_max = 0;
+
+            for (uint32_t i = s->index_start; i < s->index_end; i++)
+            {
+                uint16_t cycles = frame_decode_cycles (&frames [index_data [i] & 0x0fff], layout);
+                cycles_total += cycles;
+                if (cycles > cycles_max)
+                {
+                    cycles_max = cycles;
+                }
+            }
+
+            fprintf (encode_report, "   - %s: %3d cycles average, %3d cycles worst-case\n", s->filename,
+                     cycles_total / (s->index_end - s->index_start), cycles_max);
+        }
+    }
+
+    fprintf (encode_report, "Huffman coding saves %d bytes over nibble-packing (%d%%), with a %d byte table.\n",
+             (int) size [LAYOUT_NIBBLE] - (int) size [LAYOUT_HUFFMAN],
+             ((int) size [LAYOUT_NIBBLE] - (int) size [LAYOUT_HUFFMAN]) * 100 / (int) size [LAYOUT_NIBBLE],
+             HUFFMAN_LENGTH_MAX + 1 + huffman_symbol_count);
+
+    frame_layout (selected);
+}
+
+
+/*
+ * Find new_frame in the unique frames, adding it if it is new.
+ * Returns its frame number.
+ */
+static uint16_t frame_find (void)
+{
+    /* Check if the frame already exists */
+    for (int i = 0; i < frame_count; i++)
+    {
+        if (memcmp (&new_frame, &frames [i], sizeof (frame)) == 0)
+        {
+            /* Found */
+            return i;
+        }
+    }
+
+    /* If a matching frame was not found, then this is a new unique frame. */
+    /* Check there is space for a new frame, as we use 12 bits to index them */
+    if (frame_count > 0x0fff)
+    {
+        fprintf (stderr, "Error: Too many unique frames.\n");
+        exit (EXIT_FAILURE);
+    }
+
+    memcpy (&frames [frame_count], &new_frame, sizeof (frame));
+    ym2413_patch_saving += new_frame_patch_saving;
+
+    return frame_count++;
+}
+
+
+/*
+ * Add the indexes for a frame and its delay to index_data, recording
+ * the state of the volume macros at the start of each index.
+ */
+static void index_data_write (uint16_t index, uint16_t frame_delay, uint64_t macro_state, uint64_t macro_state_later)
+{
+    /* Check there is space for the indexes, with up to 8/60s of delay each */
+    if (index_data_count + frame_delay / 8 + 1 >= INDEX_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too much index data.\n");
+        exit (EXIT_FAILURE);
+    }
+
+    index_macro_state [index_data_count] = macro_state;
+
+    if (frame_delay <= 8)
+    {
+        uint16_t delay_bits = (frame_delay - 1) << 12;
+        index_data [index_data_count++] = delay_bits | index;
+    }
+    else
+    {
+        /* More than 16/60s delay requires multiple indexes */
+        index_data [index_data_count++] = 0x7000 | index;
+        frame_delay -= 8;
+
+        while (frame_delay)
+        {
+            index_macro_state [index_data_count] = macro_state_later;
+
+            if (frame_delay <= 8)
+            {
+                uint16_t delay_bits = (frame_delay - 1) << 12;
+                index_data [index_data_count++] = delay_bits;
+                frame_delay = 0;
+            }
+            else
+            {
+                index_data [index_data_count++] = 0x7000;
+                frame_delay -= 8;
+            }
+        }
+    }
+}
+
+
+/*
+ * Adds a frame to the output buffers.
+ *
+ * If the frame is new, it is added both to frames and index_data.
+ * If the frame is a duplicate, it is only added to index_data.
+ *
+ * If a volume macro writes a volume that differs from the song during
+ * the delay, the delay is split so that another frame can correct it.
+ *
+ * Until the frames are encoded by frame_layout (), the index
+ * field holds the frame number rather than an index into frame_data.
+ *
+ * Format:
+ *  [15]     - Always output 0, reserved for use by compression
+ *  [14..12] - Delay, 1/60 to 8/60s
+ *  [11..0]  - Index into frame data
+ */
+void write_frame (uint16_t frame_delay)
+{
+    /* The final frame may have less than 1/60s of delay remaining */
+    if (frame_delay == 0)
+    {
+        frame_delay = 1;
+    }
+
+    /* The firmware runs the volume macros before reading each frame */
+    uint64_t macro_state = volume_macros_state ();
+    volume_macros_step ();
+
+    while (frame_delay > 0)
+    {
+        uint16_t ticks = 1;
+        uint64_t macro_state_next = macro_state;
+        bool macro_active_later = false;
+
+        generate_frame ();
+        uint16_t index = frame_find ();
+
+        /* If a macro writes a volume that differs from the song before
+         * the delay is over, a new frame is needed to correct it */
+        while (ticks < frame_delay)
+        {
+            macro_state_next = volume_macros_state ();
+            macro_active_later |= volume_macros_active ();
+            if (volume_macros_step ())
+            {
+                break;
+            }
+            ticks++;
+        }
+
+        /* Indexes that continue a long delay only have a known state if no macros are running */
+        index_data_write (index, ticks, macro_state, macro_active_later ? MACRO_STATE_UNKNOWN : macro_state_next);
+        frame_delay -= ticks;
+        macro_state = macro_state_next;
+    }
+}
+
+
+/*
+ * Add a value and its delay to a channel stream.
+ */
+static void stream_write (uint16_t value, uint32_t delay)
+{
+    if (index_data_count + delay / 8 + 1 >= INDEX_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too much index data.\n");
+        exit (EXIT_FAILURE);
+    }
+
+    /* Delays of more than 8/60s are continued with hold elements */
+    index_data [index_data_count++] = (((delay > 8 ? 8 : delay) - 1) << 12) | value;
+    delay -= (delay > 8 ? 8 : delay);
+
+    while (delay)
+    {
+        index_data [index_data_count++] = (((delay > 8 ? 8 : delay) - 1) << 12) | STREAM_HOLD;
+        delay -= (delay > 8 ? 8 : delay);
+    }
+}
+
+
+/*
+ * Split the frame indexes of each song into per-channel streams.
+ *
+ * The YM2413 writes of each frame are stored in frame_data, and
+ * the YM2413 stream refers to them by their index.
+ *
+ * Format:
+ *  [15]     - Always output 0, reserved for use by compression
+ *  [14..12] - Delay, 1/60 to 8/60s
+ *  [11]     - If 1, hold the current value for the delay
+ *  [10..0]  - Value for the channel: Tone, noise, or volume,
+ *             or an index into frame_data for the YM2413
+ */
+static void channel_streams_generate (void)
+{
+    static uint16_t ym2413_index [FRAME_COUNT_MAX] = { 0 };
+
+    memcpy (stream_source, index_data, index_data_count * sizeof (uint16_t));
+    index_data_count = 0;
+
+    stream_count = ym2413_enabled ? 9 : 8;
+
+    /* Store each unique set of YM2413 writes */
+    frame_data_size = 0;
+    ym2413_reference_saving = 0;
+    for (uint16_t i = 0; ym2413_enabled && i < frame_count; i++)
+    {
+        if (frames [i].ym2413_count == 0)
+        {
+            continue;
+        }
+
+        uint8_t *output = &frame_data [frame_data_size];
+        uint16_t size = ym2413_encode (&frames [i], output);
+
+        if (output [0] & 0x80)
+        {
+            /* Identical writes are already stored */
+            ym2413_index [i] = ((output [0] & 0x0f) << 8) | output [1];
+        }
+        else
+        {
+            ym2413_index [i] = frame_data_size;
+            frame_data_size += size;
+        }
+
+        if (ym2413_index [i] >= STREAM_HOLD)
+        {
+            fprintf (stderr, "Error: YM2413 frame_data too large to index.\n");
+            exit (EXIT_FAILURE);
+        }
+    }
+    ym2413_frame_data_size = frame_data_size;
+
+    for (uint8_t song_index = 0; song_index < song_count; song_index++)
+    {
+        const char *stream_names [STREAM_COUNT_MAX] = { "tone 0", "tone 1", "tone 2", "noise",
+                                                        "volume 0", "volume 1", "volume 2", "volume 3", "ym2413" };
+        song *source = &songs [song_index];
+
+        for (uint8_t stream = 0; stream < stream_count; stream++)
+        {
+            song *s = &streams [song_index][stream];
+            uint16_t value = STREAM_HOLD;
+            uint32_t delay = 0;
+
+            s->filename = malloc (strlen (source->filename) + 16);
+            sprintf (s->filename, "%s (%s)", source->filename, stream_names [stream]);
+            s->index_start = index_data_count;
+
+            for (uint32_t i = source->index_start; i < source->index_end; i++)
+            {
+                const frame *f = &frames [stream_source [i] & 0x0fff];
+                bool write = (stream < 8) ? (f->psg_bits & (1 << stream)) : (f->ym2413_count > 0);
+
+                /* Start a new element for each write, and at the loop point */
+                if (write || i == source->loop_frame_index)
+                {
+                    if (delay > 0)
+                    {
+                        stream_write (value, delay);
+                    }
+                    if (i == source->loop_frame_index)
+                    {
+                        s->loop_frame_index = index_data_count;
+                    }
+                    value = STREAM_HOLD;
+                    delay = 0;
+                }
+
+                if (write)
+                {
+                    switch (stream)
+                    {
+                        case 0: value = f->psg.tone_0; break;
+                        case 1: value = f->psg.tone_1; break;
+                        case 2: value = f->psg.tone_2; break;
+                        case 3: value = f->psg.noise; break;
+                        case 4: value = f->psg.volume_0; break;
+                        case 5: value = f->psg.volume_1; break;
+                        case 6: value = f->psg.volume_2; break;
+                        case 7: value = f->psg.volume_3; break;
+                        default: value = ym2413_index [stream_source [i] & 0x0fff]; break;
+                    }
+                }
+
+                delay += ((stream_source [i] >> 12) & 0x07) + 1;
+            }
+
+            stream_write (value, delay);
+            s->index_end = index_data_count;
+        }
+    }
+
+    fprintf (encode_report, "Channel streams: %d indexes, compared to %d frame indexes.\n", index_data_count,
+             songs [song_count - 1].index_end);
+}
+
+
+/*
+ * Replace the frame numbers in index_data with indexes into frame_data.
+ */
+static void index_data_resolve (void)
+{
+    for (uint32_t i = 0; i < index_data_count; i++)
+    {
+        index_data [i] = (index_data [i] & 0xf000) | frame_indexes [index_data [i] & 0x0fff];
+    }
+}
+
+
+/*
+ * Check if an element of index_data has nothing to write.
+ */
+static bool index_is_rest (uint16_t element)
+{
+    if (channel_streams)
+    {
+        return (element & 0x8800) == STREAM_HOLD;
+    }
+
+    /* The zero frame is always at the start of frame_data */
+    return (element & 0x8fff) == 0;
+}
+
+
+/*
+ * Split a song's index_data into tokens for compression. Each token is one
+ * index, or 0xffff with a long delay in the upper 16 bits. Runs of elements
+ * with nothing to write are merged into a single delay.
+ *
+ * Returns the number of tokens, and the token at the loop point.
+ */
+static uint32_t index_tokenize (const song *s, uint32_t *loop_token)
+{
+    uint32_t token_count = 0;
+
+    *loop_token = s->index_end;
+
+    for (uint32_t i = s->index_start; i < s->index_end; )
+    {
+        uint32_t delay = 0;
+        uint32_t j;
+
+        if (i == s->loop_frame_index)
+        {
+            *loop_token = token_count;
+        }
+
+        if (!index_is_rest (index_data [i]))
+        {
+            index_tokens [token_count++] = index_data [i++];
+            continue;
+        }
+
+        /* Sum the run of rests, which may not continue over the loop point */
+        for (j = i; j < s->index_end && index_is_rest (index_data [j]) &&
+                    (j == i || j != s->loop_frame_index) && delay + 8 <= 0xffff; j++)
+        {
+            delay += ((index_data [j] >> 12) & 0x07) + 1;
+        }
+
+        if (delay > 8)
+        {
+            index_tokens [token_count++] = (delay << 16) | 0xffff;
+            index_long_delay_count++;
+        }
+        else
+        {
+            index_tokens [token_count++] = ((delay - 1) << 12) | (index_data [i] & 0x0fff);
+        }
+        i = j;
+    }
+
+    return token_count;
+}
+
+
+/*
+ * Choose the indexes to give one-byte codes, from their use in the
+ * last compression of the indexes.
+ */
+static void index_hot_select (void)
+{
+    memset (index_hot_code, 0, sizeof (index_hot_code));
+    index_hot_count = 0;
+
+    while (index_hot_count < INDEX_HOT_COUNT_MAX)
+    {
+        uint16_t best = 0;
+
+        for (uint32_t i = 1; i < 0x8000; i++)
+        {
+            if (index_literal_uses [i] > index_literal_uses [best])
+            {
+                best = i;
+            }
+        }
+
+        if (index_literal_uses [best] < INDEX_HOT_USES_MIN)
+        {
+            break;
+        }
+
+        index_hot [index_hot_count++] = best;
+        index_hot_code [best] = index_hot_count;
+        index_literal_uses [best] = 0;
+    }
+
+    memset (index_literal_uses, 0, sizeof (index_literal_uses));
+}
+
+
+/*
+ * Append a token from index_tokenize () to the compressed data.
+ */
+static void index_literal_write (uint32_t token)
+{
+    uint8_t *output = &compressed_index_data [compressed_index_data_size];
+
+    if (token > 0xffff)
+    {
+        output [0] = INDEX_LONG_DELAY;
+        output [1] = token >> 24;
+        output [2] = token >> 16;
+        compressed_index_data_size += 3;
+        compressed_literal [compressed_element_count] = INDEX_NO_LITERAL;
+        return;
+    }
+
+    if (index_hot_code [token])
+    {
+        output [0] = INDEX_HOT + index_hot_code [token] - 1;
+        compressed_index_data_size += 1;
+    }
+    else
+    {
+        output [0] = token >> 8;
+        output [1] = token & 0xff;
+        compressed_index_data_size += 2;
+    }
+    compressed_literal [compressed_element_count] = token;
+}
+
+
+/*
+ * Check if a token from index_tokenize () plays the same as another
+ * token would with its tone table entries moved by *transpose.
+ *
+ * A transpose of TRANSPOSE_ANY is set by the first tone that is
+ * looked up in the tone table. Deltas and raw periods must match.
+ */
+static bool index_token_transposed (uint32_t token, uint32_t transposed, int16_t *transpose)
+{
+    if (token > 0xffff || transposed > 0xffff || ((token ^ transposed) & 0xf000))
+    {
+        return token == transposed;
+    }
+
+    const frame *a = &frames [index_frame [token & 0x0fff]];
+    const frame *b = &frames [index_frame [transposed & 0x0fff]];
+    uint16_t tones_a [3] = { a->psg.tone_0, a->psg.tone_1, a->psg.tone_2 };
+    uint16_t tones_b [3] = { b->psg.tone_0, b->psg.tone_1, b->psg.tone_2 };
+
+    if (a->psg_bits != b->psg_bits || a->tone_delta_bits != b->tone_delta_bits ||
+        a->psg.noise != b->psg.noise || a->psg.volume_0 != b->psg.volume_0 ||
+        a->psg.volume_1 != b->psg.volume_1 || a->psg.volume_2 != b->psg.volume_2 ||
+        a->psg.volume_3 != b->psg.volume_3 || a->ym2413_count != b->ym2413_count ||
+        memcmp (a->ym2413_addr, b->ym2413_addr, a->ym2413_count) != 0 ||
+        memcmp (a->ym2413_data, b->ym2413_data, a->ym2413_count) != 0)
+    {
+        return false;
+    }
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        uint16_t entry_a = tone_table_entry [tones_a [channel]];
+        uint16_t entry_b = tone_table_entry [tones_b [channel]];
+
+        if (!(a->psg_bits & ~a->tone_delta_bits & (TONE_0_BIT << channel)) || entry_a == 0)
+        {
+            if (tones_a [channel] != tones_b [channel])
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if (entry_b == 0 || (*transpose != TRANSPOSE_ANY && entry_b - entry_a != *transpose))
+        {
+            return false;
+        }
+
+        *transpose = entry_b - entry_a;
+    }
+
+    return true;
+}
+
+
+/*
+ * Find repeating segments within index_data and use
+ * references to these to save space.
+ *
+ * References may point to data from any song that
+ * has already been compressed, including data that
+ * contains further references.
+ *
+ * Each element of the compressed data is one of:
+ *
+ *  0ddd iiii iiii iiii - An index, with a delay of 1/60 to 8/60s.
+ *
+ *  10ll oooo oooo oooo - A reference to 2-4 elements, starting at byte
+ *                        offset o. A length of 3 means that the number
+ *                        of elements follows in the next byte.
+ *
+ *  11hh hhhh           - Entry h (0-61) from the table of common indexes.
+ *
+ *  1111 1110 tttt tttt  - The reference that follows is played with each
+ *                        tone table entry moved by t, a signed byte.
+ *
+ *  1111 1111           - A delay with nothing to write, with the delay in
+ *                        1/60s in the next two bytes.
+ *
+ * Multi-byte values are stored with the most significant byte first.
+ */
+void compress_indexes (song *s)
+{
+    uint32_t loop_token;
+    uint32_t token_count = index_tokenize (s, &loop_token);
+    uint32_t match_length = 0;
+
+    s->start = compressed_index_data_size;
+    s->loop = compressed_index_data_size;
+
+    /* Find what it would cost to store the tokens as they are */
+    for (uint32_t i = 0; i < token_count; i++)
+    {
+        uint32_t cost = (index_tokens [i] > 0xffff) ? 3 : index_hot_code [index_tokens [i]] ? 1 : 2;
+        index_token_cost [i + 1] = index_token_cost [i] + cost;
+    }
+
+    /* Iterate over non-compressed data, adding it to the compressed data */
+    for (uint32_t i = 0; i < token_count; i += match_length)
+    {
+        uint32_t remaining = token_count - i;
+        uint32_t element = compressed_element_count;
+        uint32_t longest_segment_index = 0;
+        uint32_t longest_segment_elements = 0;
+        uint32_t longest_segment_length = 0;
+        uint32_t longest_segment_value = 0;
+        uint32_t longest_segment_cost = 0;
+        uint8_t longest_segment_depth = 0;
+        int16_t longest_segment_transpose = 0;
+
+        /* The loop must start with an element of the song's own data, so
+         * that the firmware can return to it without a stack of segments */
+        if (i == loop_token)
+        {
+            s->loop = compressed_index_data_size;
+        }
+        else if (i < loop_token && loop_token - i < remaining)
+        {
+            remaining = loop_token - i;
+        }
+
+        if (compressed_element_count + 1 >= INDEX_COUNT_MAX)
+        {
+            fprintf (stderr, "Error: Too much compressed index data.\n");
+            exit (EXIT_FAILURE);
+        }
+
+        /* Iterate over compressed data, finding the matching segment that
+         * replaces the most bytes of indexes for its size. References use 12
+         * bits to hold the offset, but an element from anywhere can be copied. */
+        for (uint32_t j = 0; j < compressed_element_count; j++)
+        {
+            uint32_t elements_max = (compressed_offset [j] <= INDEX_OFFSET_MAX) ? compressed_element_count - j : 1;
+            uint32_t expansion = compressed_expansion [j];
+            uint32_t available = compressed_expansion [j + elements_max] - expansion;
+
+            if (available > remaining)
+            {
+                available = remaining;
+            }
+
+            /* Check the length of this match, and then with --transpose, of
+             * a match with its tones transposed, which must be a reference */
+            for (uint8_t pass = 0; pass < (tone_transpose_enabled ? 2 : 1); pass++)
+            {
+                int16_t transpose = TRANSPOSE_ANY;
+                uint32_t transpose_from = 0;    /* Tokens matched before the transposition is known */
+                uint32_t k = 0;
+                uint8_t depth = 0;
+
+                if (pass == 0)
+                {
+                    while (k < available && expanded_index_data [expansion + k] == index_tokens [i + k])
+                    {
+                        k++;
+                    }
+                }
+                else
+                {
+                    while (k < available && index_token_transposed (expanded_index_data [expansion + k],
+                                                                    index_tokens [i + k], &transpose))
+                    {
+                        transpose_from = (transpose == TRANSPOSE_ANY) ? k + 1 : transpose_from;
+                        k++;
+                    }
+
+                    if (transpose == TRANSPOSE_ANY || transpose == 0)
+                    {
+                        continue;
+                    }
+                }
+
+                /* Find how many whole elements of compressed data match */
+                for (uint32_t n = 1; n <= elements_max && compressed_expansion [j + n] - expansion <= k; n++)
+                {
+                    uint32_t length = compressed_expansion [j + n] - expansion;
+                    uint32_t value = index_token_cost [i + length] - index_token_cost [i];
+                    uint32_t cost = compressed_offset [j + 1] - compressed_offset [j];
+
+                    if (compressed_depth [j + n - 1] > depth)
+                    {
+                        depth = compressed_depth [j + n - 1];
+                    }
+
+                    /* A single element is copied, longer matches become a reference */
+                    if (n >= 2)
+                    {
+                        if (depth + 1 > INDEX_NESTING_MAX || n > 0xff)
+                        {
+                            break;
+                        }
+                        cost = (n > INDEX_REFERENCE_MAX) ? 3 : 2;
+                    }
+
+                    /* A transposed reference takes two more bytes, and is only
+                     * needed once a tone has been moved by the transposition */
+                    if (pass == 1)
+                    {
+                        if (n < 2 || length <= transpose_from)
+                        {
+                            continue;
+                        }
+                        cost += 2;
+                    }
+
+                    if (value * longest_segment_cost > longest_segment_value * cost ||
+                        (value * longest_segment_cost == longest_segment_value * cost && length > longest_segment_length) ||
+                        (length == longest_segment_length && cost == longest_segment_cost &&
+                         (n == 1 ? depth : depth + 1) < longest_segment_depth))
+                    {
+                        longest_segment_index = j;
+                        longest_segment_elements = n;
+                        longest_segment_length = length;
+                        longest_segment_value = value;
+                        longest_segment_cost = cost;
+                        longest_segment_depth = (n == 1) ? depth : depth + 1;
+                        longest_segment_transpose = (pass == 1) ? transpose : 0;
+                    }
+                }
+            }
+        }
+
+        if (longest_segment_elements == 0)
+        {
+            /* Emit index, or a long delay */
+            index_literal_write (index_tokens [i]);
+            compressed_depth [element] = 0;
+            match_length = 1;
+        }
+        else if (longest_segment_elements == 1)
+        {
+            /* Emit a copy of an existing element */
+            uint32_t size = compressed_offset [longest_segment_index + 1] - compressed_offset [longest_segment_index];
+
+            memcpy (&compressed_index_data [compressed_index_data_size],
+                    &compressed_index_data [compressed_offset [longest_segment_index]], size);
+            compressed_index_data_size += size;
+            compressed_literal [element] = compressed_literal [longest_segment_index];
+            compressed_depth [element] = longest_segment_depth;
+            match_length = longest_segment_length;
+        }
+        else
+        {
+            /* Emit reference - 2 bits of length, 12 bits of offset */
+            uint8_t *output = &compressed_index_data [compressed_index_data_size];
+            uint16_t offset = compressed_offset [longest_segment_index];
+
+            if (longest_segment_transpose != 0)
+            {
+                *output++ = INDEX_TRANSPOSE;
+                *output++ = (uint8_t) longest_segment_transpose;
+                compressed_index_data_size += 2;
+                index_transposed_count++;
+            }
+            uint8_t length_code = (longest_segment_elements > INDEX_REFERENCE_MAX) ? INDEX_REFERENCE_LONG
+                                                                                   : longest_segment_elements - 2;
+
+            output [0] = INDEX_REFERENCE | (length_code << 4) | (offset >> 8);
+            output [1] = offset & 0xff;
+            compressed_index_data_size += 2;
+
+            if (length_code == INDEX_REFERENCE_LONG)
+            {
+                output [2] = longest_segment_elements;
+                compressed_index_data_size += 1;
+                index_long_reference_count++;
+            }
+
+            compressed_literal [element] = INDEX_NO_LITERAL;
+            compressed_depth [element] = longest_segment_depth;
+            match_length = longest_segment_length;
+        }
+
+        if (compressed_literal [element] != INDEX_NO_LITERAL)
+        {
+            index_literal_uses [compressed_literal [element]]++;
+        }
+
+        if (compressed_depth [element] > compressed_depth_max)
+        {
+            compressed_depth_max = compressed_depth [element];
+        }
+
+        /* Keep the expansion of the compressed data for later matches */
+        memcpy (&expanded_index_data [compressed_expansion [element]], &index_tokens [i],
+                match_length * sizeof (uint32_t));
+        compressed_expansion [element + 1] = compressed_expansion [element] + match_length;
+        compressed_offset [element + 1] = compressed_index_data_size;
+        compressed_element_count++;
+    }
+
+    s->end = compressed_index_data_size;
+}
+
+
+/*
+ * Compress the indexes of all songs, or of all channel streams.
+ *
+ * The indexes that are left in the compressed data most often are
+ * only known after compressing, so this is done twice, with the
+ * second pass giving one-byte codes to the most used indexes.
+ */
+static void songs_compress (void)
+{
+    index_hot_count = 0;
+    memset (index_hot_code, 0, sizeof (index_hot_code));
+    memset (index_literal_uses, 0, sizeof (index_literal_uses));
+
+    for (uint8_t pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+        {
+            index_hot_select ();
+        }
+
+        compressed_index_data_size = 0;
+        compressed_element_count = 0;
+        compressed_depth_max = 0;
+        index_long_delay_count = 0;
+        index_long_reference_count = 0;
+        index_transposed_count = 0;
+
+        for (int i = 0; i < song_count; i++)
+        {
+            for (int stream = 0; stream < stream_count; stream++)
+            {
+                compress_indexes (channel_streams ? &streams [i][stream] : &songs [i]);
+            }
+        }
+    }
+
+    index_hot_uses = 0;
+    for (uint8_t i = 0; i < index_hot_count; i++)
+    {
+        index_hot_uses += index_literal_uses [index_hot [i]];
+    }
+}
+
+
+/*
+ * Return the indexes in index_data to frame numbers, so that
+ * the frames can be laid out again.
+ */
+static void index_data_unresolve (void)
+{
+    for (uint32_t i = 0; i < index_data_count; i++)
+    {
+        index_data [i] = (index_data [i] & 0xf000) | index_frame [index_data [i] & 0x0fff];
+    }
+}
+
+
+/*
+ * Check if any frame left out of frame_data is still written
+ * by an index in the compressed data.
+ */
+static bool frame_unused_written (void)
+{
+    for (uint32_t i = 0; i < compressed_element_count; i++)
+    {
+        if (compressed_literal [i] != INDEX_NO_LITERAL && frame_unused [index_frame [compressed_literal [i] & 0x0fff]])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Leave out the frames that are only played through transposed references,
+ * and lay out the frames and compress the indexes again.
+ *
+ * Only the values of the indexes change, so they compress the same way.
+ * If a frame that was left out is needed after all, every frame is kept.
+ */
+static void frame_unused_remove (void)
+{
+    static bool written [FRAME_COUNT_MAX];
+
+    memset (written, 0, sizeof (written));
+    written [0] = true;
+
+    for (uint32_t i = 0; i < compressed_element_count; i++)
+    {
+        if (compressed_literal [i] != INDEX_NO_LITERAL)
+        {
+            written [index_frame [compressed_literal [i] & 0x0fff]] = true;
+        }
+    }
+
+    /* Frames with YM2413 writes may hold data that other frames refer to */
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        if (!written [i] && frames [i].ym2413_count == 0)
+        {
+            frame_unused [i] = true;
+            frame_unused_count++;
+        }
+    }
+
+    if (frame_unused_count == 0)
+    {
+        return;
+    }
+
+    index_data_unresolve ();
+    frame_layout (frame_layout_selected);
+    index_data_resolve ();
+    songs_compress ();
+
+    if (frame_unused_written ())
+    {
+        fprintf (encode_report, "Warning: Frames only played transposed could not be left out.\n");
+        memset (frame_unused, 0, sizeof (frame_unused));
+        frame_unused_count = 0;
+
+        index_data_unresolve ();
+        frame_layout (frame_layout_selected);
+        index_data_resolve ();
+        songs_compress ();
+    }
+}
+
+
+/*
+ * Process a PSG register write from the VGM file.
+ */
+void psg_register_write (uint8_t data)
+{
+    uint16_t data_low  = data & 0x0f;
+    uint16_t data_high = data << 0x04;
+
+    if (data & 0x80) { /* Latch + data-low (4-bits) */
+
+        psg_latch = data & 0x70;
+
+        switch (psg_latch)
+        {
+        /* Tone0 */
+        case 0x00:
+            current_state.tone_0 &= 0x3f0;
+            current_state.tone_0 |= data_low;
+            psg_dirty |= TONE_0_BIT;
+            break;
+
+        case 0x10:
+            current_state.volume_0 = data_low;
+            psg_dirty |= VOLUME_0_BIT;
+            break;
+
+        /* Tone1 */
+        case 0x20:
+            current_state.tone_1 &= 0x3f0;
+            current_state.tone_1 |= data_low;
+            psg_dirty |= TONE_1_BIT;
+            break;
+
+        case 0x30:
+            current_state.volume_1 = data_low;
+            psg_dirty |= VOLUME_1_BIT;
+            break;
+
+        /* Tone2 */
+        case 0x40:
+            current_state.tone_2 &= 0x3f0;
+            current_state.tone_2 |= data_low;
+            psg_dirty |= TONE_2_BIT;
+            break;
+
+        case 0x50:
+            current_state.volume_2 = data_low;
+            psg_dirty |= VOLUME_2_BIT;
+            break;
+
+        /* Noise */
+        case 0x60:
+            current_state.noise = data_low;
+            psg_dirty |= NOISE_BIT;
+            break;
+
+        case 0x70:
+            current_state.volume_3 = data_low;
+            psg_dirty |= VOLUME_3_BIT;
+            break;
+        }
+    }
+    else { /* Data-high */
+        switch (psg_latch)
+        {
+        /* Tone0 */
+        case 0x00:
+            current_state.tone_0 &= 0x00f;
+            current_state.tone_0 |= data_high;
+            psg_dirty |= TONE_0_BIT;
+            break;
+
+        case 0x10:
+            current_state.volume_0 = data_low;
+            psg_dirty |= VOLUME_0_BIT;
+            break;
+
+        /* Tone1 */
+        case 0x20:
+            current_state.tone_1 &= 0x00f;
+            current_state.tone_1 |= data_high;
+            psg_dirty |= TONE_1_BIT;
+            break;
+
+        case 0x30:
+            current_state.volume_1 = data_low;
+            psg_dirty |= VOLUME_1_BIT;
+            break;
+
+        /* Tone2 */
+        case 0x40:
+
+            current_state.tone_2 &= 0x00f;
+            current_state.tone_2 |= data_high;
+            psg_dirty |= TONE_2_BIT;
+            break;
+
+        case 0x50:
+            current_state.volume_2 = data_low;
+            psg_dirty |= VOLUME_2_BIT;
+            break;
+
+        /* Noise */
+        case 0x60:
+            current_state.noise = data_low;
+            psg_dirty |= NOISE_BIT;
+            break;
+
+        case 0x70:
+            current_state.volume_3 = data_low;
+            psg_dirty |= VOLUME_3_BIT;
+            break;
+        }
+    }
+}
+
+
+/*
+ * Process a YM2413 register write from the VGM file.
+ */
+void ym2413_register_write (uint8_t addr, uint8_t value)
+{
+    if (addr >= 0x40)
+    {
+        fprintf (stderr, "ym2413: Ignoring high register address %02x.\n", addr);
+        return;
+    }
+
+    ym2413_regs [addr] = value;
+    ym2413_dirty |= (uint64_t) 1 << addr;
+    ym2413_write_count++;
+}
+
+
+/*
+ * Check if two indexes in index_data play the same thing. The final
+ * index of a song only needs to match the frame, as its delay is
+ * whatever remained at the end of the .vgm file.
+ */
+static bool index_match (const song *s, uint32_t a, uint32_t b)
+{
+    if (b == s->index_end - 1)
+    {
+        return (index_data [a] & 0x0fff) == (index_data [b] & 0x0fff);
+    }
+
+    return index_data [a] == index_data [b];
+}
+
+
+/*
+ * Search for a section at the end of the song that repeats, so
+ * that the repeats can be trimmed and the song looped instead.
+ *
+ * From the loop point to the end, every index must match the index
+ * loop_length later. Of the possible loops, the one that leaves the
+ * fewest indexes is used.
+ *
+ * If the .vgm file has a loop offset, the loop must not change what
+ * is played: It must start at or before the loop offset, and the
+ * original looped section must be a whole number of repeats.
+ *
+ * Otherwise, the section must be played at least twice and contain
+ * more than silence.
+ *
+ * The volume macros must be in the same state at the start of the loop and
+ * where it repeats. If the loop is moved from the given loop point, where
+ * the macros were stopped, none may have been running there.
+ */
+static void song_loop_search (song *s)
+{
+    uint32_t song_length = s->index_end - s->index_start;
+    uint32_t best_loop_index = 0;
+    uint32_t best_loop_length = 0;
+    uint32_t best_kept = song_length;
+
+    for (uint32_t loop_length = 1; loop_length <= song_length / 2; loop_length++)
+    {
+        uint32_t loop_index = s->index_end - loop_length;
+
+        /* Walk backwards to find where the repetition begins */
+        while (loop_index > s->index_start && index_match (s, loop_index - 1, loop_index - 1 + loop_length))
+        {
+            loop_index--;
+        }
+
+        if (loop_index - s->index_start + loop_length >= best_kept)
+        {
+            continue;
+        }
+
+        if (index_macro_state [loop_index] != index_macro_state [loop_index + loop_length] ||
+            index_macro_state [loop_index] == MACRO_STATE_UNKNOWN ||
+            (loop_index != s->loop_frame_index && s->loop_macro_active))
+        {
+            continue;
+        }
+
+        if (s->loop_given)
+        {
+            if (loop_index > s->loop_frame_index || (s->index_end - s->loop_frame_index) % loop_length != 0)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            uint32_t ticks = 0;
+            bool silent = true;
+
+            if (s->index_end - loop_index < loop_length * 2)
+            {
+                continue;
+            }
+
+            for (uint32_t i = loop_index; i < loop_index + loop_length; i++)
+            {
+                ticks += ((index_data [i] >> 12) & 0x07) + 1;
+                if (index_data [i] & 0x0fff)
+                {
+                    silent = false;
+                }
+            }
+
+            if (silent || ticks < LOOP_SEARCH_TICKS_MIN)
+            {
+                continue;
+            }
+        }
+
+        best_loop_index = loop_index;
+        best_loop_length = loop_length;
+        best_kept = loop_index - s->index_start + loop_length;
+    }
+
+    if (best_kept < song_length)
+    {
+        fprintf (encode_report, "Loop search: Looping %d indexes from index %d, trimming %d of %d indexes.\n",
+                 best_loop_length, best_loop_index - s->index_start, song_length - best_kept, song_length);
+
+        s->loop_macros_stop = (best_loop_index == s->loop_frame_index);
+        s->loop_frame_index = best_loop_index;
+        s->index_end = best_loop_index + best_loop_length;
+        index_data_count = s->index_end;
+    }
+}
+
+
+/*
+ * Reset the state tracking before reading a new song.
+ *
+ * The firmware resets both chips before starting a song,
+ * leaving the SN76489 channels muted and the YM2413
+ * registers cleared.
+ */
+void song_reset (void)
+{
+    memset (&current_state, 0, sizeof (current_state));
+    current_state.volume_0 = 0x0f;
+    current_state.volume_1 = 0x0f;
+    current_state.volume_2 = 0x0f;
+    current_state.volume_3 = 0x0f;
+    previous_state = current_state;
+    psg_dirty = 0;
+    psg_latch = 0;
+    tone_absolute_pending = TONE_0_BIT | TONE_1_BIT | TONE_2_BIT;
+    volume_macros_clear ();
+
+    memset (ym2413_regs, 0, sizeof (ym2413_regs));
+    memset (previous_ym2413_regs, 0, sizeof (previous_ym2413_regs));
+    ym2413_dirty = 0;
+
+    samples_delay = 0;
+}
+
+
+/*
+ * Record the current register state in the timeline, along with
+ * the delay since the previous entry.
+ */
+static void timeline_add (void)
+{
+    if (timeline_count == TIMELINE_COUNT_MAX)
+    {
+        fprintf (stderr, "Error: Too many frames.\n");
+        exit (EXIT_FAILURE);
+    }
+
+    if (timeline_count == timeline_allocated)
+    {
+        timeline_allocated = timeline_allocated ? timeline_allocated * 2 : 0x1000;
+        timeline = realloc (timeline, timeline_allocated * sizeof (timeline_entry));
+
+        if (timeline == NULL)
+        {
+            fprintf (stderr, "Error: Unable to allocate memory for the timeline.\n");
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    timeline_entry *entry = &timeline [timeline_count];
+
+    entry->psg = current_state;
+    entry->psg_dirty = psg_dirty;
+    memcpy (entry->ym2413_regs, ym2413_regs, sizeof (ym2413_regs));
+    entry->ym2413_dirty = ym2413_dirty;
+    entry->delay = samples_delay / 735;
+    samples_delay -= entry->delay * 735;
+
+    psg_dirty = 0;
+    ym2413_dirty = 0;
+    timeline_count++;
+}
+
+
+/*
+ * A change of volume on one channel, for choosing the volume macros.
+ * The changes that follow it are only considered up to the limit,
+ * as the volume macros are stopped at the loop point and song end.
+ */
+typedef struct volume_change_s
+{
+    uint32_t tick;
+    uint32_t limit;
+    uint8_t  volume;
+} volume_change;
+
+/*
+ * A sequence of volume changes after a direct write, as macro steps.
+ * The song then holds the volume for hold_ticks.
+ */
+typedef struct volume_sequence_s
+{
+    uint8_t  step [MACRO_STEP_COUNT_MAX];
+    uint8_t  step_count;
+    uint32_t hold_ticks;
+} volume_sequence;
+
+
+/*
+ * Get the sequence of volume changes that follow a change, up to the
+ * first gap longer than a macro step can wait.
+ */
+static void volume_sequence_get (const volume_change *changes, uint32_t count, uint32_t first, volume_sequence *sequence)
+{
+    uint32_t tick = changes [first].tick;
+    uint32_t next;
+
+    sequence->step_count = 0;
+
+    for (next = first + 1; next < count && sequence->step_count < MACRO_STEP_COUNT_MAX; next++)
+    {
+        /* A write of the same volume would start the macro again */
+        if (changes [next].tick >= changes [first].limit || changes [next].tick - tick > MACRO_WAIT_MAX ||
+            changes [next].volume == changes [first].volume)
+        {
+            break;
+        }
+
+        sequence->step [sequence->step_count++] = ((changes [next].tick - tick - 1) << 4) | changes [next].volume;
+        tick = changes [next].tick;
+    }
+
+    /* After the limit, the macro is stopped and can do no harm */
+    sequence->hold_ticks = changes [first].limit - tick;
+    if (next < count && changes [next].tick < changes [first].limit)
+    {
+        sequence->hold_ticks = changes [next].tick - tick;
+    }
+}
+
+
+/*
+ * Estimate the nibbles saved by using each length of a candidate macro
+ * after one of the sequences, adding them to gain [].
+ */
+static void volume_macro_gain (const volume_sequence *candidate, const volume_sequence *sequence, int32_t *gain)
+{
+    uint8_t matched = 0;
+    bool correction = false;
+
+    while (matched < candidate->step_count && matched < sequence->step_count &&
+           candidate->step [matched] == sequence->step [matched])
+    {
+        matched++;
+    }
+
+    /* If the macro would write before the song next changes the
+     * volume, a frame is needed to correct it */
+    if (matched < candidate->step_count)
+    {
+        uint8_t wait = (candidate->step [matched] >> 4) + 1;
+
+        if (matched < sequence->step_count)
+        {
+            correction = wait < (sequence->step [matched] >> 4) + 1;
+        }
+        else
+        {
+            correction = wait < sequence->hold_ticks;
+        }
+    }
+
+    for (uint8_t length = 1; length <= candidate->step_count; length++)
+    {
+        gain [length] += (length < matched ? length : matched) * MACRO_WRITE_GAIN;
+        if (length > matched && correction)
+        {
+            gain [length] -= MACRO_CORRECTION_COST;
+        }
+    }
+}
+
+
+/*
+ * Choose the volume macros, from the volume changes in the timelines
+ * of all songs.
+ *
+ * Each direct write of a volume is followed by a sequence of changes on
+ * the same channel. For each volume, the candidate macros are the distinct
+ * sequences that follow it, cut to each length. The candidate that writes
+ * the most of the following changes, less the frames needed to correct it
+ * where it doesn't match the song, is chosen if it is worth its size.
+ */
+static void volume_macros_build (void)
+{
+    volume_change *changes [4];
+    uint32_t change_count [4] = { 0 };
+    int32_t macro_gain [16] = { 0 };
+    volume_sequence macro [16];
+    uint32_t tick = 0;
+
+    memset (volume_macro, MACRO_NONE, sizeof (volume_macro));
+    volume_macro_data_size = 0;
+    volume_macro_count = 0;
+    volume_macro_writes = 0;
+
+    if (!volume_macros_enabled)
+    {
+        return;
+    }
+
+    /* List the volume changes on each channel */
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        changes [channel] = malloc (timeline_count * sizeof (volume_change));
+    }
+
+    for (uint8_t song_index = 0; song_index < song_count; song_index++)
+    {
+        const song *s = &songs [song_index];
+        uint32_t loop_tick = tick;
+        uint32_t end_tick = tick;
+        uint8_t volume [4] = { 0x0f, 0x0f, 0x0f, 0x0f };
+
+        for (uint32_t i = s->timeline_start; i < s->timeline_end; i++)
+        {
+            if (i == s->timeline_loop)
+            {
+                loop_tick = end_tick;
+            }
+            end_tick += timeline [i].delay ? timeline [i].delay : 1;
+        }
+
+        for (uint32_t i = s->timeline_start; i < s->timeline_end; i++)
+        {
+            for (uint8_t channel = 0; channel < 4; channel++)
+            {
+                uint8_t value = psg_field_get (&timeline [i].psg, 4 + channel);
+
+                if (value != volume [channel])
+                {
+                    volume_change *change = &changes [channel][change_count [channel]++];
+                    change->tick = tick;
+                    change->limit = (tick < loop_tick) ? loop_tick : end_tick;
+                    change->volume = value;
+                    volume [channel] = value;
+                }
+            }
+            tick += timeline [i].delay ? timeline [i].delay : 1;
+        }
+    }
+
+    for (uint8_t volume = 0; volume < 16; volume++)
+    {
+        volume_sequence *sequences;
+        volume_sequence *candidates;
+        uint32_t sequence_count = 0;
+        uint32_t candidate_count = 0;
+
+        for (uint8_t channel = 0; channel < 4; channel++)
+        {
+            for (uint32_t i = 0; i < change_count [channel]; i++)
+            {
+                sequence_count += (changes [channel][i].volume == volume);
+            }
+        }
+
+        if (sequence_count == 0)
+        {
+            continue;
+        }
+
+        /* The sequences that follow each write of this volume */
+        sequences = malloc (sequence_count * sizeof (volume_sequence));
+        candidates = malloc (MACRO_CANDIDATE_MAX * sizeof (volume_sequence));
+        sequence_count = 0;
+
+        for (uint8_t channel = 0; channel < 4; channel++)
+        {
+            for (uint32_t i = 0; i < change_count [channel]; i++)
+            {
+                if (changes [channel][i].volume == volume)
+                {
+                    volume_sequence_get (changes [channel], change_count [channel], i, &sequences [sequence_count++]);
+                }
+            }
+        }
+
+        for (uint32_t i = 0; i < sequence_count && candidate_count < MACRO_CANDIDATE_MAX; i++)
+        {
+            bool found = (sequences [i].step_count == 0);
+
+            for (uint32_t j = 0; j < candidate_count && !found; j++)
+            {
+                found = candidates [j].step_count == sequences [i].step_count &&
+                        memcmp (candidates [j].step, sequences [i].step, sequences [i].step_count) == 0;
+            }
+
+            if (!found)
+            {
+                candidates [candidate_count++] = sequences [i];
+            }
+        }
+
+        /* Each step of the macro costs one byte */
+        for (uint32_t i = 0; i < candidate_count; i++)
+        {
+            int32_t gain [MACRO_STEP_COUNT_MAX + 1] = { 0 };
+
+            for (uint32_t j = 0; j < sequence_count; j++)
+            {
+                volume_macro_gain (&candidates [i], &sequences [j], gain);
+            }
+
+            for (uint8_t length = 1; length <= candidates [i].step_count; length++)
+            {
+                if (gain [length] - length * 2 > macro_gain [volume])
+                {
+                    macro_gain [volume] = gain [length] - length * 2;
+                    macro [volume] = candidates [i];
+                    macro [volume].step_count = length;
+                }
+            }
+        }
+
+        free (sequences);
+        free (candidates);
+    }
+
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        free (changes [channel]);
+    }
+
+    /* Store the macros with the most to gain, while they fit */
+    int32_t gain_total = 0;
+    while (true)
+    {
+        uint8_t best = 0;
+
+        for (uint8_t volume = 0; volume < 16; volume++)
+        {
+            if (macro_gain [volume] > macro_gain [best])
+            {
+                best = volume;
+            }
+        }
+
+        if (macro_gain [best] <= 0)
+        {
+            break;
+        }
+
+        if (volume_macro_data_size + macro [best].step_count <= sizeof (volume_macro_data))
+        {
+            volume_macro [best] = volume_macro_data_size;
+            memcpy (&volume_macro_data [volume_macro_data_size], macro [best].step, macro [best].step_count);
+            volume_macro_data_size += macro [best].step_count;
+            volume_macro_data [volume_macro_data_size - 1] |= MACRO_LAST;
+            volume_macro_count++;
+            gain_total += macro_gain [best];
+        }
+        macro_gain [best] = 0;
+    }
+
+    /* The table of where each macro starts takes another 16 bytes */
+    if (gain_total < 16 * 2)
+    {
+        memset (volume_macro, MACRO_NONE, sizeof (volume_macro));
+        volume_macro_data_size = 0;
+        volume_macro_count = 0;
+    }
+}
+
+
+/*
+ * Generate the frames and indexes for a song from its timeline.
+ */
+static void song_generate (song *s)
+{
+    song_reset ();
+    s->index_start = index_data_count;
+    s->loop_frame_index = index_data_count;
+
+    for (uint32_t i = s->timeline_start; i < s->timeline_end; i++)
+    {
+        timeline_entry *entry = &timeline [i];
+
+        /* The tones before the loop point are not known when looping,
+         * and the firmware stops the volume macros there */
+        if (i == s->timeline_loop)
+        {
+            s->loop_frame_index = index_data_count;
+            s->loop_macro_active = volume_macros_active ();
+            tone_absolute_pending = TONE_0_BIT | TONE_1_BIT | TONE_2_BIT;
+            volume_macros_clear ();
+        }
+
+        current_state = entry->psg;
+        psg_dirty = entry->psg_dirty;
+        memcpy (ym2413_regs, entry->ym2413_regs, sizeof (ym2413_regs));
+        ym2413_dirty = entry->ym2413_dirty;
+
+        write_frame (entry->delay);
+    }
+
+    s->index_end = index_data_count;
+    s->loop_macros_stop = true;
+    index_macro_state [s->index_end] = volume_macros_state ();
+
+    if (loop_search)
+    {
+        song_loop_search (s);
+    }
+}
+
+
+/*
+ * Check if all four SN76489 channels are muted.
+ */
+static bool psg_silent (const psg_regs *regs)
+{
+    return regs->volume_0 == 0x0f && regs->volume_1 == 0x0f &&
+           regs->volume_2 == 0x0f && regs->volume_3 == 0x0f;
+}
+
+
+/*
+ * Apply a lossy step to the timeline of a song.
+ *
+ * Each entry holds the full register state, so a change to a register
+ * is also applied to the entries that follow it until the next write.
+ */
+static void lossy_apply (song *s, const lossy_step *step)
+{
+    timeline_entry *entries = &timeline [s->timeline_start];
+    uint32_t count = s->timeline_end - s->timeline_start;
+    uint32_t loop = s->timeline_loop - s->timeline_start;
+    bool ym2413_used = false;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ym2413_used |= (entries [i].ym2413_dirty != 0);
+    }
+
+    /* Silence can only be detected for the SN76489 */
+    if (step->trim_silence && !ym2413_used)
+    {
+        uint32_t first = 0;
+        uint32_t last = count - 1;
+
+        while (first < count && psg_silent (&entries [first].psg))
+        {
+            /* The writes made during the silence are kept by the first audible entry */
+            if (first + 1 < count)
+            {
+                entries [first + 1].psg_dirty |= entries [first].psg_dirty;
+            }
+            lossy_silence_trimmed += entries [first].delay;
+            first++;
+        }
+
+        while (last > first && psg_silent (&entries [last].psg))
+        {
+            last--;
+        }
+
+        if (first < count)
+        {
+            /* Keep the entry that mutes the channels, for 1/60s */
+            if (last + 1 < count)
+            {
+                for (uint32_t i = last + 1; i < count; i++)
+                {
+                    lossy_silence_trimmed += entries [i].delay;
+                }
+                lossy_silence_trimmed -= 1;
+                entries [last + 1].delay = 1;
+                count = last + 2;
+            }
+
+            memmove (entries, &entries [first], (count - first) * sizeof (timeline_entry));
+            count -= first;
+            loop = (loop < first) ? 0 : loop - first;
+            if (loop >= count)
+            {
+                loop = count - 1;
+            }
+        }
+    }
+
+    /* A value that only lasts one frame before returning to the previous value */
+    if (step->collapse_glitches)
+    {
+        for (uint8_t field = 0; field < 8; field++)
+        {
+            for (uint32_t i = 1; i + 1 < count; i++)
+            {
+                uint16_t previous = psg_field_get (&entries [i - 1].psg, field);
+                uint16_t value = psg_field_get (&entries [i].psg, field);
+
+                if (i == loop || i + 1 == loop || entries [i].delay > 1)
+                {
+                    continue;
+                }
+
+                if (value != previous && psg_field_get (&entries [i + 1].psg, field) == previous)
+                {
+                    psg_field_set (&entries [i].psg, field, previous);
+                    lossy_glitches_collapsed++;
+                }
+            }
+        }
+    }
+
+    /* Small changes are dropped, keeping the last value that was written.
+     * Values at the loop point are always kept, as the channel may have a
+     * different value when the song loops. */
+    for (uint8_t field = 0; field < 8; field++)
+    {
+        const psg_regs reset_state = { .volume_0 = 0x0f, .volume_1 = 0x0f, .volume_2 = 0x0f, .volume_3 = 0x0f };
+        bool tone = (field < 3);
+        uint16_t written = psg_field_get (&reset_state, field);
+
+        if ((tone && step->tone_shift == 0) || (!tone && step->volume_step == 0) || field == 3)
+        {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint16_t value = psg_field_get (&entries [i].psg, field);
+            uint16_t difference = (value > written) ? value - written : written - value;
+
+            if (!(entries [i].psg_dirty & (1 << field)) || value == written)
+            {
+                psg_field_set (&entries [i].psg, field, written);
+            }
+            else if (i == loop)
+            {
+                written = value;
+            }
+            else if (tone && (difference << step->tone_shift) < written)
+            {
+                psg_field_set (&entries [i].psg, field, written);
+                lossy_tones_snapped++;
+            }
+            else if (!tone && difference <= step->volume_step && value != 0x0f && written != 0x0f)
+            {
+                psg_field_set (&entries [i].psg, field, written);
+                lossy_volumes_merged++;
+            }
+            else
+            {
+                written = value;
+            }
+        }
+    }
+
+    /* Entries that no longer change anything are merged into the entry before */
+    if (count > 0)
+    {
+        uint32_t kept = 1;
+        uint32_t kept_loop = loop;
+
+        for (uint32_t i = 1; i < count; i++)
+        {
+            timeline_entry *previous = &entries [kept - 1];
+
+            if (i != loop && entries [i].ym2413_dirty == 0 &&
+                memcmp (&entries [i].psg, &previous->psg, sizeof (psg_regs)) == 0 &&
+                previous->delay + entries [i].delay <= 0xffff)
+            {
+                previous->delay += entries [i].delay;
+                lossy_entries_merged++;
+                continue;
+            }
+
+            if (i == loop)
+            {
+                kept_loop = kept;
+            }
+            entries [kept++] = entries [i];
+        }
+
+        count = kept;
+        loop = kept_loop;
+    }
+
+    s->timeline_end = s->timeline_start + count;
+    s->timeline_loop = s->timeline_start + loop;
+}
+
+
+/*
+ * Start a new report on the encoding, in place of the last one.
+ */
+static void encode_report_begin (void)
+{
+    if (encode_report != NULL)
+    {
+        fclose (encode_report);
+        free (encode_report_text);
+    }
+
+    encode_report = open_memstream (&encode_report_text, &encode_report_size);
+
+    if (encode_report == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate memory for the report.\n");
+        exit (EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Print the report on the encoding that was kept.
+ */
+static void encode_report_print (void)
+{
+    fclose (encode_report);
+    fputs (encode_report_text, stderr);
+
+    free (encode_report_text);
+    encode_report = NULL;
+    encode_report_text = NULL;
+}
+
+
+/*
+ * Generate, lay out, and compress the frames and indexes for all songs.
+ */
+static void songs_encode (void)
+{
+    encode_report_begin ();
+
+    /* Start again from just the zero frame */
+    frame_count = 1;
+    index_data_count = 0;
+    ym2413_patch_count = 0;
+    ym2413_patch_saving = 0;
+    ym2413_change_count = 0;
+    tone_table_count = 0;
+    tone_delta_count = 0;
+    tone_change_count = 0;
+    memset (frame_unused, 0, sizeof (frame_unused));
+    frame_unused_count = 0;
+
+    volume_macros_build ();
+
+    for (int i = 0; i < song_count; i++)
+    {
+        song_generate (&songs [i]);
+    }
+
+    if (channel_streams)
+    {
+        channel_streams_generate ();
+    }
+    else
+    {
+        frame_layout_compare (frame_layout_selected);
+        index_data_resolve ();
+    }
+
+    songs_compress ();
+
+    if (index_transposed_count > 0)
+    {
+        frame_unused_remove ();
+    }
+
+    for (int i = 0; i < song_count; i++)
+    {
+        for (int stream = 0; stream < stream_count; stream++)
+        {
+            song *s = channel_streams ? &streams [i][stream] : &songs [i];
+            fprintf (encode_report, "%s: Compressed indexes: %d bytes.\n", s->filename, s->end - s->start);
+        }
+    }
+}
+
+
+/*
+ * Convert all songs.
+ *
+ * With --transpose, the tone table must be kept and laid out by semitone,
+ * which can cost more than the transposed references save. The songs are
+ * then also converted without transposition, keeping whichever is smaller.
+ */
+static void songs_convert (void)
+{
+    uint32_t transposed_size;
+
+    songs_encode ();
+
+    if (!tone_transpose_enabled)
+    {
+        return;
+    }
+
+    transposed_size = TOTAL_SIZE;
+    tone_transpose_enabled = false;
+    songs_encode ();
+
+    if (TOTAL_SIZE <= transposed_size)
+    {
+        fprintf (encode_report, "Transpose: Saves nothing, not used.\n");
+    }
+    else
+    {
+        uint32_t saving = TOTAL_SIZE - transposed_size;
+
+        tone_transpose_enabled = true;
+        songs_encode ();
+        fprintf (encode_report, "Transpose: Saves %d bytes.\n", saving);
+    }
+
+    tone_transpose_enabled = true;
+}
+
+
+/*
+ * Read a .vgm file into the timeline.
+ */
+bool song_read (song *s)
+{
+    uint8_t *buffer = NULL;
+    uint32_t vgm_offset = 0;
+
+    buffer = read_vgm (s->filename);
 
     if (buffer == NULL)
     {
         /* read_vgm should already have output an error message */
-        return EXIT_FAILURE;
+        return false;
     }
 
+    fprintf (stderr, "%s:\n", s->filename);
     fprintf (stderr, "Version: %x.\n",       * (uint32_t *)(&buffer [0x08]));
     fprintf (stderr, "Clock rate: %d Hz.\n", * (uint32_t *)(&buffer [0x0c]));
+    fprintf (stderr, "YM2413 clock rate: %d Hz.\n", * (uint32_t *)(&buffer [0x10]));
     fprintf (stderr, "Rate: %d Hz.\n",       * (uint32_t *)(&buffer [0x24]));
     fprintf (stderr, "VGM offset: %02x.\n",  * (uint32_t *)(&buffer [0x34]));
 
@@ -407,6 +3532,11 @@ int main (int argc, char **argv)
 
     fprintf (stderr, "Loop offset: %02x.\n",  * (uint32_t *)(&buffer [0x1c]));
 
+    /* Only include YM2413 data in the frames if a song uses the chip */
+    if (* (uint32_t *)(&buffer [0x10]) != 0)
+    {
+        ym2413_enabled = true;
+    }
 
     /* Note: We assume a little-endian host */
     if (* (uint32_t *)(&buffer [0x34]) != 0)
@@ -418,13 +3548,23 @@ int main (int argc, char **argv)
         vgm_offset = 0x40;
     }
 
+    song_reset ();
+    s->timeline_start = timeline_count;
+    s->timeline_loop = timeline_count;
 
-    for (uint32_t i = vgm_offset; (i < SOURCE_SIZE_MAX) && (TOTAL_SIZE < OUTPUT_SIZE_MAX); i++)
+    for (uint32_t i = vgm_offset; i < SOURCE_SIZE_MAX; i++)
     {
         if (i == loop_offset)
         {
-            loop_frame_index = index_data_count;
-            fprintf (stderr, "Loop frame index: %d.\n", loop_frame_index);
+            /* Writes from before the loop point belong to the frame before the loop */
+            if (samples_delay >= 735)
+            {
+                timeline_add ();
+            }
+
+            s->timeline_loop = timeline_count;
+            s->loop_given = true;
+            fprintf (stderr, "Loop frame index: %d.\n", s->timeline_loop - s->timeline_start);
         }
 
         switch (buffer[i])
@@ -436,102 +3576,18 @@ int main (int argc, char **argv)
         case 0x50: /* PSG Data */
             if (samples_delay >= 735)
             {
-                write_frame ();
-            }
-            data = buffer[++i];
-            data_low  = data & 0x0f;
-            data_high = data << 0x04;
-
-            if (data & 0x80) { /* Latch + data-low (4-bits) */
-
-                latch = data & 0x70;
-
-                switch (latch)
-                {
-                /* Tone0 */
-                case 0x00:
-                    current_state.tone_0 &= 0x3f0;
-                    current_state.tone_0 |= data_low;
-                    break;
-
-                case 0x10:
-                    current_state.volume_0 = data_low;
-                    break;
-
-                /* Tone1 */
-                case 0x20:
-                    current_state.tone_1 &= 0x3f0;
-                    current_state.tone_1 |= data_low;
-                    break;
-
-                case 0x30:
-                    current_state.volume_1 = data_low;
-                    break;
-
-                /* Tone2 */
-                case 0x40:
-                    current_state.tone_2 &= 0x3f0;
-                    current_state.tone_2 |= data_low;
-                    break;
-
-                case 0x50:
-                    current_state.volume_2 = data_low;
-                    break;
-
-                /* Noise */
-                case 0x60:
-                    current_state.noise = data_low;
-                    break;
-
-                case 0x70:
-                    current_state.volume_3 = data_low;
-                    break;
-                }
+                timeline_add ();
             }
-            else { /* Data-high */
-                switch (latch)
-                {
-                /* Tone0 */
-                case 0x00:
-                    current_state.tone_0 &= 0x00f;
-                    current_state.tone_0 |= data_high;
-                    break;
-
-                case 0x10:
-                    current_state.volume_0 = data_low;
-                    break;
-
-                /* Tone1 */
-                case 0x20:
-                    current_state.tone_1 &= 0x00f;
-                    current_state.tone_1 |= data_high;
-                    break;
-
-                case 0x30:
-                    current_state.volume_1 = data_low;
-                    break;
-
-                /* Tone2 */
-                case 0x40:
-
-                    current_state.tone_2 &= 0x00f;
-                    current_state.tone_2 |= data_high;
-                    break;
-
-                case 0x50:
-                    current_state.volume_2 = data_low;
-                    break;
-
-                /* Noise */
-                case 0x60:
-                    current_state.noise = data_low;
-                    break;
+            psg_register_write (buffer [++i]);
+            break;
 
-                case 0x70:
-                    current_state.volume_3 = data_low;
-                    break;
-                }
+        case 0x51: /* YM2413 */
+            if (samples_delay >= 735)
+            {
+                timeline_add ();
             }
+            ym2413_register_write (buffer [i + 1], buffer [i + 2]);
+            i += 2;
             break;
 
         case 0x61: /* Wait n 44.1 KHz samples */
@@ -548,7 +3604,7 @@ int main (int argc, char **argv)
             break;
 
         case 0x66: /* End of sound data */
-            write_frame ();
+            timeline_add ();
             i = SOURCE_SIZE_MAX;
             break;
 
@@ -574,23 +3630,386 @@ int main (int argc, char **argv)
         }
     }
 
-    compress_indexes ();
+    s->timeline_end = timeline_count;
+
+    free (buffer);
+
+    return true;
+}
+
+
+/*
+ * Start again from the original timeline and songs, and apply a lossy
+ * step to each song. The original is saved the first time.
+ */
+static void lossy_step_apply (uint8_t step)
+{
+    lossy_silence_trimmed = 0;
+    lossy_glitches_collapsed = 0;
+    lossy_tones_snapped = 0;
+    lossy_volumes_merged = 0;
+    lossy_entries_merged = 0;
+
+    if (timeline_lossless == NULL)
+    {
+        timeline_lossless = malloc (timeline_count * sizeof (timeline_entry));
+
+        if (timeline_lossless == NULL)
+        {
+            fprintf (stderr, "Error: Unable to allocate memory for the timeline.\n");
+            exit (EXIT_FAILURE);
+        }
+
+        memcpy (timeline_lossless, timeline, timeline_count * sizeof (timeline_entry));
+        memcpy (songs_lossless, songs, sizeof (songs));
+    }
+    else
+    {
+        memcpy (timeline, timeline_lossless, timeline_count * sizeof (timeline_entry));
+        memcpy (songs, songs_lossless, sizeof (songs));
+    }
+
+    for (int i = 0; step > 0 && i < song_count; i++)
+    {
+        lossy_apply (&songs [i], &lossy_steps [step]);
+    }
+}
+
+
+/*
+ * Entry point.
+ *
+ * Reads each .vgm file given on the command line,
+ * and generates the output text for the song table.
+ */
+int main (int argc, char **argv)
+{
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp (argv [arg], "--fast") == 0)
+        {
+            /* Byte-aligned frame layout */
+            frame_layout_selected = LAYOUT_BYTE;
+        }
+        else if (strcmp (argv [arg], "--huffman") == 0)
+        {
+            /* Huffman-coded frame layout */
+            frame_layout_selected = LAYOUT_HUFFMAN;
+        }
+        else if (strcmp (argv [arg], "--no-loop-search") == 0)
+        {
+            /* Keep any repeats at the end of the songs */
+            loop_search = false;
+        }
+        else if (strcmp (argv [arg], "--budget") == 0 && arg + 1 < argc)
+        {
+            /* Apply lossy changes until the output fits */
+            budget = strtoul (argv [++arg], NULL, 0);
+        }
+        else if (strcmp (argv [arg], "--channels") == 0)
+        {
+            /* Per-channel streams */
+            channel_streams = true;
+        }
+        else if (strcmp (argv [arg], "--eeprom") == 0)
+        {
+            /* Move the start of frame_data into the EEPROM */
+            eeprom_enabled = true;
+        }
+        else if (strcmp (argv [arg], "--transpose") == 0)
+        {
+            /* Match melodies played in another key */
+            tone_transpose_enabled = true;
+        }
+        else if (argv [arg][0] == '-')
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [arg]);
+            return EXIT_FAILURE;
+        }
+        else if (song_count == SONG_COUNT_MAX)
+        {
+            fprintf (stderr, "Error: Too many songs, the limit is %d.\n", SONG_COUNT_MAX);
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            songs [song_count++].filename = argv [arg];
+        }
+    }
+
+    if (channel_streams && frame_layout_selected != LAYOUT_NIBBLE)
+    {
+        fprintf (stderr, "Error: --channels does not use a frame layout.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (eeprom_enabled && channel_streams)
+    {
+        fprintf (stderr, "Error: --eeprom moves frame data, which is not used with --channels.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (tone_transpose_enabled && (channel_streams || frame_layout_selected == LAYOUT_BYTE))
+    {
+        fprintf (stderr, "Error: --transpose needs the tone table, which is not used with --fast or --channels.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The byte-aligned layout writes its tone bytes to the SN76489 as they are */
+    tone_delta_enabled = !channel_streams && frame_layout_selected != LAYOUT_BYTE;
+    volume_macros_enabled = !channel_streams;
+
+    if (song_count == 0)
+    {
+        fprintf (stderr, "Usage: vgm_convert [--fast | --huffman | --channels] [--transpose] [--eeprom] [--no-loop-search] [--budget <bytes>] <file.vgm> [file.vgm ...]\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < song_count; i++)
+    {
+        if (!song_read (&songs [i]))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* With a budget, apply lossy steps until the output fits. Steps that
+     * do not make the output smaller are not kept. */
+    uint8_t step_converted = 0;
+    uint8_t step_kept = 0;
+    uint32_t size_kept = 0;
+    uint32_t counts_kept [LOSSY_COUNTER_COUNT] = { 0 };
+
+    for (uint8_t step = 0; step < LOSSY_STEP_COUNT; step++)
+    {
+        if (step > 0)
+        {
+            fprintf (stderr, "Budget: %d bytes%s is over the budget of %d bytes. Applying: %s.\n",
+                     size_kept, BUDGET_SIZE_NAME, budget, lossy_steps [step].description);
+            lossy_step_apply (step);
+        }
+
+        songs_convert ();
+        step_converted = step;
+
+        if (step > 0)
+        {
+            if (FLASH_SIZE >= size_kept)
+            {
+                fprintf (stderr, "Budget: %s saves nothing (%d bytes%s), not applied.\n",
+                         lossy_steps [step].description, FLASH_SIZE, BUDGET_SIZE_NAME);
+                continue;
+            }
+
+            fprintf (stderr, "Budget: %s saved %d bytes (%d bytes%s).\n",
+                     lossy_steps [step].description, (int) size_kept - (int) FLASH_SIZE, FLASH_SIZE, BUDGET_SIZE_NAME);
+
+            /* Each step repeats the changes of the steps before it, so only list what this one changed */
+            for (uint8_t counter = 0; counter < LOSSY_COUNTER_COUNT; counter++)
+            {
+                uint32_t count = *lossy_counters [counter].count;
+
+                if (count != counts_kept [counter])
+                {
+                    fprintf (stderr, " - %d %s (%+d).\n", count, lossy_counters [counter].description,
+                             (int) count - (int) counts_kept [counter]);
+                }
+                counts_kept [counter] = count;
+            }
+        }
+
+        step_kept = step;
+        size_kept = FLASH_SIZE;
+
+        if (budget == 0 || size_kept <= budget)
+        {
+            break;
+        }
+    }
+
+    /* Go back to the smallest output if later steps were not kept */
+    if (step_converted != step_kept)
+    {
+        fprintf (stderr, "Budget: Converting again with: %s.\n", lossy_steps [step_kept].description);
+        lossy_step_apply (step_kept);
+        songs_convert ();
+    }
+
+    encode_report_print ();
+
+    if (budget != 0 && FLASH_SIZE > budget)
+    {
+        fprintf (stderr, "Warning: Output size %d bytes%s is over the budget of %d bytes.\n",
+                 FLASH_SIZE, BUDGET_SIZE_NAME, budget);
+    }
+
+    /* Frames past the 12-bit limit would be played from the wrong place */
+    if (!channel_streams && frame_index_max > FRAME_INDEX_LIMIT)
+    {
+        fprintf (stderr, "Error: frame_data needs indexes up to %d, but only %d can be indexed.\n",
+                 frame_index_max, FRAME_INDEX_LIMIT);
+        fprintf (stderr, "       Try converting fewer songs together, or a smaller frame layout.\n");
+        return EXIT_FAILURE;
+    }
 
-    if (TOTAL_SIZE >= (8192 - 724))
+    if (FLASH_SIZE >= (8192 - 724))
     {
         fprintf (stderr, "Warning: Output size %d.%02d KiB may not fit on ATMEGA-8.\n",
-                 TOTAL_SIZE / 1024, (TOTAL_SIZE % 1024) * 100 / 1024);
+                 FLASH_SIZE / 1024, (FLASH_SIZE % 1024) * 100 / 1024);
+    }
+
+    if (ym2413_enabled)
+    {
+        printf ("#define YM2413_ENABLED\n");
+    }
+
+    if (channel_streams)
+    {
+        printf ("#define CHANNEL_STREAMS\n");
+        printf ("#define STREAM_COUNT %d\n", stream_count);
+    }
+    else if (frame_layout_selected == LAYOUT_BYTE)
+    {
+        printf ("#define FRAME_LAYOUT_FAST\n");
+    }
+    else if (frame_layout_selected == LAYOUT_HUFFMAN)
+    {
+        printf ("#define FRAME_LAYOUT_HUFFMAN\n");
+    }
+
+    printf ("#define SONG_COUNT %d\n", song_count);
+    printf ("#define INDEX_STACK_DEPTH %d\n\n", compressed_depth_max + 1);
+
+    /* Song table: Start, end, and loop index */
+    if (channel_streams)
+    {
+        printf ("const uint16_t song_table [SONG_COUNT][STREAM_COUNT][3] PROGMEM = {\n");
+        for (int i = 0; i < song_count; i++)
+        {
+            printf ("    { /* %s */\n", songs [i].filename);
+            for (int stream = 0; stream < stream_count; stream++)
+            {
+                song *s = &streams [i][stream];
+                printf ("        { %d, %d, %d }%s\n",
+                        s->start, s->end, s->loop,
+                        stream == (stream_count - 1) ? "" : ",");
+            }
+            printf ("    }%s\n", i == (song_count - 1) ? "" : ",");
+        }
+    }
+    else
+    {
+        printf ("const uint16_t song_table [SONG_COUNT][3] PROGMEM = {\n");
+    }
+    for (int i = 0; i < song_count && !channel_streams; i++)
+    {
+        printf ("    { %d, %d, %d }%s /* %s */\n",
+                songs [i].start, songs [i].end,
+                songs [i].loop | ((volume_macro_count > 0 && songs [i].loop_macros_stop) ? SONG_LOOP_MACROS_STOP : 0),
+                i == (song_count - 1) ? "" : ",", songs [i].filename);
+    }
+    printf ("};\n\n");
+
+    if (ym2413_patch_count > 0)
+    {
+        printf ("#define YM2413_PATCH_COUNT %d\n\n", ym2413_patch_count);
+
+        printf ("const uint8_t ym2413_patch_data [] PROGMEM = {\n");
+        for (int i = 0; i < ym2413_patch_count; i++)
+        {
+            printf ("    ");
+            for (int j = 0; j < 8; j++)
+            {
+                printf ("0x%02x%s", ym2413_patch_data [i * 8 + j],
+                        (i == ym2413_patch_count - 1 && j == 7) ? "\n" : (j == 7) ? ",\n" : ", ");
+            }
+        }
+        printf ("};\n\n");
+    }
+
+    if (frame_layout_selected == LAYOUT_HUFFMAN)
+    {
+        /* Number of codes of each length, followed by the symbols in code order */
+        printf ("const uint8_t huffman_count [%d] PROGMEM = {\n    ", HUFFMAN_LENGTH_MAX + 1);
+        for (int i = 0; i <= HUFFMAN_LENGTH_MAX; i++)
+        {
+            printf ("%d%s", huffman_count [i], i == HUFFMAN_LENGTH_MAX ? "\n" : ", ");
+        }
+        printf ("};\n\n");
+
+        printf ("const uint8_t huffman_symbol [%d] PROGMEM = {\n    ", huffman_symbol_count);
+        for (int i = 0; i < huffman_symbol_count; i++)
+        {
+            printf ("0x%x%s", huffman_symbol [i], i == huffman_symbol_count - 1 ? "\n" : ", ");
+        }
+        printf ("};\n\n");
+    }
+
+    if (tone_table_count > 0)
+    {
+        printf ("#define TONE_TABLE_COUNT %d\n", tone_table_count);
+        if (index_transposed_count > 0)
+        {
+            printf ("#define TONE_TRANSPOSE\n");
+        }
+        printf ("\n");
+
+        printf ("const uint16_t tone_table [TONE_TABLE_COUNT] PROGMEM = {\n");
+        for (int i = 0; i < tone_table_count; i++)
+        {
+            if (i % 8 == 0)
+            {
+                printf ("    ");
+            }
+            printf ("0x%03x%s", tone_table [i], i == (tone_table_count - 1) ? "\n" : (i % 8 == 7) ? ",\n" : ", ");
+        }
+        printf ("};\n\n");
+    }
+
+    if (volume_macro_count > 0)
+    {
+        printf ("#define VOLUME_MACRO_COUNT %d\n", volume_macro_count);
+        printf ("#define SONG_LOOP_MACROS_STOP 0x%04x\n\n", SONG_LOOP_MACROS_STOP);
+
+        printf ("const uint8_t volume_macro [16] PROGMEM = {\n    ");
+        for (int i = 0; i < 16; i++)
+        {
+            printf ("0x%02x%s", volume_macro [i], i == 15 ? "\n" : ", ");
+        }
+        printf ("};\n\n");
+
+        printf ("const uint8_t volume_macro_data [] PROGMEM = {\n");
+        for (int i = 0; i < volume_macro_data_size; i++)
+        {
+            if (i % 16 == 0)
+            {
+                printf ("    ");
+            }
+            printf ("0x%02x%s", volume_macro_data [i], i == (volume_macro_data_size - 1) ? "\n" : (i % 16 == 15) ? ",\n" : ", ");
+        }
+        printf ("};\n\n");
     }
 
-    printf ("#define LOOP_FRAME_INDEX_INNER %d\n", loop_frame_index_inner);
-    printf ("#define LOOP_FRAME_INDEX_OUTER %d\n", loop_frame_index_outer);
-    printf ("#define LOOP_FRAME_SEGMENT_END %d\n", loop_frame_segment_end);
-    printf ("#define END_FRAME_INDEX %d\n\n", compressed_index_data_count);
+    if (FRAME_DATA_EEPROM_SIZE > 0)
+    {
+        printf ("#define FRAME_DATA_EEPROM_SIZE %d\n\n", FRAME_DATA_EEPROM_SIZE);
+
+        printf ("const uint8_t frame_data_eeprom [FRAME_DATA_EEPROM_SIZE] EEMEM = {\n");
+        for (int i = 0; i < FRAME_DATA_EEPROM_SIZE; i++)
+        {
+            if (i % 16 == 0)
+            {
+                printf ("    ");
+            }
+            printf ("0x%02x%s", frame_data [i], i == (FRAME_DATA_EEPROM_SIZE - 1) ? "\n" : (i % 16 == 15) ? ",\n" : ", ");
+        }
+        printf ("};\n\n");
+    }
 
     printf ("const uint8_t frame_data [] PROGMEM = {\n");
-    for (int i = 0; i < frame_data_size; i++)
+    for (int i = FRAME_DATA_EEPROM_SIZE; i < frame_data_size; i++)
     {
-        if (i % 16 == 0)
+        if ((i - FRAME_DATA_EEPROM_SIZE) % 16 == 0)
         {
             printf ("    ");
         }
@@ -599,7 +4018,7 @@ int main (int argc, char **argv)
         {
             break;
         }
-        if (i % 16 == 15)
+        if ((i - FRAME_DATA_EEPROM_SIZE) % 16 == 15)
         {
             printf ("\n");
         }
@@ -610,19 +4029,35 @@ int main (int argc, char **argv)
     }
     printf ("};\n\n");
 
-    printf ("const uint16_t index_data [] PROGMEM = {\n");
-    for (int i = 0; i < compressed_index_data_count; i++)
+    if (index_hot_count > 0)
+    {
+        printf ("#define INDEX_HOT_COUNT %d\n\n", index_hot_count);
+
+        printf ("const uint16_t index_hot [INDEX_HOT_COUNT] PROGMEM = {\n");
+        for (int i = 0; i < index_hot_count; i++)
+        {
+            if (i % 8 == 0)
+            {
+                printf ("    ");
+            }
+            printf ("0x%04x%s", index_hot [i], i == (index_hot_count - 1) ? "\n" : (i % 8 == 7) ? ",\n" : ", ");
+        }
+        printf ("};\n\n");
+    }
+
+    printf ("const uint8_t index_data [] PROGMEM = {\n");
+    for (int i = 0; i < compressed_index_data_size; i++)
     {
-        if (i % 8 == 0)
+        if (i % 16 == 0)
         {
             printf ("    ");
         }
-        printf ("0x%04x%s", compressed_index_data [i], i == (compressed_index_data_count - 1) ? "\n" : ",");
-        if (i == (compressed_index_data_count - 1))
+        printf ("0x%02x%s", compressed_index_data [i], i == (compressed_index_data_size - 1) ? "\n" : ",");
+        if (i == (compressed_index_data_size - 1))
         {
             break;
         }
-        if (i % 8 == 7)
+        if (i % 16 == 15)
         {
             printf ("\n");
         }
@@ -635,8 +4070,42 @@ int main (int argc, char **argv)
 
     fprintf (stderr, "Done.\n");
     fprintf (stderr, " - %d bytes of frame data. (%d unique frames)\n", frame_data_size, frame_count);
-    fprintf (stderr, " - %d bytes of index data.\n", compressed_index_data_count * 2);
+    fprintf (stderr, " - %d bytes of index data. (%d long delays, %d long references)\n",
+             compressed_index_data_size, index_long_delay_count, index_long_reference_count);
+    fprintf (stderr, " - %d one-byte indexes, from a table of %d (%d bytes).\n",
+             index_hot_uses, index_hot_count, index_hot_count * 2);
+    if (tone_table_count > 0)
+    {
+        fprintf (stderr, " - %d tone periods in the tone table (%d bytes).\n", tone_table_count, tone_table_count * 2);
+    }
+    if (tone_table_semitones > 0)
+    {
+        fprintf (stderr, " - %d entries laid out by semitone, %d of them unused.\n", tone_table_semitones, tone_table_fillers);
+        fprintf (stderr, " - %d transposed references, %d frames only played transposed.\n",
+                 index_transposed_count, frame_unused_count);
+    }
+    if (tone_delta_enabled)
+    {
+        fprintf (stderr, " - %d of %d tone changes stored as deltas.\n", tone_delta_count, tone_change_count);
+    }
+    if (volume_macro_count > 0)
+    {
+        fprintf (stderr, " - %d volume macros (%d bytes), writing %d volume changes.\n",
+                 volume_macro_count, 16 + volume_macro_data_size, volume_macro_writes);
+    }
+    if (ym2413_enabled)
+    {
+        fprintf (stderr, " - %d YM2413 register writes.\n", ym2413_write_count);
+        fprintf (stderr, " - %d bytes of YM2413 frame data, %d bytes saved by references.\n",
+                 ym2413_frame_data_size, ym2413_reference_saving);
+        fprintf (stderr, " - %d custom instrument patches (%d bytes), replacing %d bytes of frame data.\n",
+                 ym2413_patch_count, ym2413_patch_count * 8, ym2413_patch_saving);
+        fprintf (stderr, " - %d bytes saved compared to storing each YM2413 register change as a 16-bit word.\n",
+                 (int) (ym2413_change_count * 2) - (int) (ym2413_frame_data_size + ym2413_patch_count * 8));
+    }
+    if (eeprom_enabled)
+    {
+        fprintf (stderr, " - %d bytes of frame data in EEPROM, %d bytes in flash.\n", FRAME_DATA_EEPROM_SIZE, FLASH_SIZE);
+    }
     fprintf (stderr, " - %d bytes total.\n", TOTAL_SIZE);
-
-    free (buffer);
 }
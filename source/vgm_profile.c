@@ -0,0 +1,216 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+/* Must match PROFILE_BUILD in main.c */
+#define PROFILE_SYNC_0          0xa5
+#define PROFILE_SYNC_1          0x5a
+#define PROFILE_BUCKET_COUNT    8
+#define PROFILE_BUCKET_SHIFT    11
+#define PROFILE_SIZE            (13 + PROFILE_BUCKET_COUNT)
+
+#define TIMER_HZ                (7160000.0 / 8) /* F_CPU, pre-scaled by 8 */
+#define TICK_COUNTS             14915           /* OCR1A + 1 */
+
+static int uart_fd = -1;
+
+
+/*
+ * Configure the UART for 28800 baud, 8N1.
+ */
+static bool uart_configure (void)
+{
+    struct termios2 uart_attributes;
+    if (ioctl (uart_fd, TCGETS2, &uart_attributes) == -1)
+    {
+        fprintf (stderr, "Cannot get uart attributes: %s.\n", strerror (errno));
+        return false;
+    }
+
+    uart_attributes.c_cflag &= ~CSIZE;
+    uart_attributes.c_cflag |= CS8 | CREAD | CLOCAL;    /* 8, enable reading, ignore modem lines */
+    uart_attributes.c_cflag &= ~PARENB;     /* N */
+    uart_attributes.c_cflag &= ~CSTOPB;     /* 1 */
+    uart_attributes.c_cflag &= ~CRTSCTS;    /* Disable flow-control */
+    uart_attributes.c_cflag &= ~CBAUD;
+    uart_attributes.c_cflag |= CBAUDEX;    /* Use custom baud rate */
+
+    uart_attributes.c_ispeed = 28800;       /* 28.8 k */
+    uart_attributes.c_ospeed = 28800;
+
+    uart_attributes.c_lflag &= ~ICANON; /* Disable canonical mode */
+    uart_attributes.c_lflag &= ~(ECHO | ECHOE | ECHONL); /* Disable echo */
+    uart_attributes.c_lflag &= ~ISIG;   /* Disable control characters */
+
+    uart_attributes.c_iflag &= ~(IXON | IXOFF | IXANY); /* Disable software flow-control */
+    uart_attributes.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP |
+                                 INLCR |IGNCR | ICRNL); /* Disable handling of special bytes (Rx) */
+
+    uart_attributes.c_oflag &= ~(OPOST | ONLCR); /* Disable handling of special bytes (Tx) */
+
+    uart_attributes.c_cc [VMIN] = 1;    /* Block until data arrives */
+    uart_attributes.c_cc [VTIME] = 0;
+
+    if (ioctl (uart_fd, TCSETS2, &uart_attributes) == -1)
+    {
+        fprintf (stderr, "Cannot set uart attributes: %s.\n", strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * Read one byte, returning -1 at the end of the input.
+ */
+static int uart_read (void)
+{
+    uint8_t data;
+
+    if (read (uart_fd, &data, 1) != 1)
+    {
+        return -1;
+    }
+
+    return data;
+}
+
+
+/*
+ * Read a little-endian 16-bit field from a report.
+ */
+static uint16_t report_word (const uint8_t *report, uint8_t offset)
+{
+    return report [offset] | (report [offset + 1] << 8);
+}
+
+
+/*
+ * Convert Timer 1 counts into µs.
+ */
+static double counts_us (uint16_t counts)
+{
+    return counts * 1000000.0 / TIMER_HZ;
+}
+
+
+/*
+ * Print one report, one line per second.
+ */
+static void report_print (const uint8_t *report)
+{
+    uint16_t tick_count = report_word (report, 0);
+    uint16_t tick_max = report_word (report, 2);
+    uint16_t tick_late_max = report_word (report, 4);
+    const uint8_t *histogram = &report [6];
+    uint16_t rx_count = report_word (report, 6 + PROFILE_BUCKET_COUNT);
+    uint16_t rx_max = report_word (report, 8 + PROFILE_BUCKET_COUNT);
+    uint8_t ticks_missed = report [10 + PROFILE_BUCKET_COUNT];
+    uint8_t rx_overruns = report [11 + PROFILE_BUCKET_COUNT];
+    uint8_t rx_frame_errors = report [12 + PROFILE_BUCKET_COUNT];
+
+    if (tick_count > 0)
+    {
+        printf ("Tick: %3d, max %6.0f µs (%3.0f%%), late %5.0f µs, histogram [",
+                tick_count, counts_us (tick_max), 100.0 * tick_max / TICK_COUNTS, counts_us (tick_late_max));
+
+        for (uint8_t bucket = 0; bucket < PROFILE_BUCKET_COUNT; bucket++)
+        {
+            printf (bucket ? " %3d" : "%3d", histogram [bucket]);
+        }
+
+        printf ("], missed %d. ", ticks_missed);
+    }
+
+    printf ("Rx: %4d, max %6.0f µs, overruns %d, frame errors %d.\n",
+            rx_count, counts_us (rx_max), rx_overruns, rx_frame_errors);
+    fflush (stdout);
+}
+
+
+/*
+ * Entry point.
+ *
+ * Reads the statistics sent by a PROFILE_BUILD of main.c, from the
+ * UART or from a file captured earlier.
+ */
+int main (int argc, char **argv)
+{
+    char *filename = argc > 1 ? argv [1] : "/dev/ttyUSB0";
+    uint8_t report [PROFILE_SIZE];
+    uint32_t checksum_errors = 0;
+
+    if (argc > 2)
+    {
+        fprintf (stderr, "Usage: vgm_profile [device or file]\n");
+        return EXIT_FAILURE;
+    }
+
+    uart_fd = open (filename, O_RDONLY);
+    if (uart_fd < 0)
+    {
+        fprintf (stderr, "Cannot open %s: %s.\n", filename, strerror (errno));
+        return EXIT_FAILURE;
+    }
+
+    if (isatty (uart_fd) && !uart_configure ())
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf ("Histogram buckets are %.0f µs wide.\n", counts_us (1 << PROFILE_BUCKET_SHIFT));
+
+    int data = uart_read ();
+    while (data >= 0)
+    {
+        /* Find the sync bytes */
+        if (data != PROFILE_SYNC_0)
+        {
+            data = uart_read ();
+            continue;
+        }
+
+        data = uart_read ();
+        if (data != PROFILE_SYNC_1)
+        {
+            continue;
+        }
+
+        uint8_t checksum = 0;
+        uint8_t length = 0;
+
+        for (; length < PROFILE_SIZE && (data = uart_read ()) >= 0; length++)
+        {
+            report [length] = data;
+            checksum += data;
+        }
+
+        if (length < PROFILE_SIZE || (data = uart_read ()) < 0)
+        {
+            break;
+        }
+
+        if (data == checksum)
+        {
+            report_print (report);
+        }
+        else
+        {
+            fprintf (stderr, "Checksum error, %d so far.\n", ++checksum_errors);
+        }
+
+        data = uart_read ();
+    }
+
+    close (uart_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,28 @@
+/*
+ * The firmware, built for the host so that vgm_render can play a
+ * converted song through the same decoder as the micro-controller.
+ * SONG_HEADER names the header generated by vgm_convert.
+ */
+#define HOST_BUILD
+#include "../main.c"
+
+#include "embedded.h"
+
+
+/*
+ * Reset the chips and start playing an embedded song.
+ */
+void embedded_start (uint8_t song)
+{
+    chips_reset ();
+    song_select (song);
+}
+
+
+/*
+ * Play one 60 Hz tick.
+ */
+void embedded_tick (void)
+{
+    TIMER1_COMPA_vect ();
+}
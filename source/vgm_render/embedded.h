@@ -0,0 +1,6 @@
+
+/* Reset the chips and start playing an embedded song. */
+void embedded_start (uint8_t song);
+
+/* Play one 60 Hz tick. */
+void embedded_tick (void);
@@ -0,0 +1,35 @@
+
+/* Stand-ins for the AVR headers, used when main.c is built into
+ * vgm_render to play a converted song on the host, or into
+ * vgm_uart_sim to run the UART Rx interrupt. Register writes go to
+ * sn76489_write and ym2413_write, and the hardware is left out. */
+
+#include "sn76489.h"
+#include "ym2413.h"
+
+#define PROGMEM
+#define EEMEM
+
+#define pgm_read_byte(address)      (*(const uint8_t *) (address))
+#define pgm_read_word(address)      (*(const uint16_t *) (address))
+#define eeprom_read_byte(address)   (*(const uint8_t *) (address))
+
+#define ISR(vector) void vector (void)
+
+#ifdef UART_BUILD
+/* vgm_uart_sim counts the time spent waiting */
+void sim_delay_us (uint32_t us);
+#define _delay_ms(ms) sim_delay_us ((ms) * 1000)
+#else
+#define _delay_ms(ms)
+#endif
+
+#define psg_write sn76489_write
+
+#define DDB5 5
+static uint8_t PORTB;
+static uint8_t PORTC;
+
+#ifdef UART_BUILD
+static uint8_t UDR;     /* Set by vgm_uart_sim before each Rx interrupt */
+#endif
@@ -0,0 +1,200 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "sn76489.h"
+
+#define CHANNEL_GAIN 0.2f
+#define NOISE_SHIFTS_MAX 1024   /* Shifts of the noise register rendered at a time */
+
+/* Register state */
+static uint8_t latch = 0;
+static uint16_t period [3] = { 0 };
+static uint8_t noise_control = 0;
+static uint8_t volume [4] = { 0 };
+
+/* Generator state. Tone phases are the fraction of a cycle
+ * in 0.32 fixed point. The noise phase counts shifts of the
+ * noise register in 32.32 fixed point. */
+static uint32_t clock_rate = 3579545;
+static uint32_t sample_rate = 44100;
+static uint32_t tone_phase [3] = { 0 };
+static uint64_t noise_phase = 0;
+static uint16_t noise_register = 0x4000;
+
+static float volume_gain [16] = { 0 };
+
+
+/*
+ * Reset the SN76489 to silence, running from the given clock.
+ */
+void sn76489_reset (uint32_t clock, uint32_t rate)
+{
+    clock_rate = clock;
+    sample_rate = rate;
+
+    latch = 0;
+    noise_control = 0;
+    noise_register = 0x4000;
+    noise_phase = 0;
+
+    for (uint32_t channel = 0; channel < 3; channel++)
+    {
+        period [channel] = 0;
+        tone_phase [channel] = 0;
+    }
+
+    for (uint32_t channel = 0; channel < 4; channel++)
+    {
+        volume [channel] = 0x0f;
+    }
+
+    /* Each volume step is 2 dB, with 15 being silent */
+    for (uint32_t level = 0; level < 15; level++)
+    {
+        volume_gain [level] = CHANNEL_GAIN * powf (10.0f, -2.0f * level / 20.0f);
+    }
+    volume_gain [15] = 0.0f;
+}
+
+
+/*
+ * Write one byte to the SN76489.
+ */
+void sn76489_write (uint8_t data)
+{
+    if (data & 0x80)
+    {
+        latch = (data >> 4) & 0x07;
+    }
+
+    uint8_t channel = latch >> 1;
+
+    if (latch & 0x01)
+    {
+        volume [channel] = data & 0x0f;
+    }
+    else if (channel == 3)
+    {
+        /* Any write to the noise control restarts the noise */
+        noise_control = data & 0x07;
+        noise_register = 0x4000;
+    }
+    else if (data & 0x80)
+    {
+        period [channel] = (period [channel] & 0x3f0) | (data & 0x0f);
+    }
+    else
+    {
+        period [channel] = (period [channel] & 0x00f) | ((data & 0x3f) << 4);
+    }
+}
+
+
+/*
+ * Phase increment per sample for a square wave of the given period,
+ * or zero if it is above the Nyquist frequency and so averages out.
+ */
+static uint32_t tone_step (uint16_t tone_period)
+{
+    double frequency = (double) clock_rate / (32 * (tone_period ? tone_period : 0x400));
+
+    if (frequency >= sample_rate / 2)
+    {
+        return 0;
+    }
+
+    return (uint32_t) (frequency / sample_rate * 4294967296.0);
+}
+
+
+/*
+ * Add count samples of the noise channel to the buffer.
+ *
+ * The levels the noise register will output are found first, so that
+ * each sample is then only a lookup of the level at its phase. This
+ * loop has no carried state and is vectorised, leaving the shifts of
+ * the register as the only serial part. The samples must not take more
+ * than NOISE_SHIFTS_MAX shifts.
+ */
+static void noise_render (float *buffer, uint32_t count, uint64_t step, float gain)
+{
+    static float noise_level [NOISE_SHIFTS_MAX];
+    uint32_t shifts = (noise_phase + step * count) >> 32;
+
+    for (uint32_t shift = 0; shift <= shifts; shift++)
+    {
+        noise_level [shift] = (noise_register & 0x01) ? gain : -gain;
+
+        if (shift < shifts)
+        {
+            /* White noise feeds back bits 0 and 1, periodic noise only bit 0 */
+            uint16_t feedback = (noise_control & 0x04) ? ((noise_register ^ (noise_register >> 1)) & 0x01)
+                                                       : (noise_register & 0x01);
+            noise_register = (noise_register >> 1) | (feedback << 14);
+        }
+    }
+
+    if (gain != 0.0f)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            /* Each sample takes the level after the shifts during it */
+            buffer [i] += noise_level [(uint32_t) ((noise_phase + step * (i + 1)) >> 32)];
+        }
+    }
+
+    noise_phase = (noise_phase + step * count) & 0xffffffff;
+}
+
+
+/*
+ * Add count samples of SN76489 output to the buffer.
+ *
+ * Each tone sample is the average of the square wave over the sample
+ * period, found from the difference of its integral (a triangle wave)
+ * at either end. This is free of aliasing steps, and each sample only
+ * depends on the phase at the start of the buffer, so the loop has no
+ * branches or carried state and is vectorised by the compiler.
+ */
+void sn76489_render (float *buffer, uint32_t count)
+{
+    for (uint32_t channel = 0; channel < 3; channel++)
+    {
+        uint32_t step = tone_step (period [channel]);
+        uint32_t phase = tone_phase [channel];
+        float gain = volume_gain [volume [channel]];
+
+        if (step != 0 && gain != 0.0f)
+        {
+            float scale = gain / step;
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t phase_0 = phase + step * i;
+                uint32_t phase_1 = phase_0 + step;
+
+                /* Integral of the square wave, rising over the first half-cycle */
+                uint32_t integral_0 = phase_0 < -phase_0 ? phase_0 : -phase_0;
+                uint32_t integral_1 = phase_1 < -phase_1 ? phase_1 : -phase_1;
+
+                buffer [i] += scale * (float) (int32_t) (integral_1 - integral_0);
+            }
+        }
+
+        tone_phase [channel] = phase + step * count;
+    }
+
+    /* The noise register shifts once per cycle of its counter */
+    uint16_t noise_period = (noise_control & 0x03) == 0x03 ? period [2] : (0x10 << (noise_control & 0x03));
+    double noise_frequency = (double) clock_rate / (32 * (noise_period ? noise_period : 0x400));
+    uint64_t noise_step = (uint64_t) (noise_frequency / sample_rate * 4294967296.0);
+    float noise_gain = volume_gain [volume [3]];
+
+    /* Render in parts that fit the shifts of the noise register */
+    uint32_t part_max = ((uint64_t) (NOISE_SHIFTS_MAX - 1) << 32) / noise_step;
+
+    for (uint32_t start = 0; start < count; start += part_max)
+    {
+        noise_render (&buffer [start], (count - start < part_max) ? count - start : part_max, noise_step, noise_gain);
+    }
+}
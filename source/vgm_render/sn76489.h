@@ -0,0 +1,9 @@
+
+/* Reset the SN76489 to silence, running from the given clock. */
+void sn76489_reset (uint32_t clock, uint32_t rate);
+
+/* Write one byte to the SN76489. */
+void sn76489_write (uint8_t data);
+
+/* Add count samples of SN76489 output to the buffer. */
+void sn76489_render (float *buffer, uint32_t count);
@@ -0,0 +1,865 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vgm_convert/vgm_read.h"
+#include "sn76489.h"
+#include "ym2413.h"
+#ifdef SONG_HEADER
+#include "embedded.h"
+#endif
+
+#define RENDER_BLOCK        735     /* Samples rendered at a time, one 60 Hz tick at 44.1 kHz */
+#define TICK_SAMPLES        735     /* One 60 Hz tick, in 44.1 kHz .vgm samples */
+#define CLOCK_NTSC          3579545
+#define EMBEDDED_SECONDS    60
+
+#define DIFF_FRAME          2048    /* Samples per spectrum, a power of two */
+#define DIFF_FLOOR          1e-9    /* -90 dB, so silence in both renders compares as equal */
+
+/* Options */
+static uint32_t sample_rate = 44100;
+static uint32_t seconds = 0;
+static uint8_t song_number = 0;
+static bool ticks = false;
+
+/* Output */
+static FILE *wav_file = NULL;
+static uint32_t samples_written = 0;
+static uint32_t samples_total = 0;
+static bool psg_enabled = false;
+static bool ym2413_enabled = false;
+
+/* Register state for --ticks, as written during the current frame and
+ * as last made on the chips. The PSG registers are indexed by latch. */
+static uint8_t tick_psg_latch = 0;
+static uint16_t tick_psg_regs [8] = { 0, 0x0f, 0, 0x0f, 0, 0x0f, 0, 0x0f };
+static uint16_t tick_psg_applied [8] = { 0, 0x0f, 0, 0x0f, 0, 0x0f, 0, 0x0f };
+static uint8_t tick_psg_dirty = 0;
+static uint8_t tick_ym2413_regs [0x40] = { 0 };
+static uint8_t tick_ym2413_applied [0x40] = { 0 };
+static uint64_t tick_ym2413_dirty = 0;
+
+/* Frame timing for --ticks, following song_read () in vgm_convert */
+static uint64_t tick_count = 0;             /* Start of the current frame */
+static uint64_t tick_frame_start = 0;       /* Position in the .vgm that the frame's delay counts from */
+
+/* The writes from before the loop point that share its frame */
+static uint64_t tick_loop_delay = 0;
+static uint16_t tick_loop_psg_regs [8] = { 0 };
+static uint8_t tick_loop_psg_dirty = 0;
+static uint8_t tick_loop_ym2413_regs [0x40] = { 0 };
+static uint64_t tick_loop_ym2413_dirty = 0;
+
+
+/*
+ * Write a little-endian value to the output.
+ */
+static void wav_put (uint32_t value, uint8_t bytes)
+{
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        fputc ((value >> (8 * i)) & 0xff, wav_file);
+    }
+}
+
+
+/*
+ * Write the RIFF header for 16-bit mono PCM.
+ * The sizes are filled in by wav_close.
+ */
+static void wav_header_write (uint32_t data_size)
+{
+    fwrite ("RIFF", 1, 4, wav_file);
+    wav_put (36 + data_size, 4);
+    fwrite ("WAVEfmt ", 1, 8, wav_file);
+    wav_put (16, 4);                /* Format chunk size */
+    wav_put (1, 2);                 /* PCM */
+    wav_put (1, 2);                 /* Mono */
+    wav_put (sample_rate, 4);
+    wav_put (sample_rate * 2, 4);   /* Bytes per second */
+    wav_put (2, 2);                 /* Bytes per sample */
+    wav_put (16, 2);                /* Bits per sample */
+    fwrite ("data", 1, 4, wav_file);
+    wav_put (data_size, 4);
+}
+
+
+/*
+ * Open the output file.
+ */
+static bool wav_open (char *filename)
+{
+    wav_file = fopen (filename, "wb");
+    if (wav_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", filename);
+        return false;
+    }
+
+    samples_written = 0;
+    wav_header_write (0);
+
+    return true;
+}
+
+
+/*
+ * Complete the header and close the output file.
+ */
+static void wav_close (void)
+{
+    fseek (wav_file, 0, SEEK_SET);
+    wav_header_write (samples_written * 2);
+    fclose (wav_file);
+    wav_file = NULL;
+
+    fprintf (stderr, "Rendered %.1f seconds.\n", (double) samples_written / sample_rate);
+}
+
+
+/*
+ * Render samples from both chips into the output,
+ * up to the length of the render.
+ */
+static void render (uint32_t count)
+{
+    static float buffer [RENDER_BLOCK];
+    static int16_t pcm [RENDER_BLOCK];
+
+    while (count > 0 && samples_written < samples_total)
+    {
+        uint32_t block = count < RENDER_BLOCK ? count : RENDER_BLOCK;
+        if (block > samples_total - samples_written)
+        {
+            block = samples_total - samples_written;
+        }
+
+        memset (buffer, 0, sizeof (buffer));
+
+        if (psg_enabled)
+        {
+            sn76489_render (buffer, block);
+        }
+        if (ym2413_enabled)
+        {
+            ym2413_render (buffer, block);
+        }
+
+        for (uint32_t i = 0; i < block; i++)
+        {
+            float sample = buffer [i] * 32767.0f;
+            pcm [i] = sample > 32767.0f ? 32767 : sample < -32768.0f ? -32768 : (int16_t) sample;
+        }
+
+        /* Note: We assume a little-endian host */
+        fwrite (pcm, sizeof (int16_t), block, wav_file);
+
+        samples_written += block;
+        count -= block;
+    }
+}
+
+
+/*
+ * Hold a PSG write until the start of its frame.
+ */
+static void tick_psg_write (uint8_t data)
+{
+    if (data & 0x80)
+    {
+        tick_psg_latch = (data >> 4) & 0x07;
+    }
+
+    uint16_t *reg = &tick_psg_regs [tick_psg_latch];
+
+    if ((tick_psg_latch & 0x01) || tick_psg_latch == 6)
+    {
+        /* Volume and noise */
+        *reg = data & 0x0f;
+    }
+    else if (data & 0x80)
+    {
+        *reg = (*reg & 0x3f0) | (data & 0x0f);
+    }
+    else
+    {
+        *reg = (*reg & 0x00f) | ((data & 0x3f) << 4);
+    }
+
+    tick_psg_dirty |= 1 << tick_psg_latch;
+}
+
+
+/*
+ * Hold a YM2413 write until the start of its frame.
+ */
+static void tick_ym2413_write (uint8_t addr, uint8_t data)
+{
+    if (addr < 0x40)
+    {
+        tick_ym2413_regs [addr] = data;
+        tick_ym2413_dirty |= (uint64_t) 1 << addr;
+    }
+}
+
+
+/*
+ * Make the register changes of a frame, each with its final value.
+ * As with the frames of a converted song, rewriting a register with
+ * the value it already had is left out, even where it would restart
+ * the noise.
+ */
+static void tick_flush (void)
+{
+    for (uint8_t reg = 0; reg < 8; reg++)
+    {
+        if (tick_psg_regs [reg] != tick_psg_applied [reg])
+        {
+            sn76489_write (0x80 | (reg << 4) | (tick_psg_regs [reg] & 0x0f));
+
+            if (!(reg & 0x01) && reg != 6)
+            {
+                sn76489_write (tick_psg_regs [reg] >> 4);
+            }
+
+            tick_psg_applied [reg] = tick_psg_regs [reg];
+        }
+    }
+
+    for (uint8_t addr = 0; addr < 0x40; addr++)
+    {
+        if (tick_ym2413_regs [addr] != tick_ym2413_applied [addr])
+        {
+            ym2413_write (addr, tick_ym2413_regs [addr]);
+            tick_ym2413_applied [addr] = tick_ym2413_regs [addr];
+        }
+    }
+
+    tick_psg_dirty = 0;
+    tick_ym2413_dirty = 0;
+}
+
+
+/*
+ * End the frame at a position in the .vgm, making its changes and
+ * rendering it for its delay. The part-tick left over counts towards
+ * the next frame's delay, but the final frame of the song lasts at
+ * least one tick and the rest is dropped, as in vgm_convert.
+ */
+static void tick_frame_end (uint64_t vgm_position, bool song_end)
+{
+    uint64_t delay = (vgm_position - tick_frame_start) / TICK_SAMPLES;
+
+    tick_flush ();
+    tick_frame_start += delay * TICK_SAMPLES;
+    tick_count += (song_end && delay == 0) ? 1 : delay;
+
+    render (tick_count * sample_rate / 60 - samples_written);
+}
+
+
+/*
+ * At the loop point, note the frame's delay so far and the writes it
+ * already holds, which the firmware makes again each time it loops.
+ */
+static void tick_loop_save (uint64_t vgm_position)
+{
+    tick_loop_delay = vgm_position - tick_frame_start;
+    memcpy (tick_loop_psg_regs, tick_psg_regs, sizeof (tick_psg_regs));
+    tick_loop_psg_dirty = tick_psg_dirty;
+    memcpy (tick_loop_ym2413_regs, tick_ym2413_regs, sizeof (tick_ym2413_regs));
+    tick_loop_ym2413_dirty = tick_ym2413_dirty;
+}
+
+
+/*
+ * Start the loop's frame again, with the writes and delay it had.
+ */
+static void tick_loop_restore (uint64_t vgm_position)
+{
+    tick_frame_start = vgm_position - tick_loop_delay;
+
+    for (uint8_t reg = 0; reg < 8; reg++)
+    {
+        if (tick_loop_psg_dirty & (1 << reg))
+        {
+            tick_psg_regs [reg] = tick_loop_psg_regs [reg];
+        }
+    }
+
+    for (uint8_t addr = 0; addr < 0x40; addr++)
+    {
+        if (tick_loop_ym2413_dirty & ((uint64_t) 1 << addr))
+        {
+            tick_ym2413_regs [addr] = tick_loop_ym2413_regs [addr];
+        }
+    }
+
+    tick_psg_dirty = tick_loop_psg_dirty;
+    tick_ym2413_dirty = tick_loop_ym2413_dirty;
+}
+
+
+/*
+ * Render a .vgm file, following its loop until the length is reached.
+ *
+ * With --ticks, the writes are instead grouped into frames of whole
+ * 60 Hz ticks as vgm_convert groups them, and each frame's changes are
+ * made at its start. This is how the firmware plays the converted song,
+ * so it is the reference to compare a --embedded render against.
+ */
+static int vgm_render (char *filename)
+{
+    uint8_t *buffer = read_vgm (filename);
+    uint32_t vgm_offset = 0x40;
+    uint64_t vgm_position = 0; /* In 44.1 kHz samples */
+
+    if (buffer == NULL)
+    {
+        /* read_vgm should already have output an error message */
+        return EXIT_FAILURE;
+    }
+
+    /* Note: We assume a little-endian host */
+    uint32_t version = * (uint32_t *)(&buffer [0x08]);
+    uint32_t psg_clock = * (uint32_t *)(&buffer [0x0c]) & 0x3fffffff;
+    uint32_t ym2413_clock = * (uint32_t *)(&buffer [0x10]) & 0x3fffffff;
+
+    uint32_t loop_offset = * (uint32_t *)(&buffer [0x1c]);
+    if (loop_offset != 0)
+    {
+        loop_offset += 0x1c; /* Offsets in the VGM header are relative to their own position in the file */
+    }
+
+    if (version >= 0x150 && * (uint32_t *)(&buffer [0x34]) != 0)
+    {
+        vgm_offset = 0x34 + * (uint32_t *)(&buffer [0x34]);
+    }
+
+    /* By default, play the song through and then its loop once more.
+     * If the header has no length, play to the end of the data. */
+    samples_total = (uint64_t) seconds * sample_rate;
+    if (seconds == 0)
+    {
+        uint64_t length = * (uint32_t *)(&buffer [0x18]) + (loop_offset ? * (uint32_t *)(&buffer [0x20]) : 0);
+        samples_total = length * sample_rate / 44100;
+
+        if (length == 0)
+        {
+            samples_total = UINT32_MAX;
+            loop_offset = 0;
+        }
+    }
+
+    psg_enabled = psg_clock != 0;
+    ym2413_enabled = ym2413_clock != 0;
+    sn76489_reset (psg_clock, sample_rate);
+    ym2413_reset (ym2413_clock, sample_rate);
+
+    uint32_t i = vgm_offset;
+    while (i < SOURCE_SIZE_MAX && samples_written < samples_total)
+    {
+        if (ticks && i == loop_offset)
+        {
+            /* Writes from before the loop point belong to the frame before the loop */
+            if (vgm_position - tick_frame_start >= TICK_SAMPLES)
+            {
+                tick_frame_end (vgm_position, false);
+            }
+            tick_loop_save (vgm_position);
+        }
+
+        uint8_t command = buffer [i++];
+
+        /* Register writes take effect once the song has been rendered up to their position,
+         * or with --ticks, once a tick has passed since their frame began */
+        if ((command == 0x50 || command == 0x51) && !ticks)
+        {
+            render (vgm_position * sample_rate / 44100 - samples_written);
+        }
+        else if ((command == 0x50 || command == 0x51) && vgm_position - tick_frame_start >= TICK_SAMPLES)
+        {
+            tick_frame_end (vgm_position, false);
+        }
+
+        switch (command)
+        {
+        case 0x4f:
+            i++; /* Gamegear stereo data - Ignore */
+            break;
+
+        case 0x50: /* PSG Data */
+            if (ticks)
+            {
+                tick_psg_write (buffer [i++]);
+            }
+            else
+            {
+                sn76489_write (buffer [i++]);
+            }
+            break;
+
+        case 0x51: /* YM2413 */
+            if (ticks)
+            {
+                tick_ym2413_write (buffer [i], buffer [i + 1]);
+            }
+            else
+            {
+                ym2413_write (buffer [i], buffer [i + 1]);
+            }
+            i += 2;
+            break;
+
+        case 0x61: /* Wait n 44.1 KHz samples */
+            vgm_position += * (uint16_t *)(&buffer [i]);
+            i += 2;
+            break;
+
+        case 0x62: /* Wait 1/60 of a second */
+            vgm_position += 735;
+            break;
+
+        case 0x63: /* Wait 1/50 of a second */
+            vgm_position += 882;
+            break;
+
+        case 0x66: /* End of sound data - Loop */
+            if (ticks)
+            {
+                tick_frame_end (vgm_position, true);
+            }
+
+            if (loop_offset == 0)
+            {
+                i = SOURCE_SIZE_MAX;
+            }
+            else
+            {
+                i = loop_offset;
+
+                if (ticks)
+                {
+                    tick_loop_restore (vgm_position);
+                }
+            }
+            break;
+
+        /* 0x7n: Wait n+1 samples */
+        case 0x70: case 0x71: case 0x72: case 0x73:
+        case 0x74: case 0x75: case 0x76: case 0x77:
+        case 0x78: case 0x79: case 0x7a: case 0x7b:
+        case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+            vgm_position += 1 + (command & 0x0f);
+            break;
+
+        case 0xa0: /* AY8910 - Ignore */
+            i += 2;
+            break;
+
+        case 0xd2: /* SCC - Ignore */
+            i += 3;
+            break;
+
+        default:
+            fprintf (stderr, "Error: Unknown command %02x.\n", command);
+            free (buffer);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!ticks)
+    {
+        render (vgm_position * sample_rate / 44100 - samples_written);
+    }
+
+    free (buffer);
+    return EXIT_SUCCESS;
+}
+
+
+#ifdef SONG_HEADER
+/*
+ * Render the embedded song through the firmware's own decoder.
+ */
+static int embedded_render (void)
+{
+    samples_total = (uint64_t) (seconds ? seconds : EMBEDDED_SECONDS) * sample_rate;
+
+    psg_enabled = true;
+    ym2413_enabled = true;
+    sn76489_reset (CLOCK_NTSC, sample_rate);
+    ym2413_reset (CLOCK_NTSC, sample_rate);
+
+    embedded_start (song_number);
+
+    for (uint32_t tick = 0; samples_written < samples_total; tick++)
+    {
+        embedded_tick ();
+
+        /* Round each tick to whole samples without drifting */
+        render ((uint64_t) (tick + 1) * sample_rate / 60 - (uint64_t) tick * sample_rate / 60);
+    }
+
+    return EXIT_SUCCESS;
+}
+#endif /* SONG_HEADER */
+
+
+/*
+ * Read a 16-bit PCM .wav file, mixed down to mono.
+ * The samples should be freed when no longer needed.
+ */
+static float *wav_read (char *filename, uint32_t *count, uint32_t *rate)
+{
+    FILE *file = fopen (filename, "rb");
+    uint8_t chunk [8];
+    uint16_t channels = 0;
+    uint16_t bits = 0;
+    float *samples = NULL;
+
+    if (file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", filename);
+        return NULL;
+    }
+
+    if (fread (chunk, 1, 8, file) != 8 || memcmp (chunk, "RIFF", 4) != 0 ||
+        fread (chunk, 1, 4, file) != 4 || memcmp (chunk, "WAVE", 4) != 0)
+    {
+        fprintf (stderr, "Error: %s is not a valid .wav file.\n", filename);
+        fclose (file);
+        return NULL;
+    }
+
+    while (fread (chunk, 1, 8, file) == 8)
+    {
+        uint32_t size = chunk [4] | (chunk [5] << 8) | (chunk [6] << 16) | ((uint32_t) chunk [7] << 24);
+
+        if (memcmp (chunk, "fmt ", 4) == 0)
+        {
+            uint8_t format [16];
+            if (size < 16 || fread (format, 1, 16, file) != 16)
+            {
+                break;
+            }
+            channels = format [2] | (format [3] << 8);
+            *rate = format [4] | (format [5] << 8) | (format [6] << 16) | ((uint32_t) format [7] << 24);
+            bits = format [14] | (format [15] << 8);
+            fseek (file, size - 16 + (size & 1), SEEK_CUR);
+        }
+        else if (memcmp (chunk, "data", 4) == 0)
+        {
+            if (channels == 0 || bits != 16)
+            {
+                fprintf (stderr, "Error: %s is not 16-bit PCM.\n", filename);
+                break;
+            }
+
+            *count = size / (2 * channels);
+            samples = calloc (*count ? *count : 1, sizeof (float));
+            if (samples == NULL)
+            {
+                fprintf (stderr, "Error: Unable to allocate %d samples of memory.\n", *count);
+                break;
+            }
+
+            for (uint32_t i = 0; i < *count; i++)
+            {
+                for (uint16_t channel = 0; channel < channels; channel++)
+                {
+                    int low = fgetc (file);
+                    int high = fgetc (file);
+                    samples [i] += (int16_t) (low | (high << 8)) / (32768.0f * channels);
+                }
+            }
+            break;
+        }
+        else
+        {
+            fseek (file, size + (size & 1), SEEK_CUR);
+        }
+    }
+
+    if (samples == NULL && channels != 0 && bits == 16)
+    {
+        fprintf (stderr, "Error: %s has no data.\n", filename);
+    }
+
+    fclose (file);
+    return samples;
+}
+
+
+/*
+ * In-place radix-2 FFT of DIFF_FRAME complex values.
+ */
+static void fft (float *real, float *imag)
+{
+    /* Bit-reversed ordering */
+    for (uint32_t i = 1, j = 0; i < DIFF_FRAME; i++)
+    {
+        uint32_t bit = DIFF_FRAME >> 1;
+        for (; j & bit; bit >>= 1)
+        {
+            j ^= bit;
+        }
+        j ^= bit;
+
+        if (i < j)
+        {
+            float swap = real [i]; real [i] = real [j]; real [j] = swap;
+            swap = imag [i]; imag [i] = imag [j]; imag [j] = swap;
+        }
+    }
+
+    for (uint32_t length = 2; length <= DIFF_FRAME; length <<= 1)
+    {
+        float angle = -2.0f * M_PI / length;
+
+        for (uint32_t start = 0; start < DIFF_FRAME; start += length)
+        {
+            for (uint32_t k = 0; k < length / 2; k++)
+            {
+                float w_real = cosf (angle * k);
+                float w_imag = sinf (angle * k);
+                uint32_t even = start + k;
+                uint32_t odd = even + length / 2;
+
+                float t_real = real [odd] * w_real - imag [odd] * w_imag;
+                float t_imag = real [odd] * w_imag + imag [odd] * w_real;
+
+                real [odd] = real [even] - t_real;
+                imag [odd] = imag [even] - t_imag;
+                real [even] += t_real;
+                imag [even] += t_imag;
+            }
+        }
+    }
+}
+
+
+/*
+ * Power spectrum in dB of the frame starting at a sample, with a Hann window.
+ */
+static void spectrum (const float *samples, uint32_t start, float *power)
+{
+    static float real [DIFF_FRAME];
+    static float imag [DIFF_FRAME];
+
+    for (uint32_t i = 0; i < DIFF_FRAME; i++)
+    {
+        real [i] = samples [start + i] * (0.5f - 0.5f * cosf (2.0f * M_PI * i / DIFF_FRAME));
+        imag [i] = 0.0f;
+    }
+
+    fft (real, imag);
+
+    for (uint32_t bin = 0; bin < DIFF_FRAME / 2; bin++)
+    {
+        float magnitude = (real [bin] * real [bin] + imag [bin] * imag [bin]) / (DIFF_FRAME * DIFF_FRAME / 16);
+        power [bin] = 10.0f * log10f (magnitude + DIFF_FLOOR);
+    }
+}
+
+
+/*
+ * Compare two renders. The score is the log-spectral distance, the RMS
+ * difference in dB between their spectra, averaged over half-overlapping
+ * frames. Spectra rather than samples are compared, so that the phase of
+ * each oscillator does not count as a difference.
+ *
+ * The score measures conversion loss only between a --ticks render of
+ * the .vgm and an --embedded render of its conversion, which are equal
+ * when the chips are left in the same state on every tick.
+ */
+static int diff_render (char *filename_a, char *filename_b)
+{
+    static float power_a [DIFF_FRAME / 2];
+    static float power_b [DIFF_FRAME / 2];
+    uint32_t count_a = 0, count_b = 0;
+    uint32_t rate_a = 0, rate_b = 0;
+    float *samples_a = wav_read (filename_a, &count_a, &rate_a);
+    float *samples_b = wav_read (filename_b, &count_b, &rate_b);
+    int ret = EXIT_FAILURE;
+
+    if (samples_a == NULL || samples_b == NULL)
+    {
+        goto done;
+    }
+
+    if (rate_a != rate_b)
+    {
+        fprintf (stderr, "Error: Sample rates differ (%d Hz and %d Hz).\n", rate_a, rate_b);
+        goto done;
+    }
+
+    uint32_t count = count_a < count_b ? count_a : count_b;
+    if (count_a != count_b)
+    {
+        fprintf (stderr, "Lengths differ (%.3f s and %.3f s), comparing the first %.3f s.\n",
+                 (double) count_a / rate_a, (double) count_b / rate_b, (double) count / rate_a);
+    }
+
+    if (count < DIFF_FRAME)
+    {
+        fprintf (stderr, "Error: Renders are too short to compare.\n");
+        goto done;
+    }
+
+    double distance_total = 0.0;
+    double distance_worst = 0.0;
+    uint32_t frame_worst = 0;
+    uint32_t frame_count = 0;
+
+    for (uint32_t start = 0; start + DIFF_FRAME <= count; start += DIFF_FRAME / 2)
+    {
+        double distance = 0.0;
+
+        spectrum (samples_a, start, power_a);
+        spectrum (samples_b, start, power_b);
+
+        for (uint32_t bin = 1; bin < DIFF_FRAME / 2; bin++)
+        {
+            distance += (power_a [bin] - power_b [bin]) * (power_a [bin] - power_b [bin]);
+        }
+        distance = sqrt (distance / (DIFF_FRAME / 2 - 1));
+
+        if (distance > distance_worst)
+        {
+            distance_worst = distance;
+            frame_worst = start;
+        }
+
+        distance_total += distance;
+        frame_count++;
+    }
+
+    printf ("Difference: %.2f dB average, %.2f dB worst at %.2f s.\n",
+            distance_total / frame_count, distance_worst, (double) frame_worst / rate_a);
+    ret = EXIT_SUCCESS;
+
+done:
+    free (samples_a);
+    free (samples_b);
+    return ret;
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    char *filenames [2] = { NULL };
+    uint8_t filename_count = 0;
+    bool embedded = false;
+    bool diff = false;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp (argv [arg], "--rate") == 0 && arg + 1 < argc)
+        {
+            /* Output sample rate */
+            sample_rate = strtoul (argv [++arg], NULL, 0);
+        }
+        else if (strcmp (argv [arg], "--seconds") == 0 && arg + 1 < argc)
+        {
+            /* Length of the render */
+            seconds = strtoul (argv [++arg], NULL, 0);
+        }
+        else if (strcmp (argv [arg], "--song") == 0 && arg + 1 < argc)
+        {
+            /* Embedded song to play */
+            song_number = strtoul (argv [++arg], NULL, 0);
+        }
+        else if (strcmp (argv [arg], "--embedded") == 0)
+        {
+            /* Play the song built in from SONG_HEADER */
+            embedded = true;
+        }
+        else if (strcmp (argv [arg], "--ticks") == 0)
+        {
+            /* Play the .vgm in 60 Hz ticks, as the firmware would */
+            ticks = true;
+        }
+        else if (strcmp (argv [arg], "--diff") == 0)
+        {
+            /* Compare two renders */
+            diff = true;
+        }
+        else if (argv [arg][0] == '-')
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [arg]);
+            return EXIT_FAILURE;
+        }
+        else if (filename_count == 2)
+        {
+            fprintf (stderr, "Error: Too many files.\n");
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            filenames [filename_count++] = argv [arg];
+        }
+    }
+
+    if (sample_rate < 8000 || sample_rate > 192000)
+    {
+        fprintf (stderr, "Error: Sample rate must be between 8000 and 192000 Hz.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (diff)
+    {
+        if (filename_count != 2)
+        {
+            fprintf (stderr, "Usage: vgm_render --diff <a.wav> <b.wav>\n");
+            return EXIT_FAILURE;
+        }
+
+        return diff_render (filenames [0], filenames [1]);
+    }
+
+    if (embedded)
+    {
+#ifdef SONG_HEADER
+        if (filename_count != 1)
+        {
+            fprintf (stderr, "Usage: vgm_render --embedded [--song <n>] [--seconds <s>] [--rate <hz>] <out.wav>\n");
+            return EXIT_FAILURE;
+        }
+
+        if (!wav_open (filenames [0]))
+        {
+            return EXIT_FAILURE;
+        }
+
+        int ret = embedded_render ();
+        wav_close ();
+        return ret;
+#else
+        fprintf (stderr, "Error: No embedded song, build with ./build_render.sh <song.h>.\n");
+        return EXIT_FAILURE;
+#endif
+    }
+
+    if (filename_count != 2)
+    {
+        fprintf (stderr, "Usage: vgm_render [--ticks] [--seconds <s>] [--rate <hz>] <file.vgm> <out.wav>\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!wav_open (filenames [1]))
+    {
+        return EXIT_FAILURE;
+    }
+
+    int ret = vgm_render (filenames [0]);
+    wav_close ();
+    return ret;
+}
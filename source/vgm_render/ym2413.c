@@ -0,0 +1,513 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ym2413.h"
+
+#define CHANNEL_COUNT       9
+#define CHANNEL_GAIN        0.15f
+#define SLOT_MODULATOR      0
+#define SLOT_CARRIER        1
+
+#define ENVELOPE_BLOCK      16      /* Samples between envelope updates */
+#define ENVELOPE_SILENT     48.0f   /* Attenuation in dB at the end of the envelope */
+#define MODULATION_INDEX    2.0f    /* Carrier phase offset in cycles for a full-scale modulator */
+
+#define TREMOLO_RATE        3.7f    /* Hz */
+#define TREMOLO_DEPTH       0.425f  /* 4.8 dB */
+#define VIBRATO_RATE        6.4f    /* Hz */
+#define VIBRATO_DEPTH       0.0081f /* 14 cents */
+
+typedef enum envelope_stage_e
+{
+    STAGE_ATTACK = 0,
+    STAGE_DECAY,
+    STAGE_SUSTAIN,
+    STAGE_RELEASE,
+    STAGE_OFF
+} envelope_stage_t;
+
+/* Built-in instruments 1-15, followed by the rhythm instruments for
+ * the bass drum, hi-hat / snare drum, and tom-tom / top cymbal. */
+static const uint8_t patch_rom [19] [8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x71, 0x61, 0x1e, 0x17, 0xd0, 0x78, 0x00, 0x17 }, /* Violin */
+    { 0x13, 0x41, 0x1a, 0x0d, 0xd8, 0xf7, 0x23, 0x13 }, /* Guitar */
+    { 0x13, 0x01, 0x99, 0x00, 0xf2, 0xc4, 0x21, 0x23 }, /* Piano */
+    { 0x11, 0x61, 0x0e, 0x07, 0x8d, 0x64, 0x70, 0x27 }, /* Flute */
+    { 0x32, 0x21, 0x1e, 0x06, 0xe1, 0x76, 0x01, 0x28 }, /* Clarinet */
+    { 0x31, 0x22, 0x16, 0x05, 0xe0, 0x71, 0x00, 0x18 }, /* Oboe */
+    { 0x21, 0x61, 0x1d, 0x07, 0x82, 0x81, 0x11, 0x07 }, /* Trumpet */
+    { 0x33, 0x21, 0x2d, 0x13, 0xb0, 0x70, 0x00, 0x07 }, /* Organ */
+    { 0x61, 0x61, 0x1b, 0x06, 0x64, 0x65, 0x10, 0x17 }, /* Horn */
+    { 0x41, 0x61, 0x0b, 0x18, 0x85, 0xf0, 0x81, 0x07 }, /* Synthesizer */
+    { 0x33, 0x01, 0x83, 0x11, 0xea, 0xef, 0x10, 0x04 }, /* Harpsichord */
+    { 0x17, 0xc1, 0x24, 0x07, 0xf8, 0xf8, 0x22, 0x12 }, /* Vibraphone */
+    { 0x61, 0x50, 0x0c, 0x05, 0xd2, 0xf5, 0x40, 0x42 }, /* Synthesizer Bass */
+    { 0x01, 0x01, 0x55, 0x03, 0xe9, 0x90, 0x03, 0x02 }, /* Acoustic Bass */
+    { 0x41, 0x41, 0x89, 0x03, 0xf1, 0xe4, 0xc0, 0x13 }, /* Electric Guitar */
+    { 0x01, 0x01, 0x18, 0x0f, 0xdf, 0xf8, 0x6a, 0x6d }, /* Bass Drum */
+    { 0x01, 0x01, 0x00, 0x00, 0xc8, 0xd8, 0xa7, 0x68 }, /* Hi-Hat / Snare Drum */
+    { 0x05, 0x01, 0x00, 0x00, 0xf8, 0xaa, 0x59, 0x55 }, /* Tom-Tom / Top Cymbal */
+};
+
+static const float multiple_table [16] = { 0.5f, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 10, 12, 12, 15, 15 };
+
+/* Key scale attenuation in dB at block 7, for the 6 dB/octave setting */
+static const float key_scale_table [16] = { 0.0f, 9.0f, 12.0f, 13.875f, 15.0f, 16.125f, 16.875f, 17.625f,
+                                            18.0f, 18.75f, 19.125f, 19.5f, 19.875f, 20.25f, 20.625f, 21.0f };
+static const float key_scale_setting [4] = { 0.0f, 0.25f, 0.5f, 1.0f };
+
+static uint32_t clock_rate = 3579545;
+static uint32_t sample_rate = 44100;
+static uint8_t registers [0x40] = { 0 };
+
+/* Operator state is kept as arrays across the channels, so that the
+ * per-sample loops work on every channel at once and are vectorised
+ * by the compiler. Envelopes only change every ENVELOPE_BLOCK samples,
+ * with the gain stepped linearly in between. */
+static float phase              [2] [CHANNEL_COUNT];    /* Fraction of a cycle */
+static float increment          [2] [CHANNEL_COUNT];    /* Cycles per sample */
+static float attenuation        [2] [CHANNEL_COUNT];    /* Total level and key scaling, in dB */
+static float rectify            [2] [CHANNEL_COUNT];    /* -1 for a full sine, 0 for half */
+static float tremolo            [2] [CHANNEL_COUNT];
+static float vibrato            [2] [CHANNEL_COUNT];
+static float gain               [2] [CHANNEL_COUNT];
+static float gain_step          [2] [CHANNEL_COUNT];
+static float feedback           [CHANNEL_COUNT];        /* Cycles per unit of the last two outputs */
+static float feedback_history   [2] [CHANNEL_COUNT];
+static float mix                [CHANNEL_COUNT];
+
+/* Envelope state */
+static bool key                 [2] [CHANNEL_COUNT];
+static uint8_t stage            [2] [CHANNEL_COUNT];
+static float level              [2] [CHANNEL_COUNT];    /* dB */
+static uint8_t attack_rate      [2] [CHANNEL_COUNT];
+static uint8_t decay_rate       [2] [CHANNEL_COUNT];
+static uint8_t sustain_level    [2] [CHANNEL_COUNT];
+static uint8_t release_rate     [2] [CHANNEL_COUNT];
+static uint8_t key_scale_rate   [2] [CHANNEL_COUNT];
+static bool sustained           [2] [CHANNEL_COUNT];    /* Envelope holds at the sustain level */
+
+static uint32_t envelope_countdown = 0;
+static float tremolo_phase = 0.0f;
+static float vibrato_phase = 0.0f;
+static uint32_t noise_register = 1;
+
+
+/*
+ * Sine of a phase given in cycles, by a corrected parabola.
+ * There are no branches or table lookups, so it vectorises.
+ */
+static inline float sine (float x)
+{
+    x -= (float) (int32_t) x;
+    x -= (float) (int32_t) (x * 2.0f);
+
+    float y = 8.0f * x - 16.0f * x * fabsf (x);
+
+    return y + 0.225f * (y * fabsf (y) - y);
+}
+
+
+/*
+ * True if the channel is playing a rhythm instrument.
+ */
+static bool channel_rhythm (uint8_t channel)
+{
+    return (registers [0x0e] & 0x20) && channel >= 6;
+}
+
+
+/*
+ * Instrument in use by a channel.
+ */
+static const uint8_t *channel_patch (uint8_t channel)
+{
+    if (channel_rhythm (channel))
+    {
+        return patch_rom [16 + channel - 6];
+    }
+
+    uint8_t instrument = registers [0x30 + channel] >> 4;
+
+    return instrument ? patch_rom [instrument] : registers;
+}
+
+
+/*
+ * Recalculate a channel's operators after a register change.
+ */
+static void channel_update (uint8_t channel)
+{
+    const uint8_t *patch = channel_patch (channel);
+    uint16_t fnum = registers [0x10 + channel] | ((registers [0x20 + channel] & 0x01) << 8);
+    uint8_t block = (registers [0x20 + channel] >> 1) & 0x07;
+
+    float frequency = fnum * (clock_rate / 72.0f) * (1 << block) / 524288.0f;
+    float key_scale = fmaxf (0.0f, key_scale_table [fnum >> 5] - 6.0f * (7 - block));
+
+    for (uint8_t slot = SLOT_MODULATOR; slot <= SLOT_CARRIER; slot++)
+    {
+        increment      [slot] [channel] = frequency * multiple_table [patch [slot] & 0x0f] / sample_rate;
+        tremolo        [slot] [channel] = (patch [slot] & 0x80) ? 1.0f : 0.0f;
+        vibrato        [slot] [channel] = (patch [slot] & 0x40) ? 1.0f : 0.0f;
+        sustained      [slot] [channel] = (patch [slot] & 0x20) != 0;
+        key_scale_rate [slot] [channel] = (patch [slot] & 0x10) ? (block << 1 | fnum >> 8) : (block >> 1);
+        attack_rate    [slot] [channel] = patch [4 + slot] >> 4;
+        decay_rate     [slot] [channel] = patch [4 + slot] & 0x0f;
+        sustain_level  [slot] [channel] = patch [6 + slot] >> 4;
+        release_rate   [slot] [channel] = patch [6 + slot] & 0x0f;
+    }
+
+    attenuation [SLOT_MODULATOR] [channel] = (patch [2] & 0x3f) * 0.75f + key_scale * key_scale_setting [patch [2] >> 6];
+    attenuation [SLOT_CARRIER] [channel] = (registers [0x30 + channel] & 0x0f) * 3.0f + key_scale * key_scale_setting [patch [3] >> 6];
+    rectify [SLOT_MODULATOR] [channel] = (patch [3] & 0x08) ? 0.0f : -1.0f;
+    rectify [SLOT_CARRIER] [channel] = (patch [3] & 0x10) ? 0.0f : -1.0f;
+    feedback [channel] = (patch [3] & 0x07) ? exp2f ((patch [3] & 0x07) - 7) : 0.0f;
+    mix [channel] = CHANNEL_GAIN;
+
+    if (channel_rhythm (channel))
+    {
+        /* The bass drum is doubled. The hi-hat and tom-tom take their
+         * volume from the instrument bits, and are mixed separately. */
+        if (channel == 6)
+        {
+            mix [channel] = 2.0f * CHANNEL_GAIN;
+        }
+        else
+        {
+            attenuation [SLOT_MODULATOR] [channel] = (registers [0x30 + channel] >> 4) * 3.0f;
+            mix [channel] = 0.0f;
+        }
+    }
+}
+
+
+/*
+ * Start or release the envelopes of any operators whose key has changed.
+ */
+static void key_update (void)
+{
+    uint8_t rhythm = (registers [0x0e] & 0x20) ? registers [0x0e] : 0;
+
+    for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+    {
+        bool channel_key = (registers [0x20 + channel] & 0x10) != 0;
+        bool slot_key [2] = { channel_key, channel_key };
+
+        if (channel == 6)
+        {
+            slot_key [SLOT_MODULATOR] |= (rhythm & 0x10) != 0;  /* Bass drum */
+            slot_key [SLOT_CARRIER]   |= (rhythm & 0x10) != 0;
+        }
+        else if (channel == 7)
+        {
+            slot_key [SLOT_MODULATOR] |= (rhythm & 0x01) != 0;  /* Hi-hat */
+            slot_key [SLOT_CARRIER]   |= (rhythm & 0x08) != 0;  /* Snare drum */
+        }
+        else if (channel == 8)
+        {
+            slot_key [SLOT_MODULATOR] |= (rhythm & 0x04) != 0;  /* Tom-tom */
+            slot_key [SLOT_CARRIER]   |= (rhythm & 0x02) != 0;  /* Top cymbal */
+        }
+
+        for (uint8_t slot = SLOT_MODULATOR; slot <= SLOT_CARRIER; slot++)
+        {
+            if (slot_key [slot] && !key [slot] [channel])
+            {
+                stage [slot] [channel] = STAGE_ATTACK;
+                phase [slot] [channel] = 0.0f;
+            }
+            else if (!slot_key [slot] && key [slot] [channel] && stage [slot] [channel] != STAGE_OFF)
+            {
+                stage [slot] [channel] = STAGE_RELEASE;
+            }
+
+            key [slot] [channel] = slot_key [slot];
+        }
+    }
+}
+
+
+/*
+ * Speed of a decay or release in dB per second.
+ * A rate of 1 takes 39.3 s to fall by 96 dB, and each
+ * step of the rate with its key scaling doubles the speed.
+ */
+static float envelope_speed (uint8_t rate, uint8_t key_scale)
+{
+    if (rate == 0)
+    {
+        return 0.0f;
+    }
+
+    uint8_t effective = rate * 4 + key_scale;
+    if (effective > 63)
+    {
+        effective = 63;
+    }
+
+    return 96.0f / 39.28f * exp2f ((effective - 4) / 4.0f);
+}
+
+
+/*
+ * Advance every envelope by one block, and set the gain steps
+ * that reach the new level at the end of the block.
+ */
+static void envelope_update (void)
+{
+    float seconds = (float) ENVELOPE_BLOCK / sample_rate;
+
+    for (uint8_t slot = SLOT_MODULATOR; slot <= SLOT_CARRIER; slot++)
+    {
+        for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+        {
+            float *envelope = &level [slot] [channel];
+            uint8_t key_scale = key_scale_rate [slot] [channel];
+            uint8_t release = release_rate [slot] [channel];
+
+            switch (stage [slot] [channel])
+            {
+                case STAGE_ATTACK:
+                {
+                    /* A rate of 1 takes 2.8 s to reach full level,
+                     * and 15 is immediate. The attack is exponential. */
+                    uint8_t effective = attack_rate [slot] [channel] * 4 + key_scale;
+
+                    if (attack_rate [slot] [channel] == 0)
+                    {
+                        break;
+                    }
+                    else if (effective >= 60)
+                    {
+                        *envelope = 0.0f;
+                    }
+                    else
+                    {
+                        float attack_time = 2.826f * exp2f (-(effective - 4) / 4.0f);
+                        *envelope *= expf (-6.2f * seconds / attack_time);
+                    }
+
+                    if (*envelope < 0.1f)
+                    {
+                        *envelope = 0.0f;
+                        stage [slot] [channel] = STAGE_DECAY;
+                    }
+                    break;
+                }
+
+                case STAGE_DECAY:
+                    *envelope += envelope_speed (decay_rate [slot] [channel], key_scale) * seconds;
+
+                    if (*envelope >= sustain_level [slot] [channel] * 3.0f)
+                    {
+                        *envelope = sustain_level [slot] [channel] * 3.0f;
+                        stage [slot] [channel] = STAGE_SUSTAIN;
+                    }
+                    break;
+
+                case STAGE_SUSTAIN:
+                    /* Percussive instruments carry on fading at the release rate */
+                    if (!sustained [slot] [channel])
+                    {
+                        *envelope += envelope_speed (release, key_scale) * seconds;
+                    }
+                    break;
+
+                case STAGE_RELEASE:
+                    /* The channel's sustain bit holds the release at rate 5 */
+                    if (registers [0x20 + channel] & 0x20)
+                    {
+                        release = 5;
+                    }
+                    else if (!sustained [slot] [channel])
+                    {
+                        release = 7;
+                    }
+
+                    *envelope += envelope_speed (release, key_scale) * seconds;
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (*envelope >= ENVELOPE_SILENT)
+            {
+                *envelope = ENVELOPE_SILENT;
+
+                if (stage [slot] [channel] != STAGE_ATTACK)
+                {
+                    stage [slot] [channel] = STAGE_OFF;
+                }
+            }
+
+            float target = 0.0f;
+            if (stage [slot] [channel] != STAGE_OFF)
+            {
+                target = powf (10.0f, -(*envelope + attenuation [slot] [channel]) / 20.0f);
+            }
+
+            gain_step [slot] [channel] = (target - gain [slot] [channel]) / ENVELOPE_BLOCK;
+        }
+    }
+}
+
+
+/*
+ * Reset the YM2413 to silence, running from the given clock.
+ */
+void ym2413_reset (uint32_t clock, uint32_t rate)
+{
+    clock_rate = clock;
+    sample_rate = rate;
+
+    for (uint8_t addr = 0; addr < 0x40; addr++)
+    {
+        registers [addr] = 0;
+    }
+
+    for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+    {
+        for (uint8_t slot = SLOT_MODULATOR; slot <= SLOT_CARRIER; slot++)
+        {
+            phase [slot] [channel] = 0.0f;
+            gain [slot] [channel] = 0.0f;
+            gain_step [slot] [channel] = 0.0f;
+            feedback_history [slot] [channel] = 0.0f;
+            key [slot] [channel] = false;
+            stage [slot] [channel] = STAGE_OFF;
+            level [slot] [channel] = ENVELOPE_SILENT;
+        }
+
+        channel_update (channel);
+    }
+
+    envelope_countdown = 0;
+    tremolo_phase = 0.0f;
+    vibrato_phase = 0.0f;
+    noise_register = 1;
+}
+
+
+/*
+ * Write one YM2413 register.
+ */
+void ym2413_write (uint8_t addr, uint8_t data)
+{
+    if (addr >= 0x40)
+    {
+        return;
+    }
+
+    registers [addr] = data;
+
+    /* The user instrument and rhythm mode may affect any channel */
+    if (addr < 0x08 || addr == 0x0e)
+    {
+        for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+        {
+            channel_update (channel);
+        }
+    }
+    else if ((addr & 0x0f) < CHANNEL_COUNT)
+    {
+        channel_update (addr & 0x0f);
+    }
+
+    key_update ();
+}
+
+
+/*
+ * Add count samples of YM2413 output to the buffer.
+ */
+void ym2413_render (float *buffer, uint32_t count)
+{
+    float modulator [CHANNEL_COUNT];
+    float carrier [CHANNEL_COUNT];
+    bool rhythm = (registers [0x0e] & 0x20) != 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (envelope_countdown == 0)
+        {
+            envelope_update ();
+            envelope_countdown = ENVELOPE_BLOCK;
+        }
+        envelope_countdown--;
+
+        /* Low frequency oscillators, shared by all channels */
+        tremolo_phase += TREMOLO_RATE / sample_rate;
+        tremolo_phase -= (int32_t) tremolo_phase;
+        vibrato_phase += VIBRATO_RATE / sample_rate;
+        vibrato_phase -= (int32_t) vibrato_phase;
+
+        float tremolo_gain = TREMOLO_DEPTH * (1.0f - fabsf (2.0f * tremolo_phase - 1.0f));
+        float vibrato_offset = VIBRATO_DEPTH * sine (vibrato_phase);
+
+        for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+        {
+            float *slot_phase = &phase [SLOT_MODULATOR] [channel];
+            float *slot_gain = &gain [SLOT_MODULATOR] [channel];
+
+            *slot_phase += increment [SLOT_MODULATOR] [channel] * (1.0f + vibrato [SLOT_MODULATOR] [channel] * vibrato_offset);
+            *slot_phase -= (int32_t) *slot_phase;
+            *slot_gain += gain_step [SLOT_MODULATOR] [channel];
+
+            float input = *slot_phase + feedback [channel] * (feedback_history [0] [channel] + feedback_history [1] [channel]);
+            float output = fmaxf (sine (input), rectify [SLOT_MODULATOR] [channel]) * *slot_gain
+                         * (1.0f - tremolo [SLOT_MODULATOR] [channel] * tremolo_gain);
+
+            feedback_history [1] [channel] = feedback_history [0] [channel];
+            feedback_history [0] [channel] = output;
+            modulator [channel] = output;
+        }
+
+        for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+        {
+            float *slot_phase = &phase [SLOT_CARRIER] [channel];
+            float *slot_gain = &gain [SLOT_CARRIER] [channel];
+
+            *slot_phase += increment [SLOT_CARRIER] [channel] * (1.0f + vibrato [SLOT_CARRIER] [channel] * vibrato_offset);
+            *slot_phase -= (int32_t) *slot_phase;
+            *slot_gain += gain_step [SLOT_CARRIER] [channel];
+
+            float input = *slot_phase + modulator [channel] * MODULATION_INDEX;
+            carrier [channel] = fmaxf (sine (input), rectify [SLOT_CARRIER] [channel]) * *slot_gain
+                              * (1.0f - tremolo [SLOT_CARRIER] [channel] * tremolo_gain);
+        }
+
+        float sample = 0.0f;
+        for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+        {
+            sample += carrier [channel] * mix [channel];
+        }
+
+        /* The hi-hat, snare drum, tom-tom, and top cymbal are not FM
+         * pairs. They are approximated from the operator phases and
+         * envelopes, and a noise generator. */
+        if (rhythm)
+        {
+            if (noise_register & 0x01)
+            {
+                noise_register ^= 0x800302;
+            }
+            noise_register >>= 1;
+
+            float noise = (noise_register & 0x01) ? 1.0f : -1.0f;
+            float square = phase [SLOT_CARRIER] [8] < 0.5f ? 1.0f : -1.0f;
+
+            float hi_hat = gain [SLOT_MODULATOR] [7] * noise;
+            float snare_drum = gain [SLOT_CARRIER] [7] * 0.5f * (sine (phase [SLOT_CARRIER] [7]) + noise);
+            float tom_tom = gain [SLOT_MODULATOR] [8] * sine (phase [SLOT_MODULATOR] [8]);
+            float top_cymbal = gain [SLOT_CARRIER] [8] * square * noise;
+
+            sample += 2.0f * CHANNEL_GAIN * (hi_hat + snare_drum + tom_tom + top_cymbal);
+        }
+
+        buffer [i] += sample;
+    }
+}
@@ -0,0 +1,9 @@
+
+/* Reset the YM2413 to silence, running from the given clock. */
+void ym2413_reset (uint32_t clock, uint32_t rate);
+
+/* Write one YM2413 register. */
+void ym2413_write (uint8_t addr, uint8_t data);
+
+/* Add count samples of YM2413 output to the buffer. */
+void ym2413_render (float *buffer, uint32_t count);
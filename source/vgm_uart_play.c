@@ -4,39 +4,93 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <asm/termbits.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 
 #include "vgm_convert/vgm_read.h"
 
-/* State tracking */
-static uint32_t samples_delay = 0;
-static int uart_fd = -1;
+#define EVENT_COUNT_MAX     (SOURCE_SIZE_MAX / 2)   /* Each VGM write takes at least two bytes */
+#define STREAM_DATA_MAX     SOURCE_SIZE_MAX         /* Each VGM write becomes at most as many UART bytes */
+#define LOOP_NONE           UINT32_MAX
+#define SNAPSHOT_SECONDS    5       /* Time between chip state snapshots, for seeking */
+#define SEEK_SECONDS        10      /* Time moved by the arrow keys */
+#define LOOPS_FOREVER       UINT32_MAX
+#define LOOPS_PLAYLIST      1       /* Loop repeats before moving on to the next song */
 
-/* TODO: The combination of how handle_delay works
- *       and how we call a potentially blocking write
- *       to the UART mean that the music will play
- *       slightly too slow.
- *
- *       One option is to move uart writes to a
- *       separate thread. A better solution may be to
- *       update handle_delay so that it waits until
- *       a specific wall-time has been reached.
- */
+#define USAGE "Usage: vgm_uart_play [--save <file.vgs>] [--start <seconds>] [--loops <n>] " \
+              "[--device <tty>] <file.vgm | file.vgs> ...\n"
 
-/*
- * Wait the expected amount of time between register writes.
- */
-void handle_delay (void)
+const uint8_t stream_magic [4] = { 'V', 'g', 'm', 'S' };
+
+/* A group of UART bytes to send at one time, in 44.1 kHz samples from the start */
+typedef struct event_s
 {
-    /* Convert 44.1 kHz samples into µs */
-    usleep (samples_delay * 10000 / 441);
-    samples_delay = 0;
-}
+    uint32_t time;
+    uint32_t offset;    /* Into stream_data */
+    uint16_t length;
+} event_t;
+
+/* Register values of both chips */
+typedef struct chip_state_s
+{
+    uint16_t psg_tone [3];
+    uint8_t psg_volume [4];
+    uint8_t psg_noise;
+    uint8_t psg_latch;
+    uint8_t ym2413_regs [0x40];
+} chip_state_t;
+
+/* Chip state at a time, with the event to continue from. Pass 1
+ * snapshots are in the first repeat of the loop, so that later
+ * repeats can be reached from the same snapshots. */
+typedef struct snapshot_s
+{
+    uint32_t event;
+    uint8_t pass;
+    chip_state_t state;
+} snapshot_t;
+
+/* Prepared stream */
+typedef struct stream_s
+{
+    event_t *events;
+    uint32_t event_count;
+    uint8_t *stream_data;
+    uint32_t stream_data_size;
+    uint32_t loop_index;        /* First event of the loop */
+    uint32_t loop_time;
+    uint32_t end_time;
+    snapshot_t *snapshots;
+    uint32_t snapshot_count;
+} stream_t;
+
+/* Chip state while preparing, used to drop writes that change nothing.
+ * -1 is unknown, so the next write to that register is always kept. */
+static int16_t psg_latch = 0;
+static int16_t psg_tone_low [3] = { 0 };
+static int16_t psg_tone_high [3] = { 0 };
+static int16_t psg_volume [4] = { 0 };
+static int16_t ym2413_regs [0x40] = { 0 };
+static uint32_t writes_dropped = 0;
+static bool event_split = false;
+
+/* The state left by the firmware's reset, which finishes by muting the noise channel */
+static const chip_state_t chip_state_reset = { .psg_volume = { 0x0f, 0x0f, 0x0f, 0x0f }, .psg_latch = 7 };
+
+/* State tracking */
+static char *uart_device = "/dev/ttyUSB0";
+static int uart_fd = -1;
+static chip_state_t chips;  /* As written to the UART */
+static uint32_t loop_count = LOOPS_FOREVER;
+static bool interactive = false;
+static struct termios2 input_attributes;
 
 
 /*
@@ -53,11 +107,49 @@ void uart_write (uint8_t data)
 }
 
 
+/*
+ * Write a group of bytes to the UART.
+ */
+void uart_write_buffer (const uint8_t *data, uint32_t length)
+{
+    while (length > 0)
+    {
+        int ret = write (uart_fd, data, length);
+
+        if (ret <= 0)
+        {
+            fprintf (stderr, "UART Write returns %d.\n", ret);
+            return;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+}
+
+
+/*
+ * Put the terminal back the way it was found.
+ */
+void input_restore (void)
+{
+    if (interactive)
+    {
+        ioctl (STDIN_FILENO, TCSETS2, &input_attributes);
+        interactive = false;
+    }
+}
+
+
 /*
  * Stop sustained tones before exiting.
  */
 void sigint_handler (int dummy)
 {
+    (void) dummy;
+
+    input_restore ();
+
     if (uart_fd >= 0)
     {
         uart_write (0x00);
@@ -68,87 +160,129 @@ void sigint_handler (int dummy)
 
 
 /*
- * Entry point.
- *
- * Currently contains the parser for VGM commands
- * and generator for the output text.
+ * Set the chip state to what the firmware's reset leaves behind,
+ * or to unknown, as at the loop point where playback may arrive
+ * from the end of the song.
  */
-int main (int argc, char **argv)
+static void state_reset (bool known)
 {
-    /* File I/O */
-    char *filename = argv [1];
-    uint8_t *buffer = NULL;
-    uint32_t vgm_offset = 0;
+    /* The reset finishes by muting the noise channel */
+    psg_latch = known ? 7 : -1;
 
-    /* Serial I/O */
-    uart_fd = open ("/dev/ttyUSB0", O_RDWR);
-    if (uart_fd < 0)
+    for (uint8_t channel = 0; channel < 3; channel++)
     {
-        fprintf (stderr, "Cannot open ttyUSB0: %s.\n", strerror (errno));
-        return EXIT_FAILURE;
+        psg_tone_low [channel] = known ? 0 : -1;
+        psg_tone_high [channel] = known ? 0 : -1;
     }
 
-    struct termios2 uart_attributes;
-    if (ioctl (uart_fd, TCGETS2, &uart_attributes) == -1)
+    for (uint8_t channel = 0; channel < 4; channel++)
     {
-        fprintf (stderr, "Cannot get uart attributes: %s.\n", strerror (errno));
-        return EXIT_FAILURE;
+        psg_volume [channel] = known ? 0x0f : -1;
     }
 
-    uart_attributes.c_cflag &= CSIZE;
-    uart_attributes.c_cflag |= CS8;         /* 8 */
-    uart_attributes.c_cflag &= ~PARENB;     /* N */
-    uart_attributes.c_cflag &= ~CSTOPB;     /* 1 */
-    uart_attributes.c_cflag &= ~CRTSCTS;    /* Disable flow-control */
-    uart_attributes.c_cflag |= CREAD;       /* Enable reading */
-    uart_attributes.c_cflag |= CLOCAL;      /* Ignore modem lines */
-    uart_attributes.c_cflag &= ~CBAUD;
-    uart_attributes.c_cflag |= CBAUDEX;    /* Use custom baud rate */
-
-    uart_attributes.c_ispeed = 28800;       /* 28.8 k */
-    uart_attributes.c_ospeed = 28800;
+    for (uint8_t addr = 0; addr < 0x40; addr++)
+    {
+        ym2413_regs [addr] = known ? 0 : -1;
+    }
+}
 
-    uart_attributes.c_lflag &= ~ICANON; /* Disable canonical mode */
-    uart_attributes.c_lflag &= ~(ECHO | ECHOE | ECHONL); /* Disable echo */
-    uart_attributes.c_lflag &= ~ISIG;   /* Disable control characters */
 
-    uart_attributes.c_iflag &= ~(IXON | IXOFF | IXANY); /* Disable software flow-control */
-    uart_attributes.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP |
-                                 INLCR |IGNCR | ICRNL); /* Disable handling of special bytes (Rx) */
+/*
+ * Update the state for a PSG write, returning false if it changes nothing.
+ * Noise writes always restart the noise, so they are always kept.
+ */
+static bool psg_state_update (uint8_t data)
+{
+    int16_t latch = (data & 0x80) ? ((data >> 4) & 0x07) : psg_latch;
+    uint8_t channel = latch >> 1;
+    int16_t *reg = NULL;
+    int16_t value;
+    bool changed = (latch != psg_latch) || latch < 0 || latch == 6;
 
-    uart_attributes.c_oflag &= ~(OPOST | ONLCR); /* Disable handling of special bytes (Tx) */
+    psg_latch = latch;
 
-    if (ioctl(uart_fd, TCSETS2, &uart_attributes) == -1)
+    if (latch < 0 || latch == 6)
     {
-        fprintf (stderr, "Cannot set uart attributes: %s.\n", strerror (errno));
-        return EXIT_FAILURE;
+        return true;
+    }
+    else if (latch & 0x01)
+    {
+        reg = &psg_volume [channel];
+        value = data & 0x0f;
+    }
+    else if (data & 0x80)
+    {
+        reg = &psg_tone_low [channel];
+        value = data & 0x0f;
+    }
+    else
+    {
+        reg = &psg_tone_high [channel];
+        value = data & 0x3f;
     }
 
-    /* Send a zero to clear the command latch */
-    uart_write (0x00);
-    uart_write (0x01);
-    usleep (100000);
+    changed |= (*reg != value);
+    *reg = value;
+
+    return changed;
+}
 
 
-    /* Set up signal handling to quiet the chips on exit */
-    signal (SIGINT, sigint_handler);
+/*
+ * Add UART bytes at a time. Bytes at the same time as the
+ * previous event join it, so they are sent with one write.
+ */
+static void event_add (stream_t *stream, uint32_t time, uint8_t command, uint8_t data)
+{
+    if (stream->event_count == 0 || stream->events [stream->event_count - 1].time != time || event_split ||
+        stream->events [stream->event_count - 1].length > UINT16_MAX - 2)
+    {
+        stream->events [stream->event_count].time = time;
+        stream->events [stream->event_count].offset = stream->stream_data_size;
+        stream->events [stream->event_count].length = 0;
+        stream->event_count++;
+        event_split = false;
+    }
 
-    uint8_t command = 0;
-    uint8_t addr = 0;
-    uint8_t data = 0;
+    stream->stream_data [stream->stream_data_size++] = command;
+    stream->stream_data [stream->stream_data_size++] = data;
+    stream->events [stream->event_count - 1].length += 2;
+}
+
+
+/*
+ * Allocate the buffers for a prepared stream.
+ */
+static bool stream_allocate (stream_t *stream, uint32_t count, uint32_t size)
+{
+    stream->events = malloc (count * sizeof (event_t));
+    stream->stream_data = malloc (size);
 
-    if (argc != 2)
+    if (stream->events == NULL || stream->stream_data == NULL)
     {
-        fprintf (stderr, "Error: No VGM file specified.\n");
-        return EXIT_FAILURE;
+        fprintf (stderr, "Error: Unable to allocate memory for the stream.\n");
+        return false;
     }
 
-    buffer = read_vgm (filename);
+    return true;
+}
+
+
+/*
+ * Prepare the stream from a .vgm file. Each register write becomes
+ * the UART bytes for the firmware, timed from the start of the song,
+ * and writes that would not change the chips are dropped.
+ */
+static bool stream_prepare (stream_t *stream, char *filename)
+{
+    uint8_t *buffer = read_vgm (filename);
+    uint32_t vgm_offset = 0;
+    uint32_t time = 0;
 
     if (buffer == NULL)
     {
         /* read_vgm should already have output an error message */
-        return EXIT_FAILURE;
+        return false;
     }
 
     fprintf (stderr, "Version: %x.\n",       * (uint32_t *)(&buffer [0x08]));
@@ -175,12 +309,31 @@ int main (int argc, char **argv)
         vgm_offset = 0x40;
     }
 
-    uint32_t ym2413_count = 0;
+    if (!stream_allocate (stream, EVENT_COUNT_MAX, STREAM_DATA_MAX))
+    {
+        free (buffer);
+        return false;
+    }
+
+    /* Playback starts by resetting the chips */
+    state_reset (true);
+    writes_dropped = 0;
 
     uint32_t i = vgm_offset;
     while (i < SOURCE_SIZE_MAX)
     {
-        command = buffer[i++];
+        if (i == loop_offset)
+        {
+            /* Playback can also arrive here from the end of the song */
+            state_reset (false);
+            stream->loop_index = stream->event_count;
+            stream->loop_time = time;
+            event_split = true;
+        }
+
+        uint8_t command = buffer [i++];
+        uint8_t addr;
+        uint8_t data;
 
         switch (command)
         {
@@ -189,41 +342,46 @@ int main (int argc, char **argv)
             break;
 
         case 0x50: /* PSG Data */
-            if (samples_delay)
+            data = buffer [i++];
+            if (psg_state_update (data))
+            {
+                event_add (stream, time, 0x40, data);
+            }
+            else
             {
-                handle_delay ();
+                writes_dropped++;
             }
-            data = buffer[i++];
-            uart_write (0x40);
-            uart_write (data);
             break;
 
         case 0x51: /* YM2413 */
-            if (samples_delay)
+            addr = buffer [i++] & 0x3f;
+            data = buffer [i++];
+            if (ym2413_regs [addr] != data)
             {
-                handle_delay ();
+                ym2413_regs [addr] = data;
+                event_add (stream, time, 0x80 | addr, data);
+            }
+            else
+            {
+                writes_dropped++;
             }
-            addr = buffer[i++];
-            data = buffer[i++];
-            uart_write (0x80 | addr);
-            uart_write (data);
             break;
 
         case 0x61: /* Wait n 44.1 KHz samples */
-            samples_delay += * (uint16_t *)(&buffer [i]);
+            time += * (uint16_t *)(&buffer [i]);
             i += 2;
             break;
 
         case 0x62: /* Wait 1/60 of a second */
-            samples_delay += 735;
+            time += 735;
             break;
 
         case 0x63: /* Wait 1/50 of a second */
-            samples_delay += 882;
+            time += 882;
             break;
 
-        case 0x66: /* End of sound data - Loop */
-            i = loop_offset;
+        case 0x66: /* End of sound data */
+            i = SOURCE_SIZE_MAX;
             break;
 
         /* 0x7n: Wait n+1 samples */
@@ -231,7 +389,7 @@ int main (int argc, char **argv)
         case 0x74: case 0x75: case 0x76: case 0x77:
         case 0x78: case 0x79: case 0x7a: case 0x7b:
         case 0x7c: case 0x7d: case 0x7e: case 0x7f:
-            samples_delay += 1 + (command & 0x0f);
+            time += 1 + (command & 0x0f);
             break;
 
         case 0xa0: /* AY8910 - Ignore */
@@ -248,5 +406,900 @@ int main (int argc, char **argv)
         }
     }
 
+    stream->end_time = time;
+
+    /* A loop with nothing in it cannot be played */
+    if (stream->loop_index != LOOP_NONE && stream->loop_time == stream->end_time)
+    {
+        stream->loop_index = LOOP_NONE;
+    }
+
+    fprintf (stderr, "Prepared %d events, %d bytes, dropping %d writes that change nothing.\n",
+             stream->event_count, stream->stream_data_size, writes_dropped);
+
     free (buffer);
+    return true;
+}
+
+
+/*
+ * Write a little-endian value to a stream file.
+ */
+static void stream_put (FILE *file, uint32_t value, uint8_t bytes)
+{
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        fputc ((value >> (8 * i)) & 0xff, file);
+    }
+}
+
+
+/*
+ * Read a little-endian value from a stream file.
+ */
+static uint32_t stream_get (FILE *file, uint8_t bytes)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        value |= (uint32_t) (fgetc (file) & 0xff) << (8 * i);
+    }
+
+    return value;
+}
+
+
+/*
+ * Save the prepared stream. The file holds a header, the time and
+ * length of each event, and then the bytes of all events in order.
+ */
+static bool stream_save (stream_t *stream, char *filename)
+{
+    FILE *file = fopen (filename, "wb");
+
+    if (file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", filename);
+        return false;
+    }
+
+    fwrite (stream_magic, 1, 4, file);
+    stream_put (file, stream->event_count, 4);
+    stream_put (file, stream->stream_data_size, 4);
+    stream_put (file, stream->loop_index, 4);
+    stream_put (file, stream->loop_time, 4);
+    stream_put (file, stream->end_time, 4);
+
+    for (uint32_t event = 0; event < stream->event_count; event++)
+    {
+        stream_put (file, stream->events [event].time, 4);
+        stream_put (file, stream->events [event].length, 2);
+    }
+
+    fwrite (stream->stream_data, 1, stream->stream_data_size, file);
+
+    if (fclose (file) != 0)
+    {
+        fprintf (stderr, "Error: Unable to write %s.\n", filename);
+        return false;
+    }
+
+    fprintf (stderr, "Saved %d events to %s.\n", stream->event_count, filename);
+    return true;
+}
+
+
+/*
+ * Load a stream saved by stream_save.
+ */
+static bool stream_load (stream_t *stream, char *filename)
+{
+    FILE *file = fopen (filename, "rb");
+    uint8_t file_magic [4] = { 0 };
+    uint32_t offset = 0;
+
+    if (file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", filename);
+        return false;
+    }
+
+    if (fread (file_magic, 1, 4, file) != 4 || memcmp (file_magic, stream_magic, 4) != 0)
+    {
+        fprintf (stderr, "Error: %s is not a stream file.\n", filename);
+        fclose (file);
+        return false;
+    }
+
+    stream->event_count = stream_get (file, 4);
+    stream->stream_data_size = stream_get (file, 4);
+    stream->loop_index = stream_get (file, 4);
+    stream->loop_time = stream_get (file, 4);
+    stream->end_time = stream_get (file, 4);
+
+    if (stream->event_count > EVENT_COUNT_MAX || stream->stream_data_size > STREAM_DATA_MAX ||
+        (stream->loop_index != LOOP_NONE && stream->loop_index > stream->event_count))
+    {
+        fprintf (stderr, "Error: %s is not a valid stream file.\n", filename);
+        fclose (file);
+        return false;
+    }
+
+    if (!stream_allocate (stream, stream->event_count ? stream->event_count : 1, stream->stream_data_size ? stream->stream_data_size : 1))
+    {
+        fclose (file);
+        return false;
+    }
+
+    for (uint32_t event = 0; event < stream->event_count; event++)
+    {
+        stream->events [event].time = stream_get (file, 4);
+        stream->events [event].length = stream_get (file, 2);
+        stream->events [event].offset = offset;
+        offset += stream->events [event].length;
+    }
+
+    if (offset != stream->stream_data_size || fread (stream->stream_data, 1, stream->stream_data_size, file) != stream->stream_data_size)
+    {
+        fprintf (stderr, "Error: %s is truncated.\n", filename);
+        fclose (file);
+        return false;
+    }
+
+    fclose (file);
+    return true;
+}
+
+
+/*
+ * Apply a group of UART bytes to a chip state.
+ */
+static void chip_state_apply (chip_state_t *state, const uint8_t *data, uint32_t length)
+{
+    for (uint32_t i = 0; i + 1 < length; i += 2)
+    {
+        uint8_t command = data [i];
+        uint8_t value = data [i + 1];
+
+        if (command & 0x80)
+        {
+            state->ym2413_regs [command & 0x3f] = value;
+            continue;
+        }
+
+        if (value & 0x80)
+        {
+            state->psg_latch = (value >> 4) & 0x07;
+        }
+
+        uint8_t channel = state->psg_latch >> 1;
+
+        if (state->psg_latch & 0x01)
+        {
+            state->psg_volume [channel] = value & 0x0f;
+        }
+        else if (channel == 3)
+        {
+            state->psg_noise = value & 0x07;
+        }
+        else if (value & 0x80)
+        {
+            state->psg_tone [channel] = (state->psg_tone [channel] & 0x3f0) | (value & 0x0f);
+        }
+        else
+        {
+            state->psg_tone [channel] = (state->psg_tone [channel] & 0x00f) | ((value & 0x3f) << 4);
+        }
+    }
+}
+
+
+/*
+ * Record the chip state every SNAPSHOT_SECONDS through the first pass
+ * of the song and the first repeat of its loop, with the state as
+ * the firmware's reset leaves it at the start.
+ */
+static bool snapshots_build (stream_t *stream)
+{
+    uint32_t loop_length = (stream->loop_index == LOOP_NONE) ? 0 : stream->end_time - stream->loop_time;
+    uint32_t interval = SNAPSHOT_SECONDS * 44100;
+    chip_state_t state = chip_state_reset;
+    uint32_t event = 0;
+    uint8_t pass = 0;
+
+    stream->snapshot_count = (stream->end_time + loop_length) / interval + 1;
+    stream->snapshots = malloc (stream->snapshot_count * sizeof (snapshot_t));
+
+    if (stream->snapshots == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate memory for the snapshots.\n");
+        return false;
+    }
+
+    for (uint32_t snapshot = 0; snapshot < stream->snapshot_count; snapshot++)
+    {
+        uint64_t time = (uint64_t) snapshot * interval;
+
+        while (true)
+        {
+            if (event == stream->event_count && pass == 0 && loop_length)
+            {
+                event = stream->loop_index;
+                pass = 1;
+            }
+
+            if (event == stream->event_count || stream->events [event].time + pass * loop_length >= time)
+            {
+                break;
+            }
+
+            chip_state_apply (&state, &stream->stream_data [stream->events [event].offset], stream->events [event].length);
+            event++;
+        }
+
+        stream->snapshots [snapshot].event = event;
+        stream->snapshots [snapshot].pass = pass;
+        stream->snapshots [snapshot].state = state;
+    }
+
+    return true;
+}
+
+
+/*
+ * Write a chip state to the UART in one burst. With no previous state,
+ * every register is written, and the YM2413 keys are released first so
+ * that notes start again from the new state. Otherwise, only registers
+ * that differ from the previous state are written. Either way, the PSG
+ * latch is restored last.
+ */
+static void chip_state_write (const chip_state_t *from, const chip_state_t *to)
+{
+    static uint8_t burst [256];
+    uint16_t length = 0;
+    int16_t latch = from ? from->psg_latch : -1;
+
+#define BURST_PSG(data)         burst [length++] = 0x40;            burst [length++] = (data)
+#define BURST_YM2413(addr)      if (from == NULL || from->ym2413_regs [addr] != to->ym2413_regs [addr]) \
+                                { burst [length++] = 0x80 | (addr); burst [length++] = to->ym2413_regs [addr]; }
+
+    if (from == NULL)
+    {
+        for (uint8_t channel = 0; channel < 9; channel++)
+        {
+            burst [length++] = 0x80 | (0x20 + channel);
+            burst [length++] = to->ym2413_regs [0x20 + channel] & ~0x10;
+        }
+        burst [length++] = 0x80 | 0x0e;
+        burst [length++] = to->ym2413_regs [0x0e] & ~0x1f;
+    }
+
+    for (uint8_t addr = 0x00; addr < 0x08; addr++)
+    {
+        BURST_YM2413 (addr);
+    }
+    for (uint8_t channel = 0; channel < 9; channel++)
+    {
+        BURST_YM2413 (0x10 + channel);
+        BURST_YM2413 (0x30 + channel);
+    }
+    BURST_YM2413 (0x0e);
+    for (uint8_t channel = 0; channel < 9; channel++)
+    {
+        BURST_YM2413 (0x20 + channel);
+    }
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        if (from == NULL || from->psg_tone [channel] != to->psg_tone [channel])
+        {
+            BURST_PSG (0x80 | (channel << 5) | (to->psg_tone [channel] & 0x0f));
+            BURST_PSG (to->psg_tone [channel] >> 4);
+            latch = channel << 1;
+        }
+    }
+    for (uint8_t channel = 0; channel < 4; channel++)
+    {
+        if (from == NULL || from->psg_volume [channel] != to->psg_volume [channel])
+        {
+            BURST_PSG (0x90 | (channel << 5) | to->psg_volume [channel]);
+            latch = (channel << 1) | 0x01;
+        }
+    }
+    if (from == NULL || from->psg_noise != to->psg_noise)
+    {
+        BURST_PSG (0xe0 | to->psg_noise);
+        latch = 6;
+    }
+
+    /* Later data bytes go to the latched register. Writing it again
+     * latches it without changing it, other than restarting the noise. */
+    if (latch != to->psg_latch)
+    {
+        uint8_t channel = to->psg_latch >> 1;
+
+        if (to->psg_latch & 0x01)
+        {
+            BURST_PSG (0x90 | (channel << 5) | to->psg_volume [channel]);
+        }
+        else if (channel < 3)
+        {
+            BURST_PSG (0x80 | (channel << 5) | (to->psg_tone [channel] & 0x0f));
+        }
+        else
+        {
+            BURST_PSG (0xe0 | to->psg_noise);
+        }
+    }
+
+#undef BURST_PSG
+#undef BURST_YM2413
+
+    uart_write_buffer (burst, length);
+    chips = *to;
+}
+
+
+/*
+ * Get the length of a song in 44.1 kHz samples, playing the loop
+ * loop_count more times, or UINT64_MAX if it loops forever.
+ */
+static uint64_t stream_length (stream_t *stream)
+{
+    if (stream->loop_index == LOOP_NONE)
+    {
+        return stream->end_time;
+    }
+    else if (loop_count == LOOPS_FOREVER)
+    {
+        return UINT64_MAX;
+    }
+
+    return stream->end_time + (uint64_t) loop_count * (stream->end_time - stream->loop_time);
+}
+
+
+/*
+ * Move playback to a time, in 44.1 kHz samples from the start and
+ * counting repeats of the loop. The state is taken from the nearest
+ * earlier snapshot, with at most SNAPSHOT_SECONDS of events applied
+ * to it, so the time taken does not depend on the position.
+ */
+static void stream_seek (stream_t *stream, uint64_t position, uint32_t *event, uint64_t *time_base)
+{
+    uint32_t loop_length = (stream->loop_index == LOOP_NONE) ? 0 : stream->end_time - stream->loop_time;
+    uint64_t repeats = 0;
+
+    if (position >= stream_length (stream))
+    {
+        /* Past the end of the song */
+        *event = stream->event_count;
+        *time_base = stream_length (stream) - stream->end_time;
+        return;
+    }
+    else if (position >= stream->end_time)
+    {
+        /* Later repeats of the loop are played from the first repeat */
+        repeats = (position - stream->end_time) / loop_length;
+        position -= repeats * loop_length;
+    }
+
+    snapshot_t *snapshot = &stream->snapshots [position / (SNAPSHOT_SECONDS * 44100)];
+    chip_state_t state = snapshot->state;
+    uint32_t next = snapshot->event;
+    uint8_t pass = snapshot->pass;
+
+    while (true)
+    {
+        if (next == stream->event_count && pass == 0 && loop_length)
+        {
+            next = stream->loop_index;
+            pass = 1;
+        }
+
+        if (next == stream->event_count || stream->events [next].time + pass * loop_length >= position)
+        {
+            break;
+        }
+
+        chip_state_apply (&state, &stream->stream_data [stream->events [next].offset], stream->events [next].length);
+        next++;
+    }
+
+    chip_state_write (NULL, &state);
+
+    *event = next;
+    *time_base = (repeats + pass) * loop_length;
+}
+
+
+/*
+ * Convert a time in 44.1 kHz samples after the start into a deadline.
+ */
+static struct timespec deadline_get (const struct timespec *start, uint64_t samples)
+{
+    uint64_t ns = samples * 1000000000 / 44100;
+    struct timespec deadline = {
+        .tv_sec = start->tv_sec + ns / 1000000000,
+        .tv_nsec = start->tv_nsec + ns % 1000000000
+    };
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    return deadline;
+}
+
+
+/*
+ * Set the start so that the current time is a position in 44.1 kHz samples.
+ */
+static void position_set (struct timespec *start, uint64_t position)
+{
+    uint64_t ns = position * 1000000000 / 44100;
+
+    clock_gettime (CLOCK_MONOTONIC, start);
+    start->tv_sec -= ns / 1000000000;
+    start->tv_nsec -= ns % 1000000000;
+
+    if (start->tv_nsec < 0)
+    {
+        start->tv_sec--;
+        start->tv_nsec += 1000000000;
+    }
+}
+
+
+/*
+ * Get the current position in 44.1 kHz samples.
+ */
+static uint64_t position_get (const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    int64_t ns = (int64_t) (now.tv_sec - start->tv_sec) * 1000000000 + (now.tv_nsec - start->tv_nsec);
+
+    return (ns > 0) ? (uint64_t) ns * 44100 / 1000000000 : 0;
+}
+
+
+/*
+ * Set up the terminal to read the arrow keys without waiting for enter.
+ */
+static void input_setup (void)
+{
+    struct termios2 attributes;
+
+    if (!isatty (STDIN_FILENO) || ioctl (STDIN_FILENO, TCGETS2, &input_attributes) == -1)
+    {
+        return;
+    }
+
+    attributes = input_attributes;
+    attributes.c_lflag &= ~(ICANON | ECHO);
+    attributes.c_cc [VMIN] = 1;
+    attributes.c_cc [VTIME] = 0;
+
+    if (ioctl (STDIN_FILENO, TCSETS2, &attributes) == 0)
+    {
+        interactive = true;
+        fprintf (stderr, "Use the left and right arrow keys to seek.\n");
+    }
+}
+
+
+/*
+ * Sleep until a time in 44.1 kHz samples after the start, or until an
+ * arrow key is pressed. Returns 1 for right, -1 for left, or 0 once
+ * the time is reached.
+ */
+static int input_wait (const struct timespec *start, uint64_t samples)
+{
+    struct timespec deadline = deadline_get (start, samples);
+
+    if (!interactive)
+    {
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+        return 0;
+    }
+
+    while (true)
+    {
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        struct timespec timeout = {
+            .tv_sec = deadline.tv_sec - now.tv_sec,
+            .tv_nsec = deadline.tv_nsec - now.tv_nsec
+        };
+
+        if (timeout.tv_nsec < 0)
+        {
+            timeout.tv_sec--;
+            timeout.tv_nsec += 1000000000;
+        }
+
+        if (timeout.tv_sec < 0)
+        {
+            return 0;
+        }
+
+        fd_set input;
+        FD_ZERO (&input);
+        FD_SET (STDIN_FILENO, &input);
+
+        if (pselect (STDIN_FILENO + 1, &input, NULL, NULL, &timeout, NULL) <= 0)
+        {
+            continue;
+        }
+
+        /* Arrow keys arrive as ESC [ C and ESC [ D */
+        uint8_t key [8];
+        ssize_t length = read (STDIN_FILENO, key, sizeof (key));
+
+        if (length == 3 && key [0] == 0x1b && key [1] == '[')
+        {
+            if (key [2] == 'C')
+            {
+                return 1;
+            }
+            else if (key [2] == 'D')
+            {
+                return -1;
+            }
+        }
+    }
+}
+
+
+/*
+ * Play the prepared stream from a position in 44.1 kHz samples, with
+ * the start of the song at the given time. Returns with the start
+ * moved to the end of the song, where the next song in a playlist
+ * begins.
+ */
+static void stream_play (stream_t *stream, struct timespec *start, uint64_t position)
+{
+    uint64_t time_base = 0; /* Added to event times for each pass of the loop */
+    uint32_t event = 0;
+
+    if (position > 0)
+    {
+        stream_seek (stream, position, &event, &time_base);
+        position_set (start, position);
+    }
+
+    while (true)
+    {
+        if (event == stream->event_count && time_base + stream->end_time < stream_length (stream))
+        {
+            time_base += stream->end_time - stream->loop_time;
+            event = stream->loop_index;
+            continue;
+        }
+
+        uint64_t time = time_base + ((event == stream->event_count) ? stream->end_time : stream->events [event].time);
+        int seek = input_wait (start, time);
+
+        if (seek != 0)
+        {
+            position = position_get (start);
+            position = (seek < 0 && position < SEEK_SECONDS * 44100) ? 0 : position + seek * SEEK_SECONDS * 44100;
+
+            stream_seek (stream, position, &event, &time_base);
+            position_set (start, position);
+
+            fprintf (stderr, "Position %d:%02d.\n", (int) (position / 44100 / 60), (int) (position / 44100 % 60));
+            continue;
+        }
+
+        if (event == stream->event_count)
+        {
+            *start = deadline_get (start, time);
+            return;
+        }
+
+        uart_write_buffer (&stream->stream_data [stream->events [event].offset], stream->events [event].length);
+        chip_state_apply (&chips, &stream->stream_data [stream->events [event].offset], stream->events [event].length);
+        event++;
+    }
+}
+
+
+/*
+ * Open and configure the UART.
+ */
+static bool uart_open (void)
+{
+    uart_fd = open (uart_device, O_RDWR);
+    if (uart_fd < 0)
+    {
+        fprintf (stderr, "Cannot open %s: %s.\n", uart_device, strerror (errno));
+        return false;
+    }
+
+    struct termios2 uart_attributes;
+    if (ioctl (uart_fd, TCGETS2, &uart_attributes) == -1)
+    {
+        fprintf (stderr, "Cannot get uart attributes: %s.\n", strerror (errno));
+        return false;
+    }
+
+    uart_attributes.c_cflag &= ~CSIZE;
+    uart_attributes.c_cflag |= CS8 | CREAD | CLOCAL;    /* 8, enable reading, ignore modem lines */
+    uart_attributes.c_cflag &= ~PARENB;     /* N */
+    uart_attributes.c_cflag &= ~CSTOPB;     /* 1 */
+    uart_attributes.c_cflag &= ~CRTSCTS;    /* Disable flow-control */
+    uart_attributes.c_cflag &= ~CBAUD;
+    uart_attributes.c_cflag |= CBAUDEX;    /* Use custom baud rate */
+
+    uart_attributes.c_ispeed = 28800;       /* 28.8 k */
+    uart_attributes.c_ospeed = 28800;
+
+    uart_attributes.c_lflag &= ~ICANON; /* Disable canonical mode */
+    uart_attributes.c_lflag &= ~(ECHO | ECHOE | ECHONL); /* Disable echo */
+    uart_attributes.c_lflag &= ~ISIG;   /* Disable control characters */
+
+    uart_attributes.c_iflag &= ~(IXON | IXOFF | IXANY); /* Disable software flow-control */
+    uart_attributes.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP |
+                                 INLCR |IGNCR | ICRNL); /* Disable handling of special bytes (Rx) */
+
+    uart_attributes.c_oflag &= ~(OPOST | ONLCR); /* Disable handling of special bytes (Tx) */
+
+    if (ioctl(uart_fd, TCSETS2, &uart_attributes) == -1)
+    {
+        fprintf (stderr, "Cannot set uart attributes: %s.\n", strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * True if the file starts with the magic bytes of a saved stream.
+ */
+static bool stream_file_check (char *filename)
+{
+    FILE *file = fopen (filename, "rb");
+    uint8_t file_magic [4] = { 0 };
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    bool match = fread (file_magic, 1, 4, file) == 4 && memcmp (file_magic, stream_magic, 4) == 0;
+    fclose (file);
+
+    return match;
+}
+
+
+/*
+ * Free a stream and its buffers.
+ */
+static void stream_free (stream_t *stream)
+{
+    if (stream != NULL)
+    {
+        free (stream->events);
+        free (stream->stream_data);
+        free (stream->snapshots);
+        free (stream);
+    }
+}
+
+
+/*
+ * Prepare a .vgm file, or load a saved stream, ready to play.
+ * Returns NULL on failure.
+ */
+static stream_t *stream_create (char *filename)
+{
+    stream_t *stream = calloc (1, sizeof (stream_t));
+
+    if (stream == NULL)
+    {
+        fprintf (stderr, "Error: Unable to allocate memory for the stream.\n");
+        return NULL;
+    }
+
+    stream->loop_index = LOOP_NONE;
+
+    /* Saved streams are played as they are */
+    if ((stream_file_check (filename) ? !stream_load (stream, filename) : !stream_prepare (stream, filename)) ||
+        !snapshots_build (stream))
+    {
+        stream_free (stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+
+/*
+ * Prepare the next song of a playlist in the background.
+ */
+static void *prefetch_run (void *filename)
+{
+    return stream_create (filename);
+}
+
+
+/*
+ * Entry point.
+ *
+ * Each .vgm file is first prepared into a stream of timed UART
+ * writes, which is then either saved or played. Several files
+ * are played one after another as a playlist.
+ */
+int main (int argc, char **argv)
+{
+    char *filenames [argc];
+    int file_count = 0;
+    char *save_filename = NULL;
+    double start_seconds = 0;
+    bool loops_set = false;
+    int result = EXIT_SUCCESS;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp (argv [arg], "--save") == 0 && arg + 1 < argc)
+        {
+            /* Save the prepared stream instead of playing it */
+            save_filename = argv [++arg];
+        }
+        else if (strcmp (argv [arg], "--start") == 0 && arg + 1 < argc)
+        {
+            /* Start playing part-way through the song */
+            start_seconds = strtod (argv [++arg], NULL);
+        }
+        else if (strcmp (argv [arg], "--loops") == 0 && arg + 1 < argc)
+        {
+            /* Repeat the loop of each song this many times */
+            char *end;
+            long loops = strtol (argv [++arg], &end, 10);
+
+            if (*end != '\0' || end == argv [arg] || loops < 0 || loops >= LOOPS_FOREVER)
+            {
+                fprintf (stderr, "Error: Invalid loop count %s.\n", argv [arg]);
+                fprintf (stderr, USAGE);
+                return EXIT_FAILURE;
+            }
+
+            loop_count = loops;
+            loops_set = true;
+        }
+        else if (strcmp (argv [arg], "--device") == 0 && arg + 1 < argc)
+        {
+            /* Use another UART, or vgm_uart_sim */
+            uart_device = argv [++arg];
+        }
+        else if (argv [arg][0] == '-')
+        {
+            fprintf (stderr, "Error: Unknown option %s.\n", argv [arg]);
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            filenames [file_count++] = argv [arg];
+        }
+    }
+
+    if (file_count == 0)
+    {
+        fprintf (stderr, "Error: No VGM file specified.\n");
+        fprintf (stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    if (save_filename != NULL && file_count > 1)
+    {
+        fprintf (stderr, "Error: Only one file can be saved at a time.\n");
+        return EXIT_FAILURE;
+    }
+
+    stream_t *stream = stream_create (filenames [0]);
+    if (stream == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (save_filename != NULL)
+    {
+        result = stream_save (stream, save_filename) ? EXIT_SUCCESS : EXIT_FAILURE;
+        stream_free (stream);
+        return result;
+    }
+
+    /* Songs in a playlist need to end */
+    if (file_count > 1 && !loops_set)
+    {
+        loop_count = LOOPS_PLAYLIST;
+    }
+
+    /* Serial I/O */
+    if (!uart_open ())
+    {
+        stream_free (stream);
+        return EXIT_FAILURE;
+    }
+
+    /* Send a zero to clear the command latch */
+    uart_write (0x00);
+    uart_write (0x01);
+    usleep (100000);
+    chips = chip_state_reset;
+
+
+    /* Set up signal handling to quiet the chips on exit */
+    signal (SIGINT, sigint_handler);
+
+    input_setup ();
+
+    struct timespec start;
+    position_set (&start, 0);
+
+    /* While each song plays, the next one is prepared on another thread.
+     * It then starts at the exact time the previous song ends, with only
+     * the registers that differ from the reset state written between. */
+    for (int song = 0; stream != NULL; song++)
+    {
+        pthread_t prefetch;
+        bool prefetching = (song + 1 < file_count) &&
+                           pthread_create (&prefetch, NULL, prefetch_run, filenames [song + 1]) == 0;
+
+        if (song > 0)
+        {
+            fprintf (stderr, "Playing %s.\n", filenames [song]);
+        }
+
+        stream_play (stream, &start, (song == 0 && start_seconds > 0) ? start_seconds * 44100 : 0);
+        stream_free (stream);
+        stream = NULL;
+
+        if (song + 1 == file_count)
+        {
+            break;
+        }
+
+        if (prefetching)
+        {
+            pthread_join (prefetch, (void **) &stream);
+        }
+        else
+        {
+            stream = stream_create (filenames [song + 1]);
+        }
+
+        if (stream == NULL)
+        {
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        /* Allow for scheduling, but do not rush to catch up if the song was late */
+        if (position_get (&start) > 441)
+        {
+            fprintf (stderr, "Warning: %s was not ready in time.\n", filenames [song + 1]);
+            position_set (&start, 0);
+        }
+
+        chip_state_write (&chips, &chip_state_reset);
+    }
+
+    input_restore ();
+
+    /* Quiet the chips once the last song has finished */
+    uart_write (0x00);
+    uart_write (0x01);
+
+    return result;
 }
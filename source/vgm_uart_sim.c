@@ -0,0 +1,332 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+/* The firmware, built for the host with its UART Rx interrupt */
+#define HOST_BUILD
+#define UART_BUILD
+#include "main.c"
+
+/* Timing of the firmware, in µs */
+#define UART_BAUD           (F_CPU / (8.0 * (30 + 1)))  /* U2X, with UBRRL = 30 */
+#define UART_BYTE_US        (10 * 1000000.0 / UART_BAUD) /* Start, eight data bits, stop */
+#define UART_BUFFER_SIZE    3                           /* Two in the Rx buffer, one in the shift register */
+#define ISR_ENTRY_US        (30 * 1000000.0 / F_CPU)    /* Vector, and saving registers */
+#define ISR_EXIT_US         (30 * 1000000.0 / F_CPU)    /* Restoring registers, and reti */
+#define PSG_WRITE_US        10
+#define YM2413_WRITE_US     80
+
+/* Simulated time, from the arrival of the first byte */
+static double sim_time = 0;
+static double isr_free = 0;                             /* When the Rx interrupt can next run */
+static double isr_start [UART_BUFFER_SIZE] = { 0 };     /* Of the most recent bytes */
+static double wire_end = 0;                             /* When the last byte was received */
+
+/* Statistics */
+static uint32_t bytes_received = 0;
+static uint32_t psg_writes = 0;
+static uint32_t ym2413_writes = 0;
+static uint32_t resets = 0;
+static uint32_t overruns = 0;
+static double isr_busy = 0;
+static double latency_sum = 0;
+static double latency_square_sum = 0;
+static double latency_max = 0;
+static uint32_t latency_count = 0;
+
+/* State tracking */
+static int pty_fd = -1;
+static FILE *log_file = NULL;
+static char *link_name = NULL;
+
+
+/*
+ * Count time spent in a delay.
+ */
+void sim_delay_us (uint32_t us)
+{
+    sim_time += us;
+}
+
+
+/*
+ * Log a PSG write, taking ~10 µs as on the hardware.
+ */
+void sn76489_write (uint8_t data)
+{
+    fprintf (log_file, "%.6f psg %02x\n", sim_time / 1000000, data);
+    sim_time += PSG_WRITE_US;
+    psg_writes++;
+}
+
+
+/*
+ * Log a YM2413 write, taking ~80 µs as on the hardware.
+ */
+void ym2413_write (uint8_t addr, uint8_t data)
+{
+    fprintf (log_file, "%.6f ym2413 %02x %02x\n", sim_time / 1000000, addr, data);
+    sim_time += YM2413_WRITE_US;
+    ym2413_writes++;
+}
+
+
+/*
+ * Pass one byte through the UART to the firmware. The byte is sent
+ * once the previous one is on the wire, and the Rx interrupt runs once
+ * it is received and the previous interrupt has returned. Bytes that
+ * arrive with the receiver's buffer full are lost, as an overrun.
+ */
+static void byte_receive (uint8_t data, double arrival)
+{
+    wire_end = ((arrival > wire_end) ? arrival : wire_end) + UART_BYTE_US;
+    bytes_received++;
+
+    /* Bytes still waiting for the interrupt */
+    uint8_t waiting = 0;
+    for (uint8_t i = 0; i < UART_BUFFER_SIZE; i++)
+    {
+        if (isr_start [i] > wire_end)
+        {
+            waiting++;
+        }
+    }
+
+    if (waiting == UART_BUFFER_SIZE)
+    {
+        fprintf (log_file, "%.6f overrun %02x\n", wire_end / 1000000, data);
+        overruns++;
+        return;
+    }
+
+    double start = (wire_end > isr_free) ? wire_end : isr_free;
+    memmove (&isr_start [1], &isr_start [0], (UART_BUFFER_SIZE - 1) * sizeof (double));
+    isr_start [0] = start;
+
+    /* As in the Rx interrupt, a reset is a 0x01 while no command is
+     * latched, and 0x00 leaves the command unlatched */
+    static bool command_latched = false;
+    if (!command_latched && data == 0x01)
+    {
+        fprintf (log_file, "%.6f reset\n", (start + ISR_ENTRY_US) / 1000000);
+        resets++;
+    }
+    else
+    {
+        command_latched = !command_latched && data != 0x00;
+    }
+
+    sim_time = start + ISR_ENTRY_US;
+    UDR = data;
+    USART_RXC_vect ();
+    isr_free = sim_time + ISR_EXIT_US;
+    isr_busy += isr_free - start;
+
+    /* Latency from the host writing the byte to the firmware acting on it */
+    double latency = isr_free - arrival;
+    latency_sum += latency;
+    latency_square_sum += latency * latency;
+    latency_count++;
+
+    if (latency > latency_max)
+    {
+        latency_max = latency;
+    }
+}
+
+
+/*
+ * Print the statistics, and remove the link to the pty.
+ */
+static void summary_print (void)
+{
+    double seconds = isr_free / 1000000;
+
+    if (link_name != NULL)
+    {
+        unlink (link_name);
+    }
+
+    fflush (log_file);
+
+    if (bytes_received == 0)
+    {
+        fprintf (stderr, "No bytes received.\n");
+        return;
+    }
+
+    double latency_mean = latency_sum / latency_count;
+    double latency_variance = latency_square_sum / latency_count - latency_mean * latency_mean;
+
+    fprintf (stderr, "Received %d bytes in %.3f s, %.0f bytes/s, %.1f%% of the line rate.\n",
+             bytes_received, seconds, bytes_received / seconds,
+             100.0 * bytes_received * UART_BYTE_US / isr_free);
+    fprintf (stderr, "Writes: %d PSG, %d YM2413, %d resets.\n", psg_writes, ym2413_writes, resets);
+    fprintf (stderr, "Latency from the host to the chips: mean %.3f ms, max %.3f ms, jitter %.3f ms.\n",
+             latency_mean / 1000, latency_max / 1000, sqrt (latency_variance > 0 ? latency_variance : 0) / 1000);
+    fprintf (stderr, "Rx interrupt busy %.1f%% of the time, %d overruns.\n",
+             100.0 * isr_busy / isr_free, overruns);
+}
+
+
+/*
+ * Report the statistics when interrupted.
+ */
+void sigint_handler (int dummy)
+{
+    (void) dummy;
+
+    summary_print ();
+    exit (0);
+}
+
+
+/*
+ * Open a pty for the player to use in place of the UART. Returns the
+ * slave, which is held open until the player connects.
+ */
+static int pty_open (void)
+{
+    char slave_name [32];
+    int unlock = 0;
+    int index;
+
+    pty_fd = open ("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if (pty_fd < 0 || ioctl (pty_fd, TIOCSPTLCK, &unlock) == -1 || ioctl (pty_fd, TIOCGPTN, &index) == -1)
+    {
+        fprintf (stderr, "Cannot open a pty: %s.\n", strerror (errno));
+        return -1;
+    }
+
+    snprintf (slave_name, sizeof (slave_name), "/dev/pts/%d", index);
+
+    int slave_fd = open (slave_name, O_RDWR | O_NOCTTY);
+    if (slave_fd < 0)
+    {
+        fprintf (stderr, "Cannot open %s: %s.\n", slave_name, strerror (errno));
+        return -1;
+    }
+
+    /* Pass bytes through unchanged */
+    struct termios2 attributes;
+    if (ioctl (slave_fd, TCGETS2, &attributes) == 0)
+    {
+        attributes.c_iflag &= ~(IXON | IXOFF | IXANY | IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
+        attributes.c_oflag &= ~(OPOST | ONLCR);
+        attributes.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG);
+        ioctl (slave_fd, TCSETS2, &attributes);
+    }
+
+    if (link_name != NULL)
+    {
+        unlink (link_name);
+        if (symlink (slave_name, link_name) == -1)
+        {
+            fprintf (stderr, "Cannot link %s: %s.\n", link_name, strerror (errno));
+            return -1;
+        }
+        fprintf (stderr, "Simulating the firmware on %s, linked from %s.\n", slave_name, link_name);
+    }
+    else
+    {
+        fprintf (stderr, "Simulating the firmware on %s.\n", slave_name);
+    }
+
+    return slave_fd;
+}
+
+
+/*
+ * Entry point.
+ *
+ * Stands in for a UART_BUILD of the firmware, on a pty that
+ * vgm_uart_play can use with --device. Each byte is paced to the
+ * baud rate and passed to the firmware's own Rx interrupt, and the
+ * chip writes are logged with the time they would happen on the
+ * hardware. Statistics are printed once the player disconnects.
+ */
+int main (int argc, char **argv)
+{
+    char *log_filename = NULL;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp (argv [arg], "--log") == 0 && arg + 1 < argc)
+        {
+            /* Write the timeline to a file instead of stdout */
+            log_filename = argv [++arg];
+        }
+        else if (strcmp (argv [arg], "--link") == 0 && arg + 1 < argc)
+        {
+            /* Make the pty available at a known path */
+            link_name = argv [++arg];
+        }
+        else
+        {
+            fprintf (stderr, "Usage: vgm_uart_sim [--log <file>] [--link <path>]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    log_file = stdout;
+    if (log_filename != NULL && (log_file = fopen (log_filename, "w")) == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s for writing.\n", log_filename);
+        return EXIT_FAILURE;
+    }
+
+    int slave_fd = pty_open ();
+    if (slave_fd < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    signal (SIGINT, sigint_handler);
+
+    struct timespec first = { 0 };
+    uint8_t buffer [256];
+    ssize_t length;
+
+    /* Reads fail once the player closes the pty */
+    while ((length = read (pty_fd, buffer, sizeof (buffer))) > 0)
+    {
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        if (bytes_received == 0)
+        {
+            first = now;
+
+            /* The player has connected */
+            close (slave_fd);
+        }
+
+        double arrival = (now.tv_sec - first.tv_sec) * 1000000.0 + (now.tv_nsec - first.tv_nsec) / 1000.0;
+
+        for (ssize_t i = 0; i < length; i++)
+        {
+            byte_receive (buffer [i], arrival);
+        }
+    }
+
+    summary_print ();
+
+    close (pty_fd);
+    if (log_file != stdout)
+    {
+        fclose (log_file);
+    }
+
+    return EXIT_SUCCESS;
+}